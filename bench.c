@@ -0,0 +1,1183 @@
+/*
+microbenchmarks of the playback hot paths
+
+synthetic wavs of every supported bit depth (8, 16, 24) and a few
+channel counts are written to a temporary directory, then each stage is
+timed on them:
+
+- exact: not timed, every conversion kernel the cpu supports must give
+  the same samples as convert_wav_to_32() for any length, without
+  reading or writing past either end, fails (exit status 1) otherwise
+- convert: every conversion kernel the cpu supports, plus the scalar
+  reference convert_wav_to_32(), tick by tick over the mapped data chunk
+- gain: gain_apply() at a constant gain
+- loudness: the loudness meter (k-weighting, gating, true peak)
+- waveform: the min/max/rms pyramid build (block kernel and levels)
+- resample: every quality level, for a few common ratios
+- probe: the header parse the scanner does per file (read_wav_header_at)
+- read: read_wav_from_filename(), headers and the whole data chunk
+- pipeline: a whole track through the real engine (decode thread, ring,
+  output thread, play_wav_player_tick()) into the null output, which
+  takes frames as fast as they come, so no sound card is needed
+- realtime: the pipeline with a real-time output thread (see realtime.h),
+  fails (exit status 1) if that thread called the allocator once it ran
+
+every measurement runs once to warm up (page cache, kernel pick, first
+touch of the buffers), then reps times, and the median is reported in
+ns per item (frame or file) and MB/s of input. -j prints one json object
+per line instead of the table, tagged with $BENCH_REV (make bench sets
+it to the git commit), so runs of two commits can be diffed
+*/
+
+#include "types.h"
+#include "fd_handle.h"
+#include "sound_engine.h"
+#include "cli_interface.h"
+#include "convert.h"
+#include "gain.h"
+#include "resample.h"
+#include "loudness.h"
+#include "waveform.h"
+#include "prefetch.h"
+#include "scanner.h"
+#include "output.h"
+#include "readahead.h"
+#include "realtime.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define BENCH_RATE 44100
+#define BENCH_SECONDS 10 // length of every synthetic file (-s)
+#define BENCH_REPS 5 // timed runs per measurement (-r)
+#define BENCH_MAX_REPS 100
+#define BENCH_RT_PRIORITY 10 // of the realtime stage's output thread
+#define EXACT_MAX_SAMPLES 256 // lengths the exact stage checks, 0 to this
+#define EXACT_GUARD 16 // samples past the end no kernel may write
+
+static const int bench_bits[] = { 8, 16, 24 };
+static const int bench_channels[] = { 1, 2, 6 };
+
+#define BENCH_BITS (sizeof(bench_bits) / sizeof(bench_bits[0]))
+#define BENCH_CHANNELS (sizeof(bench_channels) / sizeof(bench_channels[0]))
+
+static const unsigned int resample_ratios[][2] = {
+	{ 44100, 48000 },
+	{ 48000, 44100 },
+	{ 96000, 48000 },
+};
+
+struct bench {
+	int reps;
+	int json;
+	size_t frames; // per synthetic file
+	const char* rev; // $BENCH_REV, tags json results (e.g. a commit)
+	char dir[PATH_MAX_LENGTH / 2];
+	char files[BENCH_BITS][BENCH_CHANNELS][PATH_MAX_LENGTH];
+	int failed; // a check (not a timing) failed, exit status 1
+};
+
+// one measured run: items processed, bytes read
+typedef int (*bench_fn)(void* arg, size_t* items, size_t* bytes);
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report
+(
+	const struct bench* b,
+	const char* stage,
+	const char* variant,
+	const char* unit,
+	size_t items,
+	size_t bytes,
+	double median_ns,
+	double min_ns
+)
+{
+	double per_item = items ? median_ns / items : 0.0;
+	double best = items ? min_ns / items : 0.0;
+	double mb_per_s = median_ns > 0.0 ? bytes / (median_ns / 1e9) / (1024.0 * 1024.0) : 0.0;
+
+	if (b->json) {
+		printf("{\"rev\":\"%s\",\"stage\":\"%s\",\"variant\":\"%s\",\"unit\":\"%s\","
+			"\"items\":%zu,\"bytes\":%zu,\"reps\":%d,"
+			"\"ns_per_item\":%.3f,\"min_ns_per_item\":%.3f,\"mb_per_s\":%.2f}\n",
+			b->rev, stage, variant, unit, items, bytes, b->reps,
+			per_item, best, mb_per_s);
+	} else {
+		printf("%-10s %-28s %12.3f ns/%-5s %10.2f MB/s\n",
+			stage, variant, per_item, unit, mb_per_s);
+	}
+
+	fflush(stdout);
+}
+
+// warms up, then times reps runs of fn
+static void measure
+(
+	const struct bench* b,
+	const char* stage,
+	const char* variant,
+	const char* unit,
+	bench_fn fn,
+	void* arg
+)
+{
+	double times[BENCH_MAX_REPS];
+	size_t items = 0;
+	size_t bytes = 0;
+
+	if (fn(arg, &items, &bytes) < 0) {
+		fprintf(stderr, "%s %s failed\n", stage, variant);
+		return;
+	}
+
+	for (int i = 0; i < b->reps; i++) {
+		double start = now_ns();
+
+		fn(arg, &items, &bytes);
+		times[i] = now_ns() - start;
+	}
+
+	qsort(times, b->reps, sizeof(double), compare_double);
+	report(b, stage, variant, unit, items, bytes, times[b->reps / 2], times[0]);
+}
+
+/* --- ALLOCATIONS --- */
+
+// the realtime stage counts the allocator calls of the playback
+// threads: malloc and friends are replaced here and call glibc's own
+// (not under a sanitizer, which replaces them itself)
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define COUNT_ALLOCS 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+extern void __libc_free(void* p);
+
+static atomic_int watching;
+static pthread_t watched[2]; // the output thread and the decoder
+static size_t watched_len;
+static atomic_size_t watched_allocs[2];
+
+static void count_alloc(void) {
+	if (!atomic_load_explicit(&watching, memory_order_acquire)) {
+		return;
+	}
+
+	pthread_t self = pthread_self();
+
+	for (size_t i = 0; i < watched_len; i++) {
+		if (pthread_equal(self, watched[i])) {
+			atomic_fetch_add_explicit(&watched_allocs[i], 1, memory_order_relaxed);
+		}
+	}
+}
+
+void* malloc(size_t size) {
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+	count_alloc();
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+	count_alloc();
+	return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+	if (p) {
+		count_alloc();
+	}
+
+	__libc_free(p);
+}
+
+void* memalign(size_t align, size_t size) {
+	count_alloc();
+	return __libc_memalign(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+	count_alloc();
+	return __libc_memalign(align, size);
+}
+
+int posix_memalign(void** p, size_t align, size_t size) {
+	count_alloc();
+	*p = __libc_memalign(align, size);
+
+	return *p ? 0 : ENOMEM;
+}
+
+#endif
+
+/* --- SYNTHETIC FILES --- */
+
+// deterministic noise at half scale, so no stage can skip work on
+// silence or constant samples
+static uint32_t noise(uint32_t* seed) {
+	*seed = *seed * 1664525u + 1013904223u;
+	return *seed;
+}
+
+static int write_synthetic
+(
+	const char* path,
+	int bits,
+	int channels,
+	unsigned int rate,
+	size_t frames
+)
+{
+	size_t frame_size = channels * bits / 8;
+	size_t data_len = frames * frame_size;
+	struct riff_header riff = { {'R','I','F','F'}, 0, {'W','A','V','E'} };
+	struct fmt_sub_chunk fmt = { {'f','m','t',' '}, 16, 1, channels, rate,
+		rate * frame_size, frame_size, bits };
+	struct data_sub_chunk data = { {'d','a','t','a'}, data_len };
+	uint8_t* buf = malloc(data_len);
+	uint32_t seed = bits * 31 + channels;
+
+	if (!buf) {
+		return -1;
+	}
+
+	riff.chunk_size = 4 + sizeof(fmt) + sizeof(data) + data_len;
+
+	for (size_t i = 0; i < frames * channels; i++) {
+		int32_t v = (int32_t) noise(&seed) >> 1;
+		uint8_t* p = buf + i * (bits / 8);
+
+		if (bits == 8) {
+			p[0] = (uint8_t) ((v >> 24) + 128);
+		} else if (bits == 16) {
+			p[0] = v >> 16;
+			p[1] = v >> 24;
+		} else {
+			p[0] = v >> 8;
+			p[1] = v >> 16;
+			p[2] = v >> 24;
+		}
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int ret = -1;
+
+	if (fd >= 0 &&
+		write_bytes_to_file(fd, &riff, sizeof(riff)) == sizeof(riff) &&
+		write_bytes_to_file(fd, &fmt, sizeof(fmt)) == sizeof(fmt) &&
+		write_bytes_to_file(fd, &data, sizeof(data)) == sizeof(data) &&
+		write_bytes_to_file(fd, buf, data_len) == (ssize_t) data_len) {
+		ret = 0;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int make_files(struct bench* b) {
+	const char* tmp = getenv("TMPDIR");
+
+	if (snprintf(b->dir, sizeof(b->dir), "%s/wav_bench.XXXXXX",
+		tmp ? tmp : "/tmp") >= (int) sizeof(b->dir)) {
+		fprintf(stderr, "TMPDIR is too long\n");
+		return -1;
+	}
+
+	if (!mkdtemp(b->dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	for (size_t i = 0; i < BENCH_BITS; i++) {
+		for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+			char* path = b->files[i][j];
+
+			snprintf(path, PATH_MAX_LENGTH, "%s/%dbit_%dch.wav", b->dir,
+				bench_bits[i], bench_channels[j]);
+
+			if (write_synthetic(path, bench_bits[i], bench_channels[j],
+				BENCH_RATE, b->frames) < 0) {
+				fprintf(stderr, "writing %s failed\n", path);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void remove_files(struct bench* b) {
+	for (size_t i = 0; i < BENCH_BITS; i++) {
+		for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+			unlink(b->files[i][j]);
+		}
+	}
+
+	rmdir(b->dir);
+}
+
+/* --- STAGES --- */
+
+// a mapped synthetic file and a tick sized output buffer
+struct stream_arg {
+	struct wav_stream stream;
+	struct fmt_sub_chunk fmt;
+	size_t frames;
+	const struct convert_kernel* kernel; // NULL: convert_wav_to_32()
+	struct gain_stage gain;
+	const struct resample_bank* bank;
+	struct resampler* rs;
+	struct loudness_meter* meter;
+	struct waveform* wf;
+	int32_t out[FRAMES_PER_TICK * MAX_CHANNELS];
+	int32_t in[FRAMES_PER_TICK * MAX_CHANNELS];
+};
+
+static int stream_open(struct stream_arg* a, const char* path) {
+	struct wav_info info = {0};
+
+	if (wav_stream_open(path, &info, &a->stream) < 0) {
+		return -1;
+	}
+
+	a->fmt = info.fmt;
+	a->frames = a->stream.data_len / a->stream.frame_size;
+
+	return 0;
+}
+
+static int run_convert(void* arg, size_t* items, size_t* bytes) {
+	struct stream_arg* a = arg;
+	size_t channels = a->fmt.num_channels;
+
+	for (size_t f = 0; f < a->frames; f += FRAMES_PER_TICK) {
+		const uint8_t* src;
+		size_t n = wav_stream_frames(&a->stream, f, FRAMES_PER_TICK, &src);
+
+		if (a->kernel) {
+			a->kernel->fn(src, a->out, n * channels);
+		} else if (convert_wav_to_32(&a->fmt, src, a->out, n) < 0) {
+			return -1;
+		}
+	}
+
+	*items = a->frames;
+	*bytes = a->stream.data_len;
+
+	return 0;
+}
+
+static void bench_convert(const struct bench* b) {
+	const struct convert_kernel* kernels;
+	size_t count = convert_kernels(&kernels);
+	struct stream_arg* a = calloc(1, sizeof(*a));
+
+	if (!a) {
+		return;
+	}
+
+	for (size_t i = 0; i < BENCH_BITS; i++) {
+		for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+			char variant[64];
+
+			if (stream_open(a, b->files[i][j]) < 0) {
+				continue;
+			}
+
+			// the scalar reference first, then every kernel for this depth
+			for (size_t k = 0; k <= count; k++) {
+				a->kernel = k ? &kernels[k - 1] : NULL;
+
+				if (a->kernel && (a->kernel->bits != bench_bits[i] ||
+					!a->kernel->supported())) {
+					continue;
+				}
+
+				snprintf(variant, sizeof(variant), "%s/%dbit/%dch",
+					a->kernel ? a->kernel->name : "reference",
+					bench_bits[i], bench_channels[j]);
+				measure(b, "convert", variant, "frame", run_convert, a);
+			}
+
+			wav_stream_close(&a->stream);
+		}
+	}
+
+	free(a);
+}
+
+// every kernel against convert_wav_to_32(), for every length up to
+// EXACT_MAX_SAMPLES, so every tail their vector loops leave. fails on
+// any sample that differs or a write past the last one. the source
+// ends right before an unmapped page, a read past it faults
+static void bench_exact(struct bench* b) {
+	const struct convert_kernel* kernels;
+	size_t count = convert_kernels(&kernels);
+	long page = sysconf(_SC_PAGESIZE);
+	uint8_t src[EXACT_MAX_SAMPLES * 3];
+	int32_t want[EXACT_MAX_SAMPLES + EXACT_GUARD];
+	int32_t got[EXACT_MAX_SAMPLES + EXACT_GUARD];
+	uint32_t seed = 1;
+
+	if (page < (long) sizeof(src)) {
+		return;
+	}
+
+	uint8_t* map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "exact: mapping the source failed\n");
+		b->failed = 1;
+		return;
+	}
+
+	if (mprotect(map + page, page, PROT_NONE) < 0) {
+		fprintf(stderr, "exact: protecting the guard page failed\n");
+		munmap(map, 2 * page);
+		b->failed = 1;
+		return;
+	}
+
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = noise(&seed) >> 24;
+	}
+
+	// full scale of every depth first: 24-bit min and max, 16-bit min,
+	// -1 and max, 8-bit 0, 128 and 255
+	static const uint8_t extremes[] = { 0x00, 0x00, 0x80, 0xff, 0xff, 0x7f };
+	memcpy(src, extremes, sizeof(extremes));
+
+	for (size_t k = 0; k < count; k++) {
+		const struct convert_kernel* kernel = &kernels[k];
+		struct fmt_sub_chunk fmt = { .num_channels = 1, .bits_per_sample = kernel->bits };
+		size_t checked = 0;
+		size_t bad = 0;
+		size_t bad_len = 0;
+		char variant[64];
+
+		if (!kernel->supported()) {
+			continue;
+		}
+
+		for (size_t len = 0; len <= EXACT_MAX_SAMPLES; len++) {
+			size_t bytes = len * kernel->bits / 8;
+			uint8_t* in = map + page - bytes; // also every alignment
+
+			memcpy(in, src, bytes);
+
+			// the guard past len must come back untouched
+			memset(want, 0x5a, sizeof(want));
+			memset(got, 0x5a, sizeof(got));
+
+			convert_wav_to_32(&fmt, in, want, len);
+			kernel->fn(in, got, len);
+			checked++;
+
+			if (memcmp(want, got, (len + EXACT_GUARD) * sizeof(int32_t)) != 0 &&
+				bad++ == 0) {
+				bad_len = len;
+			}
+		}
+
+		snprintf(variant, sizeof(variant), "%s/%dbit", kernel->name, kernel->bits);
+
+		if (b->json) {
+			printf("{\"rev\":\"%s\",\"stage\":\"exact\",\"variant\":\"%s\","
+				"\"checked\":%zu,\"mismatches\":%zu}\n",
+				b->rev, variant, checked, bad);
+		} else if (bad) {
+			printf("%-10s %-28s %zu/%zu lengths differ (first: %zu samples)"
+				"  FAILED\n", "exact", variant, bad, checked, bad_len);
+		} else {
+			printf("%-10s %-28s %zu lengths match the reference\n",
+				"exact", variant, checked);
+		}
+
+		fflush(stdout);
+		b->failed |= bad != 0;
+	}
+
+	munmap(map, 2 * page);
+}
+
+static int run_gain(void* arg, size_t* items, size_t* bytes) {
+	struct stream_arg* a = arg;
+	size_t channels = a->fmt.num_channels;
+
+	for (size_t f = 0; f < a->frames; f += FRAMES_PER_TICK) {
+		size_t n = a->frames - f < FRAMES_PER_TICK ? a->frames - f : FRAMES_PER_TICK;
+
+		gain_apply(&a->gain, a->in, n, channels);
+	}
+
+	*items = a->frames;
+	*bytes = a->frames * channels * sizeof(int32_t);
+
+	return 0;
+}
+
+static void bench_gain(const struct bench* b) {
+	struct stream_arg* a = calloc(1, sizeof(*a));
+
+	if (!a) {
+		return;
+	}
+
+	// the 16-bit files, converted once: gain works on S32 blocks
+	for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+		char variant[64];
+		const uint8_t* src;
+
+		if (stream_open(a, b->files[1][j]) < 0) {
+			continue;
+		}
+
+		size_t n = wav_stream_frames(&a->stream, 0, FRAMES_PER_TICK, &src);
+
+		convert_select(&a->fmt)->fn(src, a->in, n * a->fmt.num_channels);
+		gain_init(&a->gain, 0.5f, a->fmt.sample_rate);
+		snprintf(variant, sizeof(variant), "%dch", bench_channels[j]);
+		measure(b, "gain", variant, "frame", run_gain, a);
+		wav_stream_close(&a->stream);
+	}
+
+	free(a);
+}
+
+static int run_loudness(void* arg, size_t* items, size_t* bytes) {
+	struct stream_arg* a = arg;
+	size_t channels = a->fmt.num_channels;
+	float loudness;
+	float peak;
+
+	if (loudness_meter_init(a->meter, a->fmt.sample_rate, channels) < 0) {
+		return -1;
+	}
+
+	for (size_t f = 0; f < a->frames; f += FRAMES_PER_TICK) {
+		size_t n = a->frames - f < FRAMES_PER_TICK ? a->frames - f : FRAMES_PER_TICK;
+
+		loudness_meter_add(a->meter, a->in, n);
+	}
+
+	loudness_meter_result(a->meter, &loudness, &peak);
+	loudness_meter_free(a->meter);
+
+	*items = a->frames;
+	*bytes = a->frames * channels * sizeof(int32_t);
+
+	return 0;
+}
+
+static void bench_loudness(const struct bench* b) {
+	struct stream_arg* a = calloc(1, sizeof(*a));
+	struct loudness_meter* m = malloc(sizeof(*m));
+
+	if (!a || !m) {
+		free(a);
+		free(m);
+		return;
+	}
+
+	a->meter = m;
+
+	// like gain, one converted tick measured over and over
+	for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+		char variant[64];
+		const uint8_t* src;
+
+		if (stream_open(a, b->files[1][j]) < 0) {
+			continue;
+		}
+
+		size_t n = wav_stream_frames(&a->stream, 0, FRAMES_PER_TICK, &src);
+
+		convert_select(&a->fmt)->fn(src, a->in, n * a->fmt.num_channels);
+		snprintf(variant, sizeof(variant), "%s %dch", loudness_kernel_name(),
+			bench_channels[j]);
+		measure(b, "loudness", variant, "frame", run_loudness, a);
+		wav_stream_close(&a->stream);
+	}
+
+	free(a);
+	free(m);
+}
+
+static int run_waveform(void* arg, size_t* items, size_t* bytes) {
+	struct stream_arg* a = arg;
+	size_t channels = a->fmt.num_channels;
+
+	if (waveform_init(a->wf, a->frames, channels) < 0) {
+		return -1;
+	}
+
+	for (size_t f = 0; f < a->frames; f += FRAMES_PER_TICK) {
+		size_t n = a->frames - f < FRAMES_PER_TICK ? a->frames - f : FRAMES_PER_TICK;
+
+		waveform_add(a->wf, a->in, n);
+	}
+
+	waveform_finish(a->wf);
+	waveform_free(a->wf);
+
+	*items = a->frames;
+	*bytes = a->frames * channels * sizeof(int32_t);
+
+	return 0;
+}
+
+static void bench_waveform(const struct bench* b) {
+	struct stream_arg* a = calloc(1, sizeof(*a));
+	struct waveform* wf = malloc(sizeof(*wf));
+
+	if (!a || !wf) {
+		free(a);
+		free(wf);
+		return;
+	}
+
+	a->wf = wf;
+
+	// like loudness, one converted tick added over and over
+	for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+		char variant[64];
+		const uint8_t* src;
+
+		if (stream_open(a, b->files[1][j]) < 0) {
+			continue;
+		}
+
+		size_t n = wav_stream_frames(&a->stream, 0, FRAMES_PER_TICK, &src);
+
+		convert_select(&a->fmt)->fn(src, a->in, n * a->fmt.num_channels);
+		snprintf(variant, sizeof(variant), "%s %dch", waveform_kernel_name(),
+			bench_channels[j]);
+		measure(b, "waveform", variant, "frame", run_waveform, a);
+		wav_stream_close(&a->stream);
+	}
+
+	free(a);
+	free(wf);
+}
+
+// a whole file through the resampler, tick by tick like the decoder
+static int run_resample(void* arg, size_t* items, size_t* bytes) {
+	struct stream_arg* a = arg;
+	size_t channels = a->fmt.num_channels;
+	size_t total = resample_frames_out(a->bank, a->frames);
+	size_t cursor = 0;
+	size_t done = 0;
+
+	resample_reset(a->rs, a->bank, channels);
+
+	while (done < total) {
+		size_t n = total - done < FRAMES_PER_TICK ? total - done : FRAMES_PER_TICK;
+		size_t got = resample_pull(a->rs, a->out, n);
+
+		done += got;
+
+		if (got == n) {
+			continue;
+		}
+
+		size_t want = resample_wants(a->rs, n - got);
+
+		if (!want) {
+			break;
+		}
+
+		if (want > FRAMES_PER_TICK) {
+			want = FRAMES_PER_TICK;
+		}
+
+		const uint8_t* src;
+		size_t read = wav_stream_frames(&a->stream, cursor, want, &src);
+
+		if (!read) {
+			resample_finish(a->rs);
+			continue;
+		}
+
+		convert_select(&a->fmt)->fn(src, a->in, read * channels);
+		resample_push(a->rs, a->in, read);
+		cursor += read;
+	}
+
+	*items = done;
+	*bytes = a->stream.data_len;
+
+	return done == total ? 0 : -1;
+}
+
+static void bench_resample(const struct bench* b) {
+	size_t levels_len;
+	const struct resample_level* levels = resample_levels(&levels_len);
+	struct stream_arg* a = calloc(1, sizeof(*a));
+	struct resampler* rs = malloc(sizeof(*rs));
+
+	if (!a || !rs) {
+		free(a);
+		free(rs);
+		return;
+	}
+
+	a->rs = rs;
+
+	// the stereo 16-bit file is played back at every input rate, the
+	// samples don't matter, only how many there are
+	if (stream_open(a, b->files[1][1]) < 0) {
+		free(a);
+		free(rs);
+		return;
+	}
+
+	for (size_t r = 0; r < sizeof(resample_ratios) / sizeof(resample_ratios[0]); r++) {
+		for (size_t q = 0; q < levels_len; q++) {
+			char variant[64];
+
+			a->bank = resample_bank_get(resample_ratios[r][0],
+				resample_ratios[r][1], q);
+
+			if (!a->bank) {
+				continue;
+			}
+
+			snprintf(variant, sizeof(variant), "%s/%u-%u/%zutaps/2ch",
+				levels[q].name, resample_ratios[r][0], resample_ratios[r][1],
+				a->bank->taps);
+			measure(b, "resample", variant, "frame", run_resample, a);
+		}
+	}
+
+	wav_stream_close(&a->stream);
+	free(a);
+	free(rs);
+}
+
+struct files_arg {
+	const struct bench* b;
+	int read_data; // read_wav_from_filename() instead of the probe
+};
+
+static int run_files(void* arg, size_t* items, size_t* bytes) {
+	struct files_arg* a = arg;
+	const struct bench* b = a->b;
+
+	*items = 0;
+	*bytes = 0;
+
+	for (size_t i = 0; i < BENCH_BITS; i++) {
+		for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+			const char* path = b->files[i][j];
+
+			if (a->read_data) {
+				struct fmt_sub_chunk fmt;
+				uint8_t* data = NULL;
+				size_t len = 0;
+				int fd = read_wav_from_filename(path, NULL, &fmt, NULL,
+					&data, &len, NULL);
+
+				if (fd < 0) {
+					return -1;
+				}
+
+				close(fd);
+				free(data);
+				*bytes += len;
+			} else {
+				struct wav_info info;
+
+				if (read_wav_header_at(AT_FDCWD, path, &info, NULL) < 0) {
+					return -1;
+				}
+
+				*bytes += info.data_offset; // the headers
+			}
+
+			(*items)++;
+		}
+	}
+
+	return 0;
+}
+
+static void bench_files(const struct bench* b) {
+	struct files_arg a = { b, 0 };
+
+	measure(b, "probe", "read_wav_header_at", "file", run_files, &a);
+
+	a.read_data = 1;
+	measure(b, "read", "read_wav_from_filename", "file", run_files, &a);
+}
+
+// the player, as far as the engine needs it: one track, no library
+struct pipeline_arg {
+	struct player_state st;
+	float gain;
+	unsigned int device_rate;
+	int watch; // count the allocations of the playback threads
+};
+
+static int run_pipeline(void* arg, size_t* items, size_t* bytes) {
+	struct pipeline_arg* a = arg;
+	struct player_state* st = &a->st;
+
+	if (set_current_music(st, 0) < 0) {
+		return -1;
+	}
+
+	st->player_gain = a->gain;
+	st->cursor = 0;
+
+	// nothing follows, the decoder must not wait for a next track
+	prefetch_end(st);
+
+	if (audio_init(st) < 0) {
+		return -1;
+	}
+
+#ifdef COUNT_ALLOCS
+	// from the first tick to the threads' exit: whatever they needed is
+	// allocated before they start
+	if (a->watch) {
+		watched[0] = st->output_thread;
+		watched[1] = st->decode_thread;
+		watched_len = st->decoding ? 2 : 1;
+		atomic_store_explicit(&watching, 1, memory_order_release);
+	}
+#endif
+
+	int ret;
+
+	while ((ret = play_wav_player_tick(st)) == 1) {
+		struct pollfd pfd = { .fd = st->event_fd, .events = POLLIN };
+		uint64_t events;
+
+		if (poll(&pfd, 1, 100) > 0) {
+			ssize_t n = read(st->event_fd, &events, sizeof(events));
+			(void) n;
+		}
+	}
+
+	audio_shutdown(st);
+
+#ifdef COUNT_ALLOCS
+	atomic_store(&watching, 0);
+#endif
+
+	*items = st->pcm_frames;
+	*bytes = st->buf_len;
+
+	return ret == 0 ? 0 : -1;
+}
+
+static int pipeline_init(struct pipeline_arg* a, const char* path) {
+	struct player_state* st = &a->st;
+	char dir[PATH_MAX_LENGTH];
+	struct track t;
+
+	memset(st, 0, sizeof(*st));
+	output_select(&st->out, "null");
+	st->out.format = SND_PCM_FORMAT_UNKNOWN;
+	st->watch.fd = -1;
+	st->resample_quality = RESAMPLE_DEFAULT;
+	playlist_init(&st->playlist);
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	char* slash = strrchr(dir, '/');
+	*slash = '\0';
+
+	if (scan_track(AT_FDCWD, dir, slash + 1, &t) < 0 ||
+		playlist_push(&st->playlist, t) < 0) {
+		playlist_free(&st->playlist);
+		return -1;
+	}
+
+	if (ring_init(&st->ring, RING_FRAMES, MAX_CHANNELS) < 0) {
+		playlist_free(&st->playlist);
+		return -1;
+	}
+
+	if (audio_events_init(st) < 0) {
+		ring_free(&st->ring);
+		playlist_free(&st->playlist);
+		return -1;
+	}
+
+	if (readahead_init(&st->readahead, READAHEAD_DEPTH) < 0) {
+		audio_events_free(st);
+		ring_free(&st->ring);
+		playlist_free(&st->playlist);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void pipeline_free(struct pipeline_arg* a) {
+	struct player_state* st = &a->st;
+
+	prefetch_cancel(st);
+	output_close(&st->out);
+	readahead_free(&st->readahead);
+	wav_stream_close(&st->stream);
+	wav_stream_close(&st->retired);
+	audio_events_free(st);
+	ring_free(&st->ring);
+	playlist_free(&st->playlist);
+}
+
+static void bench_pipeline(const struct bench* b) {
+	// passthrough, conversion (the gain isn't unity) and resampling
+	static const struct {
+		const char* name;
+		float gain;
+		unsigned int device_rate;
+	} paths[] = {
+		{ "passthrough", 1.0f, 0 },
+		{ "convert", 0.5f, 0 },
+		{ "resample", 1.0f, 48000 },
+	};
+
+	struct pipeline_arg* a = malloc(sizeof(*a));
+
+	if (!a) {
+		return;
+	}
+
+	for (size_t i = 0; i < BENCH_BITS; i++) {
+		for (size_t j = 0; j < BENCH_CHANNELS; j++) {
+			for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+				char variant[64];
+
+				if (pipeline_init(a, b->files[i][j]) < 0) {
+					fprintf(stderr, "pipeline setup failed\n");
+					free(a);
+					return;
+				}
+
+				a->gain = paths[p].gain;
+				a->st.device_rate = paths[p].device_rate;
+				snprintf(variant, sizeof(variant), "%s/%dbit/%dch",
+					paths[p].name, bench_bits[i], bench_channels[j]);
+				measure(b, "pipeline", variant, "frame", run_pipeline, a);
+				pipeline_free(a);
+			}
+		}
+	}
+
+	free(a);
+}
+
+// the pipeline on the conversion and resampling paths, the output thread
+// real-time (the same paths as -t), counting what its threads allocate
+static void bench_realtime(struct bench* b) {
+	static const struct {
+		const char* name;
+		float gain;
+		unsigned int device_rate;
+	} paths[] = {
+		{ "convert", 0.5f, 0 },
+		{ "resample", 1.0f, 48000 },
+	};
+
+	struct pipeline_arg* a = malloc(sizeof(*a));
+
+	if (!a) {
+		return;
+	}
+
+	// the 16-bit stereo file, what most libraries are made of
+	for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+		char variant[64];
+
+		if (pipeline_init(a, b->files[1][1]) < 0) {
+			fprintf(stderr, "pipeline setup failed\n");
+			break;
+		}
+
+		a->gain = paths[p].gain;
+		a->watch = 1;
+		a->st.device_rate = paths[p].device_rate;
+		a->st.rt_priority = BENCH_RT_PRIORITY;
+		realtime_lock(&a->st, sizeof(a->st));
+		realtime_lock(a->st.ring.data, a->st.ring.size * MAX_CHANNELS * sizeof(int32_t));
+
+#ifdef COUNT_ALLOCS
+		atomic_store(&watched_allocs[0], 0);
+		atomic_store(&watched_allocs[1], 0);
+#endif
+
+		snprintf(variant, sizeof(variant), "%s/16bit/2ch", paths[p].name);
+		measure(b, "realtime", variant, "frame", run_pipeline, a);
+
+#ifdef COUNT_ALLOCS
+		size_t output = atomic_load(&watched_allocs[0]);
+		size_t decode = atomic_load(&watched_allocs[1]);
+		const char* policy = a->st.output_fifo ? "fifo" : "normal";
+
+		if (b->json) {
+			printf("{\"rev\":\"%s\",\"stage\":\"realtime\",\"variant\":\"%s\","
+				"\"policy\":\"%s\",\"output_allocs\":%zu,\"decode_allocs\":%zu}\n",
+				b->rev, variant, policy, output, decode);
+		} else {
+			printf("%-10s %-28s %s output thread: %zu allocations (decoder: %zu)%s\n",
+				"realtime", variant, policy, output, decode,
+				output ? "  FAILED" : "");
+		}
+
+		b->failed |= output != 0;
+#else
+		if (!b->json) {
+			printf("%-10s %-28s allocations can't be counted in this build\n",
+				"realtime", variant);
+		}
+#endif
+
+		munlock(&a->st, sizeof(a->st));
+		munlock(a->st.ring.data, a->st.ring.size * MAX_CHANNELS * sizeof(int32_t));
+		pipeline_free(a);
+	}
+
+	free(a);
+}
+
+static void print_usage(const char* name) {
+	printf("usage: %s [-j] [-r REPS] [-s SECONDS] [STAGE...]\n", name);
+	printf("stages: exact convert gain loudness waveform resample files pipeline realtime (default: all)\n\n");
+	printf("-j  one json object per result instead of the table\n");
+	printf("-r  timed runs per measurement, the median is reported (default %d)\n",
+		BENCH_REPS);
+	printf("-s  length of the synthetic files in seconds (default %d)\n",
+		BENCH_SECONDS);
+}
+
+static int wanted(int argc, char* const* argv, const char* stage) {
+	if (optind >= argc) {
+		return 1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (strcmp(argv[i], stage) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	struct bench* b = calloc(1, sizeof(*b));
+	int seconds = BENCH_SECONDS;
+	int opt;
+
+	if (!b) {
+		return -1;
+	}
+
+	b->reps = BENCH_REPS;
+	b->rev = getenv("BENCH_REV") ? getenv("BENCH_REV") : "";
+
+	while ((opt = getopt(argc, argv, "jr:s:")) != -1) {
+		if (opt == 'j') {
+			b->json = 1;
+		} else if (opt == 'r' && atoi(optarg) > 0 && atoi(optarg) <= BENCH_MAX_REPS) {
+			b->reps = atoi(optarg);
+		} else if (opt == 's' && atoi(optarg) > 0) {
+			seconds = atoi(optarg);
+		} else {
+			print_usage(argv[0]);
+			free(b);
+			return -1;
+		}
+	}
+
+	b->frames = (size_t) seconds * BENCH_RATE;
+
+	if (make_files(b) < 0) {
+		remove_files(b);
+		free(b);
+		return -1;
+	}
+
+	if (!b->json) {
+		printf("%d reps of %d s synthetic files, median per item\n\n",
+			b->reps, seconds);
+	}
+
+	if (wanted(argc, argv, "exact")) {
+		bench_exact(b);
+	}
+
+	if (wanted(argc, argv, "convert")) {
+		bench_convert(b);
+	}
+
+	if (wanted(argc, argv, "gain")) {
+		bench_gain(b);
+	}
+
+	if (wanted(argc, argv, "loudness")) {
+		bench_loudness(b);
+	}
+
+	if (wanted(argc, argv, "waveform")) {
+		bench_waveform(b);
+	}
+
+	if (wanted(argc, argv, "resample")) {
+		bench_resample(b);
+	}
+
+	if (wanted(argc, argv, "files")) {
+		bench_files(b);
+	}
+
+	if (wanted(argc, argv, "pipeline")) {
+		bench_pipeline(b);
+	}
+
+	if (wanted(argc, argv, "realtime")) {
+		bench_realtime(b);
+	}
+
+	int failed = b->failed;
+
+	remove_files(b);
+	resample_banks_free();
+	free(b);
+
+	return failed ? 1 : 0;
+}
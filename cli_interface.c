@@ -1,22 +1,30 @@
 #include "cli_interface.h"
 #include "fd_handle.h"
 #include "sound_engine.h"
+#include "convert.h"
+#include "prefetch.h"
+#include "scanner.h"
+#include "library.h"
+#include "watcher.h"
+#include "resample.h"
+#include "telemetry.h"
+#include "export.h"
+#include "loudness.h"
+#include "waveform.h"
+#include "screen.h"
 #include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
+#include <math.h>
 
-static int is_wav(const char* name) {
-	const char* dot = strrchr(name, '.');
-
-	if (!dot) {
-		return 0;
-	}
-
-	return strcasecmp(dot, ".wav") == 0;
-}
+#define VOLUME_STEP 0.05f
+#define MAX_VOLUME 1.99f
+#define MAX_CROSSFADE_MS 10000
+#define SEEK_STEP_SECONDS 5
 
 void list_wavs
 (
@@ -50,7 +58,7 @@ void list_wavs
 
 		if (S_ISDIR(st.st_mode) && recursive) { // actual file is a dir?
 			list_wavs(fullpath, recursive, on_wav, userdata);
-		} else if (S_ISREG(st.st_mode) && is_wav(ent->d_name)) {
+		} else if (S_ISREG(st.st_mode) && scan_is_wav(ent->d_name)) {
 			on_wav(fullpath, ent->d_name, userdata);
 		}
 	}
@@ -71,6 +79,25 @@ struct track* get_nth_music(struct player_state* st, size_t index) {
 	return &st->playlist.items[index];
 }
 
+// makes src the current track, the previous stream is the caller's
+static void install_track(struct player_state* st, const struct track_source* src) {
+	st->stream = src->stream;
+	st->fmt = src->fmt;
+	st->convert = src->convert;
+	st->buf_len = src->stream.data_len;
+	st->pcm_frames = src->frames;
+	st->resample = src->resample;
+	st->norm = src->norm;
+	st->current_track = src->index;
+}
+
+// tags only live as long as their track is the current one
+static void load_tags(struct player_state* st, const char* path, const struct wav_info* info) {
+	if (wav_read_tags(path, info, &st->tags) < 0) {
+		memset(&st->tags, 0, sizeof(st->tags));
+	}
+}
+
 int set_current_music(struct player_state* st, size_t index) {
 	if (index >= st->playlist.len) {
 		fprintf(stderr, "index out of bounds\n");
@@ -78,78 +105,156 @@ int set_current_music(struct player_state* st, size_t index) {
 	}
 
 	struct track* t = get_nth_music(st, index);
+	struct track_source src;
+	char path[PATH_MAX_LENGTH];
 
-	struct read_wav_result read_result = {0};
-	struct fmt_sub_chunk fmt;
-	uint8_t* data_buf;
-	size_t buf_len;
-
-	int file = read_wav_from_filename(t->path, NULL, &fmt, NULL,
-		&data_buf, &buf_len, &read_result);
-
-	if (file < 0) {
+	if (track_path(t, path, sizeof(path)) < 0 ||
+		track_source_open(path, index, &t->info, &src) < 0) {
 		fprintf(stderr, "reading wav failed\n");
 		return -1;
 	}
 
-	close(file);
+	track_source_resample(&src, st->device_rate, st->resample_quality);
+	src.norm = loudness_gain(t);
 
-	if (!read_result.fmt) {
-		fprintf(stderr, "reading wav failed\n");
+	// frames are mapped and converted on demand by the playback threads
+	wav_stream_close(&st->stream);
+	install_track(st, &src);
+	load_tags(st, path, &t->info);
+	st->cursor = 0;
+
+	return 0;
+}
+
+// the track played after the current one, -1 if playback ends there
+static int following_track(struct player_state* st, size_t* index) {
+	if (st->track_loop) {
+		*index = st->current_track;
+	} else if (st->current_track + 1 < st->playlist.len) {
+		*index = st->current_track + 1;
+	} else if (st->playlist_loop) {
+		*index = 0;
+	} else {
 		return -1;
 	}
 
-	st->fmt = fmt;
-	st->buf_len = buf_len;
+	return 0;
+}
 
-	// if st->pcm_buf is a valid pointer, then data_buf is not
-	if (convert_wav_to_32(&st, data_buf) < 0) {
-		free(data_buf);
-		return -1;
+// starts opening the following track in the background, so the decoder
+// can go on with it without a gap
+static void prefetch_following(struct player_state* st) {
+	size_t index;
+
+	if (following_track(st, &index) < 0) {
+		prefetch_end(st);
+		return;
 	}
 
-	apply_volume(&st);
+	prefetch_request(st, index, get_nth_music(st, index));
+}
 
-	free(data_buf);
+// the device already plays the prefetched track, st->cursor is in it
+// the previous stream may still be read by a crossfade, so it is only
+// closed at the next change
+static void adopt_next_music(struct player_state* st) {
+	atomic_store(&st->track_changed, 0);
 
-	st->current_track = index;
-	st->cursor = 0;
+	wav_stream_close(&st->retired);
+	st->retired = st->stream;
+	install_track(st, &st->next);
+	st->current_track = st->next_index;
+	load_tags(st, st->next_path, &st->next_info);
+	atomic_store(&st->next_state, NEXT_PENDING);
 
-	return 0;
+	st->played++;
+	prefetch_following(st);
 }
 
 void next_music(struct player_state* st) {
+	// the decode and output threads must not touch the stream while
+	// it is being replaced
+	playback_stop(st);
+
+	if (atomic_load(&st->track_changed)) {
+		adopt_next_music(st);
+	}
+
 	if (st->track_loop) {
 		st->cursor = 0;
+		playback_start(st);
+		return;
+	}
+
+	size_t index;
+
+	if (following_track(st, &index) < 0) {
+		st->mode = COMMAND;
+		st->play_state = STOPPED;
+		st->cursor = 0;
+		audio_shutdown(st);
+
 		return;
-	} else if (st->pcm_buf) {
-		free(st->pcm_buf);
 	}
 
 	st->played++;
 
-	if (st->current_track >= st->playlist.len - 1) {
-		if (st->playlist_loop) {
-			if (set_current_music(st, 0) < 0) {
-				fprintf(stderr, "playing wav failed\n");
-			}
+	// the prefetched track is used as is when the decoder couldn't take
+	// it itself (e.g. another sample rate)
+	if (atomic_load(&st->next_state) == NEXT_READY && st->next_index == index) {
+		wav_stream_close(&st->stream);
+		install_track(st, &st->next);
+		st->current_track = index;
+		load_tags(st, st->next_path, &st->next_info);
+		atomic_store(&st->next_state, NEXT_PENDING);
+		st->cursor = 0;
+	} else {
+		prefetch_cancel(st);
 
-			return;
-		} else {
+		if (set_current_music(st, index) < 0) {
+			fprintf(stderr, "playing wav failed\n");
 			st->mode = COMMAND;
 			st->play_state = STOPPED;
-			st->cursor = 0;
 			audio_shutdown(st);
-
 			return;
 		}
 	}
 
-	if (set_current_music(st, st->current_track + 1) < 0) {
+	if (audio_configure(st) < 0) {
 		fprintf(stderr, "playing wav failed\n");
 		st->mode = COMMAND;
 		st->play_state = STOPPED;
 		audio_shutdown(st);
+		return;
+	}
+
+	playback_start(st);
+	prefetch_following(st);
+}
+
+// seconds from the start of the current track, or from what is heard
+// right now when relative. a track change the device already made is
+// adopted first, so the seek lands in the track being heard
+static void seek_music(struct player_state* st, double seconds, int relative) {
+	playback_stop(st);
+
+	if (atomic_load(&st->track_changed)) {
+		adopt_next_music(st);
+	}
+
+	double rate = st->fmt.sample_rate;
+	double frame = seconds * rate;
+
+	if (relative) {
+		frame += (double) playback_position(st);
+	}
+
+	if (frame < 0.0) {
+		frame = 0.0;
+	}
+
+	if (audio_seek(st, (size_t) frame) < 0) {
+		fprintf(stderr, "seeking failed\n");
 	}
 }
 
@@ -161,12 +266,22 @@ void print_help() {
 	printf("(list) -> list all wav files\n");
 	printf("(loop) -> enable/disable playlist loop\n");
 	printf("(volume percent) -> change volume\n");
+	printf("(crossfade ms) -> fade tracks into each other, 0 for gapless\n");
+	printf("(normalize) -> enable/disable playing every track at the same loudness\n");
+	printf("(info number_track) -> format, chunks and tags of a track\n");
+	printf("(seek seconds) -> while playing, jump to that point of the track\n");
+	printf("(stats) -> device counters and write/tick latencies as json\n");
+	printf("(export dir [rate [bits [channels]]]) -> write every track as a wav\n");
+	printf("under dir, converted (0 or nothing keeps the track's own)\n");
 	printf("(clear) -> clean the terminal\n");
 	printf("(help) -> list all possible commands\n");
 	printf("(about) -> about the program\n");
 	printf("(quit) -> quit the program\n\n");
-	printf("if you add a new WAV in the directory, restart the program\n");
-	printf("volume must be altered only in command mode\n\n");
+	printf("WAVs added to or removed from the directory show up right away\n");
+	printf("(the library is remembered between runs, and only new or changed\n");
+	printf("files are read again)\n");
+	printf("volume can also be changed while playing with (+) and (-)\n");
+	printf("and (b)/(f) seek %d seconds back/forward\n\n", SEEK_STEP_SECONDS);
 	printf("you don't need to write (command) inside the parentheses\n");
 	printf("the use in here is just a way to distinguish a command from a normal text\n\n");
 }
@@ -175,10 +290,11 @@ void print_about() {
 	printf("\033[H\033[J");
 	printf("	--- ABOUT ---\n\n");
 	printf("this is a simple wav player written in C and using ALSA\n\n");
-	printf("it is currently inefficient in memory,\n");
-	printf("because to read a .wav it is necessary to copy\n");
-	printf("all the memory of the file into the program's\n");
-	printf("memory before instead of reading the data on demand\n\n");
+	printf("the .wav being played is mapped into memory (mmap)\n");
+	printf("and only the frames about to be played are converted,\n");
+	printf("so memory usage doesn't depend on the length of the file\n\n");
+	printf("the next track is opened in the background while the current\n");
+	printf("one plays, so tracks follow each other without a gap\n\n");
 	printf("in this player you can play a list of.wav files\n");
 	printf("within a directory (recursively if you enable this option)\n\n");
 	printf("a file is identified as .wav only by its name, which means\n");
@@ -187,8 +303,7 @@ void print_about() {
 	printf("	--- OPERATION MODES ---	 \n\n");
 	printf("Command mode:\n");
 	printf("it's the mode you're in right now, where you set\n");
-	printf("certain settings like playlistloop or volume (yes, the volume\n");
-	printf("should be set here and not while a .wav is playing) and dictate\n");
+	printf("certain settings like playlistloop or the initial volume and dictate\n");
 	printf("specific commands for specific needs\n\n");
 	printf("Player mode:\n");
 	printf("this is the mode you find yourself in while a .wav\n");
@@ -197,8 +312,61 @@ void print_about() {
 	printf("commands (simpler to write) that you can write to get specific results\n\n");
 }
 
+static void print_track_info(struct track* t) {
+	struct wav_tags tags;
+	struct wav_chunks chunks;
+	char path[PATH_MAX_LENGTH];
+
+	// the playlist may be older than the file
+	if (track_path(t, path, sizeof(path)) < 0 ||
+		read_wav_header_at(AT_FDCWD, path, &t->info, &chunks) < 0) {
+		fprintf(stderr, "reading wav failed\n");
+		return;
+	}
+
+	printf("%s\n", path);
+	printf("data: %llu bytes at %llu\n\n", (unsigned long long) t->info.data_len,
+		(unsigned long long) t->info.data_offset);
+	print_fmt_sub_chunk(&t->info.fmt);
+	print_wav_chunks(&chunks);
+
+	if (wav_read_tags(path, &t->info, &tags) == 0) {
+		print_wav_tags(&tags);
+	}
+
+	if (t->loudness == LOUDNESS_UNKNOWN) {
+		printf("loudness: not measured yet\n");
+	} else if (t->loudness == LOUDNESS_NONE) {
+		printf("loudness: nothing to measure\n");
+	} else {
+		printf("loudness: %.1f LUFS, true peak %.1f dBTP, played at %+.1f dB\n",
+			t->loudness, 20.0f * log10f(t->peak), 20.0f * log10f(loudness_gain(t)));
+	}
+}
+
+// export DEST [RATE [BITS [CHANNELS]]], at the current volume
+static void export_command(const char* line, struct player_state* st) {
+	char dest[PATH_MAX_LENGTH] = "";
+	struct export_options opt = {
+		.dest = dest,
+		.root = st->dir_path,
+		.gain = st->player_gain,
+		.quality = st->resample_quality
+	};
+
+	if (sscanf(line, "%*s %1023s %u %u %u", dest, &opt.rate, &opt.bits,
+		&opt.channels) < 1 || export_check(&opt) < 0) {
+		fprintf(stderr, "invalid export: (export dir [rate [bits [channels]]])\n");
+		return;
+	}
+
+	if (export_playlist(&st->playlist, &opt) < 0) {
+		fprintf(stderr, "exporting failed\n");
+	}
+}
+
 void process_command_input(char* line, struct player_state* st) {
-	char cmd[16];
+	char cmd[16] = "";
 	int flag;
 
 	int count = sscanf(line, "%15s %d", cmd, &flag);
@@ -237,6 +405,8 @@ void process_command_input(char* line, struct player_state* st) {
 			fprintf(stderr, "playing wav failed\n");
 			return;
 		}
+
+		prefetch_following(st);
 	} else if (strcmp(cmd, "loop") == 0) {
 		st->playlist_loop = (st->playlist_loop) ? 0 : 1;
 
@@ -245,15 +415,47 @@ void process_command_input(char* line, struct player_state* st) {
 		} else {
 			printf("playlistloop: disabled\n");
 		}
+	} else if (strcmp(cmd, "normalize") == 0) {
+		atomic_store(&st->normalize, !atomic_load(&st->normalize));
+
+		if (atomic_load(&st->normalize)) {
+			printf("normalize: enabled\n");
+		} else {
+			printf("normalize: disabled\n");
+		}
 	} else if (strcmp(cmd, "volume") == 0) {
 		if (count == 2) {
 			if (flag < 0.0 || flag >= 200.0) {
-				fprintf(stderr, "invalid volume: %.2f\n", flag);
+				fprintf(stderr, "invalid volume: %d\n", flag);
 				return;
 			}
 
 			st->player_gain = flag / 100.0;
 		}
+	} else if (strcmp(cmd, "crossfade") == 0) {
+		if (count == 2) {
+			if (flag < 0 || flag > MAX_CROSSFADE_MS) {
+				fprintf(stderr, "invalid crossfade: %d\n", flag);
+				return;
+			}
+
+			atomic_store(&st->crossfade_ms, flag);
+		}
+
+		printf("crossfade: %d ms\n", atomic_load(&st->crossfade_ms));
+	} else if (strcmp(cmd, "info") == 0) {
+		if (count != 2 || flag < 1 || flag > (int) st->playlist.len) {
+			fprintf(stderr, "invalid track\n");
+			return;
+		}
+
+		print_track_info(get_nth_music(st, flag - 1));
+	} else if (strcmp(cmd, "seek") == 0) {
+		printf("nothing is playing, (seek seconds) works in player mode\n");
+	} else if (strcmp(cmd, "stats") == 0) {
+		telemetry_print_json(st, stdout);
+	} else if (strcmp(cmd, "export") == 0) {
+		export_command(line, st);
 	} else if (strcmp(cmd, "clear") == 0) {
 		printf("\033[H\033[J");		
 	} else if(strcmp(cmd, "about") == 0) {
@@ -264,33 +466,109 @@ void process_command_input(char* line, struct player_state* st) {
 	}
 }
 
+// both loops read stdin with read(), whatever one of them read past its
+// last line or key (e.g. keys typed right after play) is kept here for
+// the other one
+static char input[256];
+static size_t input_len;
+static int input_closed; // stdin reached its end
+
+static ssize_t read_input() {
+	if (input_len == sizeof(input)) {
+		return 1;
+	}
+
+	ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - input_len);
+
+	if (n > 0) {
+		input_len += n;
+	} else if (n == 0) {
+		input_closed = 1;
+	}
+
+	return n;
+}
+
+// takes the first complete line out of input (everything left if all)
+static int take_line(char* line, int all) {
+	char* nl = memchr(input, '\n', input_len);
+	size_t n;
+
+	if (nl) {
+		n = nl - input + 1;
+	} else if (input_len == sizeof(input) || (all && input_len)) {
+		n = input_len;
+	} else {
+		return 0;
+	}
+
+	memcpy(line, input, n);
+	line[n] = '\0';
+	memmove(input, input + n, input_len - n);
+	input_len -= n;
+
+	return 1;
+}
+
 void command_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
-	char line[256];
+	char line[sizeof(input) + 1];
+	int prompt = 1;
 	int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
 	fcntl(STDIN_FILENO, F_SETFL, flags & ~O_NONBLOCK);
 	printf("\033[H\033[J");
 	printf("COMMAND MODE (help for list of commands)\n\n");
 
+	// stdin and the library watcher
+	struct pollfd fds[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = st->watch.fd, .events = POLLIN }
+	};
+
 	while (st->running && (st->mode == COMMAND)) {
 		if (*should_exit) {
 			st->running = 0;
+			break;
 		}
 
-		printf("> ");
-		fflush(stdout);
+		if (prompt) {
+			printf("> ");
+			fflush(stdout);
+			prompt = 0;
+		}
 
+		// measured loudness too, and the tracks to measure are looked for
+		loudness_update(st);
 
-		if (!fgets(line, sizeof(line), stdin)) {
-			break;
+		if (take_line(line, 0)) {
+			// the library rescan is only picked up between commands
+			library_adopt(st);
+			process_command_input(line, st);
+			prompt = 1;
+			continue;
+		}
+
+		if (poll(fds, 2, -1) < 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			watcher_process(st);
 		}
 
-		process_command_input(line, st);
+		if ((fds[0].revents & (POLLIN | POLLHUP)) && read_input() <= 0) {
+			// end of input: the last line without a newline, then quit
+			if (take_line(line, 1)) {
+				process_command_input(line, st);
+			}
+
+			st->running = 0;
+		}
 	}
 }
 
 static void process_key(struct player_state* st, char c) {
 	if (c == ' ') {
-		st->play_state = (st->play_state == PAUSED) ? PLAYING : PAUSED;
+		audio_pause(st, st->play_state != PAUSED);
 		return;
 	}
 
@@ -302,23 +580,46 @@ static void process_key(struct player_state* st, char c) {
 	if (c == 'q') {
 		st->mode = COMMAND;
 		st->play_state = STOPPED;
-		free(st->pcm_buf);
 		audio_shutdown(st);
+		wav_stream_close(&st->stream);
 		return;
 	}
 
 	if (c == 'l') {
 		st->track_loop = (st->track_loop) ? 0 : 1;
+		prefetch_following(st);
+		return;
+	}
+
+	if (c == 'b' || c == 'f') {
+		seek_music(st, c == 'b' ? -SEEK_STEP_SECONDS : SEEK_STEP_SECONDS, 1);
+		return;
+	}
+
+	// the decode thread ramps to the new gain, so this is click free
+	if (c == '+' || c == '-') {
+		float gain = st->player_gain + (c == '+' ? VOLUME_STEP : -VOLUME_STEP);
+
+		if (gain < 0.0f) {
+			gain = 0.0f;
+		} else if (gain > MAX_VOLUME) {
+			gain = MAX_VOLUME;
+		}
+
+		st->player_gain = gain;
 		return;
 	}
 }
 
-static void render_progress_bar(struct player_state* st, int width) {
-	if (st->buf_len == 0) {
+static void render_progress_bar(struct screen* sc, struct player_state* st, int width) {
+	char bar[UI_WIDTH + 1];
+
+	if (st->buf_len == 0 || width > UI_WIDTH) {
 		return;
 	}
 
-	size_t current = st->cursor;
+	// as heard, not as written to the device
+	size_t current = playback_position(st);
 	size_t total = st->pcm_frames;
 
 	float ratio = (float) current / (float) total;
@@ -329,68 +630,268 @@ static void render_progress_bar(struct player_state* st, int width) {
 
 	int filled = (int) (ratio * width);
 
-	putchar('[');
+	for (int i = 0; i < width; i++) {
+		bar[i] = i < filled ? '#' : '-';
+	}
+
+	bar[width] = '\0';
+
+	size_t rate = st->fmt.sample_rate ? st->fmt.sample_rate : 1;
+	size_t elapsed = current / rate;
+	size_t length = total / rate;
+
+	screen_printf(sc, "[%s] %zu:%02zu / %zu:%02zu", bar, elapsed / 60, elapsed % 60,
+		length / 60, length % 60);
+}
+
+// the whole track over the progress bar, one column per character of
+// it, what was already heard in full and the rest dimmed
+static void render_waveform(struct screen* sc, struct player_state* st, int width) {
+	static const char* const bars[] = { " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+	struct track* t = get_current_music(st);
+	char path[PATH_MAX_LENGTH];
+	struct waveform_peak peaks[UI_WIDTH];
+
+	// only what's shown gets one (not a track played by wav_bench),
+	// asking again for the same track does nothing
+	if (track_path(t, path, sizeof(path)) == 0) {
+		waveform_request(st, path, &t->info);
+	}
+
+	const struct waveform* wf = waveform_current(st);
+
+	if (!wf || st->buf_len == 0 || width > UI_WIDTH) {
+		return;
+	}
+
+	size_t played = (size_t) width * playback_position(st) / (st->pcm_frames ? st->pcm_frames : 1);
+
+	waveform_overview(wf, 0, wf->frames, width, peaks);
+	screen_printf(sc, " ");
 
 	for (int i = 0; i < width; i++) {
-		if (i < filled) {
-			putchar('#');
-		} else {
-			putchar('-');
+		int level = -peaks[i].min > peaks[i].max ? -peaks[i].min : peaks[i].max;
+		int bar = (level * 8 + 32767) / 32768;
+
+		if ((size_t) i == played) {
+			screen_printf(sc, "\033[2m");
 		}
+
+		screen_printf(sc, "%s", bars[bar > 8 ? 8 : bar]);
 	}
 
-	putchar(']');
+	screen_printf(sc, "\033[0m\n");
 }
 
-static void render_ui(struct player_state* st) {
-	printf("\033[H\033[J");
+static double clock_seconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// copies per second and cpu usage, recomputed once per second
+static void update_meter(struct player_state* st) {
+	struct io_meter* m = &st->meter;
+	double wall = clock_seconds(CLOCK_MONOTONIC);
+	double elapsed = wall - m->wall;
+
+	if (elapsed < 1.0) {
+		return;
+	}
+
+	double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	size_t copies = atomic_load(&st->copies);
+	size_t bytes = atomic_load(&st->copied_bytes);
+
+	if (m->wall > 0.0) {
+		m->copies_per_sec = (copies - m->copies) / elapsed;
+		m->mb_per_sec = (bytes - m->copied_bytes) / elapsed / (1024.0 * 1024.0);
+		m->cpu_percent = (cpu - m->cpu) * 100.0 / elapsed;
+	}
+
+	m->wall = wall;
+	m->cpu = cpu;
+	m->copies = copies;
+	m->copied_bytes = bytes;
+}
+
+// what the output thread saw of the device (see telemetry.h)
+static void render_telemetry(struct screen* sc, struct player_state* st) {
+	const struct telemetry* t = &st->out.telemetry;
+	long delay = telemetry_delay(st);
+	size_t errors = atomic_load(&t->xruns) + atomic_load(&t->suspends) +
+		atomic_load(&t->errors);
+
+	screen_printf(sc, "device: delay %.1f ms  avail: %ld  xruns: %zu  short writes: %zu  recovered: %zu/%zu\n",
+		delay > 0 && st->out.rate ? delay * 1000.0 / st->out.rate : 0.0,
+		atomic_load(&t->avail), atomic_load(&t->xruns),
+		atomic_load(&t->short_writes), atomic_load(&t->recoveries), errors);
+	screen_printf(sc, "write: p50 <%.0f us  p99 <%.0f us  max %.2f ms  tick: p50 <%.0f us  p99 <%.0f us  max %.2f ms\n",
+		histogram_percentile(&t->write, 0.50), histogram_percentile(&t->write, 0.99),
+		atomic_load(&t->write.max_ns) / 1e6,
+		histogram_percentile(&t->tick, 0.50), histogram_percentile(&t->tick, 0.99),
+		atomic_load(&t->tick.max_ns) / 1e6);
+}
+
+// composes the player screen and draws what changed since the last
+// frame, at most once per UI_REFRESH_MS however often the loop wakes up.
+// returns the ms until the frame it skipped can be drawn, 0 if it drew
+static int render_ui(struct player_state* st) {
+	static uint64_t drawn_ns;
+	uint64_t now = telemetry_now();
+	uint64_t period = UI_REFRESH_MS * 1000000ull;
+
+	if (!st->screen && !(st->screen = screen_open(STDOUT_FILENO))) {
+		return 0;
+	}
+
+	if (drawn_ns && now - drawn_ns < period) {
+		return (int) ((period - (now - drawn_ns) + 999999) / 1000000);
+	}
+
+	struct screen* sc = st->screen;
+
+	drawn_ns = now;
+	screen_begin(sc);
 
 	if (st->play_state == PLAYING) {
 		struct track* t = get_current_music(st);
-		printf("current track [%d/%d]: %s\n",
+		screen_printf(sc, "current track [%zu/%zu]: %s\n",
 			st->current_track + 1, st->playlist.len, t->name);
-		printf("volume: %.1f%\n", st->player_gain * 100.0);
+
+		if (*st->tags.title) {
+			screen_printf(sc, "%s%s%s\n", st->tags.title, *st->tags.artist ? " - " : "",
+				st->tags.artist);
+		}
+
+		screen_printf(sc, "volume: %.1f%%\n", st->player_gain * 100.0);
+		if (st->output_path == PATH_PASSTHROUGH) {
+			screen_printf(sc, "output: passthrough %s\n",
+				snd_pcm_format_name(st->out.format));
+		} else {
+			screen_printf(sc, "output: %d-bit -> %s (%s)\n", st->fmt.bits_per_sample,
+				snd_pcm_format_name(st->out.format), st->convert->name);
+
+			if (st->resample) {
+				size_t levels_len;
+				const struct resample_level* levels = resample_levels(&levels_len);
+
+				screen_printf(sc, "resample: %u -> %u hz (%s, %zu taps, %s)\n",
+					st->resample->in_rate, st->resample->out_rate,
+					levels[st->resample->quality].name, st->resample->taps,
+					resample_kernel_name());
+			}
+
+			screen_printf(sc, "buffer: %zu%% (underruns: %zu)\n",
+				ring_readable(&st->ring) * 100 / st->ring.size,
+				atomic_load(&st->underruns));
+		}
+
+		update_meter(st);
+		screen_printf(sc, "access: %s%s  setups: %zu  copies: %.0f/s (%.2f MB/s)  cpu: %.1f%%\n",
+			st->out.access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw",
+			st->out.mmap_refused ? " (mmap refused)" : "", st->out.setups,
+			st->meter.copies_per_sec, st->meter.mb_per_sec,
+			st->meter.cpu_percent);
+
+		if (st->rt_priority && st->output_fifo) {
+			screen_printf(sc, "output thread: SCHED_FIFO %d\n", st->rt_priority);
+		} else if (st->rt_priority) {
+			screen_printf(sc, "output thread: normal priority (SCHED_FIFO refused)\n");
+		}
+
+		render_telemetry(sc, st);
+
+		const struct readahead* ra = &st->readahead;
+		size_t reads = atomic_load(&ra->reads);
+
+		if (ra->running) {
+			screen_printf(sc, "read-ahead: %s  in flight: %d/%d (%zu KB)  latency: %.2f ms (max %.2f ms)\n",
+				ra->backend, atomic_load(&ra->inflight), ra->depth,
+				atomic_load(&ra->inflight_bytes) / 1024,
+				reads ? atomic_load(&ra->latency_ns) / (double) reads / 1e6 : 0.0,
+				atomic_load(&ra->latency_max_ns) / 1e6);
+		}
 
 		if (st->track_loop) {
-			printf("looptrack: enabled\n");
+			screen_printf(sc, "looptrack: enabled\n");
 		} else {
-			printf("looptrack: disabled\n");
+			screen_printf(sc, "looptrack: disabled\n");
+		}
+
+		if (atomic_load(&st->crossfade_ms)) {
+			screen_printf(sc, "crossfade: %d ms\n", atomic_load(&st->crossfade_ms));
 		}
 
-		render_progress_bar(st, UI_WIDTH);
-		printf("\n(space) play/pause  (n) next  (l) loop  (q) quit\n");
+		render_waveform(sc, st, UI_WIDTH);
+		render_progress_bar(sc, st, UI_WIDTH);
+		screen_printf(sc, "\n(space) play/pause  (n) next  (l) loop  (+/-) volume  (b/f) seek  (q) quit\n");
 	}
+
+	// whatever printf() still holds goes out before the frame
+	fflush(stdout);
+	screen_flush(sc);
+
+	return 0;
 }
 
 void process_player_input(struct player_state* st) {
-	char buf[32];
+	read_input();
 
-	ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
-	if (n <= 0) {
-		return;
-	}
+	size_t i = 0;
+
+	// after q the rest belongs to the command loop
+	while (i < input_len && st->mode == PLAYER) {
+		// a line starting with seek is a command, not keys
+		if ((i == 0 || input[i - 1] == '\n') && input_len - i >= 4 &&
+			memcmp(input + i, "seek", 4) == 0) {
+			char* nl = memchr(input + i, '\n', input_len - i);
+			double seconds;
+
+			if (!nl) {
+				break; // the rest of it hasn't been read yet
+			}
+
+			*nl = '\0';
+
+			if (sscanf(input + i + 4, "%lf", &seconds) == 1) {
+				seek_music(st, seconds, 0);
+			}
+
+			i = nl - input + 1;
+			continue;
+		}
 
-	for (ssize_t i = 0; i < n; i++) {
-		process_key(st, buf[i]);
+		process_key(st, input[i++]);
 	}
+
+	memmove(input, input + i, input_len - i);
+	input_len -= i;
 }
 
 void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 	int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
 	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
-	struct timespec ts = {
-		.tv_sec = 0,
-		.tv_nsec = 16 * 1000 * 1000
+	struct pollfd fds[3] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = st->event_fd, .events = POLLIN },
+		{ .fd = st->watch.fd, .events = POLLIN }
 	};
 
+	// the command mode wrote over the last frame
+	if (st->screen) {
+		screen_invalidate(st->screen);
+	}
+
 	while (st->running && (st->mode == PLAYER)) {
 		if (*should_exit) {
 			st->running = 0;
 
 			if (st->mode == PLAYER) {
 				audio_shutdown(st);
-				free(st->pcm_buf);
+				wav_stream_close(&st->stream);
 			}
 		}
 
@@ -399,10 +900,56 @@ void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 
 		if (ret == 0) {
 			next_music(st);
+		} else if (ret == 2) {
+			adopt_next_music(st);
+		}
+
+		// tracks deleted while they were playing, and the rescan of the
+		// library started from its index
+		library_settle(st);
+
+		if (library_adopt(st)) {
+			prefetch_following(st);
+		}
+
+		loudness_update(st);
+
+		int wait = render_ui(st);
+
+		// the playlist ended, nothing would wake the poll below
+		if (st->mode != PLAYER) {
+			break;
+		}
+
+		// sleeps until the user types, the output thread finishes or
+		// changes the track or the progress bar needs to move (never
+		// while paused), or until a frame skipped above can be drawn
+		int timeout = (st->play_state == PLAYING) ? UI_REFRESH_MS : -1;
+
+		if (wait > 0 && (timeout < 0 || wait < timeout)) {
+			timeout = wait;
 		}
 
-		render_ui(st);
-		nanosleep(&ts, NULL);
+		// a closed stdin would wake it every time (e.g. rendering a
+		// playlist with its commands piped in)
+		fds[0].fd = input_closed ? -1 : STDIN_FILENO;
+
+		if (poll(fds, 3, timeout) <= 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t events;
+			ssize_t n = read(st->event_fd, &events, sizeof(events));
+			(void) n;
+		}
+
+		// entries may have moved around the current track, and the one
+		// that follows it may be another one now
+		if (fds[2].revents & POLLIN) {
+			watcher_process(st);
+			prefetch_following(st);
+		}
 	}
 }
 
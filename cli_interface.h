@@ -4,15 +4,17 @@ there are 3 I/O lines that must me implemented:
 - user input
 - UI update
 
-i could use threads if a wanted to create a more complex wav player, but
-i'm using poll() for now
+audio output runs on its own threads (see playback_start()):
+a decode thread converts the track and applies gain into a lock-free
+ring buffer, and an output thread only moves frames from the ring to
+the device, so the loops below can never block audio
 
 the main loop must be:
 
 loop {
-	wait_timeout_events()
+	wait_timeout_events() // poll() on stdin, the output thread and inotify
 	process_user_input() // stdin
-	feed_audio_output() // data_buf
+	feed_audio_output() // checks if the output thread finished the track
 	update_ui()
 }
 
@@ -26,7 +28,8 @@ loop {
 #include <signal.h>
 #include <alsa/asoundlib.h>
 
-#define UI_WIDTH 20
+#define UI_WIDTH 60
+#define UI_REFRESH_MS 50 // frame interval of the player screen (at most, and while playing)
 
 struct track* get_current_music(struct player_state* st);
 int set_current_music(struct player_state* st, size_t index);
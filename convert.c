@@ -0,0 +1,284 @@
+#include "convert.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* --- SCALAR (fallback, same code as convert_wav_to_32) --- */
+
+static void convert_8_scalar(const uint8_t* src, int32_t* dst, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = ((int32_t) src[i] - 128) << 24;
+	}
+}
+
+static void convert_16_scalar(const uint8_t* src, int32_t* dst, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		int16_t v = (int16_t)(src[0] | (src[1] << 8));
+		src += 2;
+		dst[i] = ((int32_t) v) << 16;
+	}
+}
+
+static void convert_24_scalar(const uint8_t* src, int32_t* dst, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		int32_t v = (src[0]) | (src[1] << 8) | (src[2] << 16);
+
+		if (v & 0x00800000) {
+			v |= 0xFF000000;
+		}
+
+		src += 3;
+		dst[i] = v << 8;
+	}
+}
+
+static int always(void) {
+	return 1;
+}
+
+#ifdef HAVE_X86
+
+/*
+the cpu is asked once (cpuid, through __builtin_cpu_supports) and every
+kernel is compiled with a target attribute, so the binary still runs on
+any x86 and no global -m flags are needed
+*/
+
+static int has_sse2(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+static int has_ssse3(void) {
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int has_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+/* --- SSE2 --- */
+
+__attribute__((target("sse2")))
+static void convert_8_sse2(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi8((char) 0x80);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		v = _mm_xor_si128(v, bias); // unsigned -> signed
+
+		// each byte ends up in the top byte of its dword
+		__m128i lo = _mm_unpacklo_epi8(zero, v);
+		__m128i hi = _mm_unpackhi_epi8(zero, v);
+
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_unpacklo_epi16(zero, lo));
+		_mm_storeu_si128((__m128i*) (dst + i + 4), _mm_unpackhi_epi16(zero, lo));
+		_mm_storeu_si128((__m128i*) (dst + i + 8), _mm_unpacklo_epi16(zero, hi));
+		_mm_storeu_si128((__m128i*) (dst + i + 12), _mm_unpackhi_epi16(zero, hi));
+	}
+
+	convert_8_scalar(src + i, dst + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_16_sse2(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i * 2));
+
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_unpacklo_epi16(zero, v));
+		_mm_storeu_si128((__m128i*) (dst + i + 4), _mm_unpackhi_epi16(zero, v));
+	}
+
+	convert_16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_24_sse2(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+	size_t i = 0;
+
+	// 4 samples per step, each read as a 4 byte word, so one byte past
+	// the group must still be inside the buffer
+	for (; i + 5 <= samples; i += 4) {
+		const uint8_t* p = src + i * 3;
+		int32_t w[4];
+
+		memcpy(&w[0], p, 4);
+		memcpy(&w[1], p + 3, 4);
+		memcpy(&w[2], p + 6, 4);
+		memcpy(&w[3], p + 9, 4);
+
+		__m128i v = _mm_loadu_si128((const __m128i*) w);
+		v = _mm_slli_epi32(_mm_and_si128(v, mask), 8);
+		_mm_storeu_si128((__m128i*) (dst + i), v);
+	}
+
+	convert_24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+/* --- SSSE3 --- */
+
+#define Z -128 // pshufb: zero this byte
+
+__attribute__((target("ssse3")))
+static void convert_8_ssse3(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i bias = _mm_set1_epi8((char) 0x80);
+	const __m128i s0 = _mm_setr_epi8(Z,Z,Z,0, Z,Z,Z,1, Z,Z,Z,2, Z,Z,Z,3);
+	const __m128i s1 = _mm_setr_epi8(Z,Z,Z,4, Z,Z,Z,5, Z,Z,Z,6, Z,Z,Z,7);
+	const __m128i s2 = _mm_setr_epi8(Z,Z,Z,8, Z,Z,Z,9, Z,Z,Z,10, Z,Z,Z,11);
+	const __m128i s3 = _mm_setr_epi8(Z,Z,Z,12, Z,Z,Z,13, Z,Z,Z,14, Z,Z,Z,15);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		v = _mm_xor_si128(v, bias);
+
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, s0));
+		_mm_storeu_si128((__m128i*) (dst + i + 4), _mm_shuffle_epi8(v, s1));
+		_mm_storeu_si128((__m128i*) (dst + i + 8), _mm_shuffle_epi8(v, s2));
+		_mm_storeu_si128((__m128i*) (dst + i + 12), _mm_shuffle_epi8(v, s3));
+	}
+
+	convert_8_scalar(src + i, dst + i, samples - i);
+}
+
+__attribute__((target("ssse3")))
+static void convert_16_ssse3(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i s0 = _mm_setr_epi8(Z,Z,0,1, Z,Z,2,3, Z,Z,4,5, Z,Z,6,7);
+	const __m128i s1 = _mm_setr_epi8(Z,Z,8,9, Z,Z,10,11, Z,Z,12,13, Z,Z,14,15);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i * 2));
+
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, s0));
+		_mm_storeu_si128((__m128i*) (dst + i + 4), _mm_shuffle_epi8(v, s1));
+	}
+
+	convert_16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+__attribute__((target("ssse3")))
+static void convert_24_ssse3(const uint8_t* src, int32_t* dst, size_t samples) {
+	// the 3 bytes of each sample go to the top of its dword, which also
+	// sign extends it for free
+	const __m128i s = _mm_setr_epi8(Z,0,1,2, Z,3,4,5, Z,6,7,8, Z,9,10,11);
+	size_t i = 0;
+
+	// 16 byte loads, 12 of them used
+	for (; i + 6 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i * 3));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, s));
+	}
+
+	convert_24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+/* --- AVX2 --- */
+
+__attribute__((target("avx2")))
+static void convert_8_avx2(const uint8_t* src, int32_t* dst, size_t samples) {
+	const __m128i bias = _mm_set1_epi8((char) 0x80);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		v = _mm_xor_si128(v, bias);
+
+		__m256i lo = _mm256_slli_epi32(_mm256_cvtepi8_epi32(v), 24);
+		__m256i hi = _mm256_slli_epi32(
+			_mm256_cvtepi8_epi32(_mm_srli_si128(v, 8)), 24);
+
+		_mm256_storeu_si256((__m256i*) (dst + i), lo);
+		_mm256_storeu_si256((__m256i*) (dst + i + 8), hi);
+	}
+
+	convert_8_scalar(src + i, dst + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_16_avx2(const uint8_t* src, int32_t* dst, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + i * 2));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i * 2 + 16));
+
+		_mm256_storeu_si256((__m256i*) (dst + i),
+			_mm256_slli_epi32(_mm256_cvtepi16_epi32(a), 16));
+		_mm256_storeu_si256((__m256i*) (dst + i + 8),
+			_mm256_slli_epi32(_mm256_cvtepi16_epi32(b), 16));
+	}
+
+	convert_16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_24_avx2(const uint8_t* src, int32_t* dst, size_t samples) {
+	// bytes 12..23 are moved to the upper lane, then both lanes use the
+	// same shuffle as the ssse3 kernel
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	const __m256i s = _mm256_setr_epi8(
+		Z,0,1,2, Z,3,4,5, Z,6,7,8, Z,9,10,11,
+		Z,0,1,2, Z,3,4,5, Z,6,7,8, Z,9,10,11);
+	size_t i = 0;
+
+	// 32 byte loads, 24 of them used
+	for (; i + 11 <= samples; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (src + i * 3));
+		v = _mm256_permutevar8x32_epi32(v, lanes);
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v, s));
+	}
+
+	convert_24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+#undef Z
+
+#endif
+
+static const struct convert_kernel kernels[] = {
+	{ "scalar", 8, convert_8_scalar, always },
+	{ "scalar", 16, convert_16_scalar, always },
+	{ "scalar", 24, convert_24_scalar, always },
+#ifdef HAVE_X86
+	{ "sse2", 8, convert_8_sse2, has_sse2 },
+	{ "sse2", 16, convert_16_sse2, has_sse2 },
+	{ "sse2", 24, convert_24_sse2, has_sse2 },
+	{ "ssse3", 8, convert_8_ssse3, has_ssse3 },
+	{ "ssse3", 16, convert_16_ssse3, has_ssse3 },
+	{ "ssse3", 24, convert_24_ssse3, has_ssse3 },
+	{ "avx2", 8, convert_8_avx2, has_avx2 },
+	{ "avx2", 16, convert_16_avx2, has_avx2 },
+	{ "avx2", 24, convert_24_avx2, has_avx2 },
+#endif
+};
+
+size_t convert_kernels(const struct convert_kernel** list) {
+	*list = kernels;
+	return sizeof(kernels) / sizeof(kernels[0]);
+}
+
+const struct convert_kernel* convert_select(const struct fmt_sub_chunk* fmt) {
+	const struct convert_kernel* best = NULL;
+	size_t count = sizeof(kernels) / sizeof(kernels[0]);
+
+	if (fmt->audio_format != 1) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (kernels[i].bits == fmt->bits_per_sample && kernels[i].supported()) {
+			best = &kernels[i];
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,31 @@
+/*
+sample conversion kernels (8/16/24-bit little endian -> S32)
+
+convert_wav_to_32() in sound_engine.c is the scalar reference, every
+kernel here must produce exactly the same samples. the best kernel the
+cpu supports is picked once per track by convert_select(), so the hot
+loop never branches on bits_per_sample
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "types.h"
+
+// converts samples samples (not frames) from src to dst
+typedef void (*convert_fn)(const uint8_t* src, int32_t* dst, size_t samples);
+
+struct convert_kernel {
+	const char* name; // "scalar", "sse2", "ssse3" or "avx2"
+	int bits; // bits_per_sample handled by fn
+	convert_fn fn;
+	int (*supported)(void); // can this cpu run fn?
+};
+
+// every kernel compiled in, fastest last
+size_t convert_kernels(const struct convert_kernel** kernels);
+
+// NULL if fmt can't be converted
+const struct convert_kernel* convert_select(const struct fmt_sub_chunk* fmt);
+
+#endif
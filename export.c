@@ -0,0 +1,586 @@
+#include "export.h"
+#include "convert.h"
+#include "fd_handle.h"
+#include "gain.h"
+#include "resample.h"
+#include "telemetry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct exporter {
+	const struct playlist* pl;
+	const struct export_options* opt;
+	atomic_size_t next; // first track no worker took yet
+	atomic_size_t done; // files finished, failed ones included
+	atomic_size_t failed;
+	atomic_uint_least64_t bytes_read; // data chunks of the files done
+	atomic_uint_least64_t bytes_written; // as the buffers are flushed
+
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	size_t running; // workers that didn't return yet
+};
+
+struct export_worker {
+	struct exporter* ex;
+	pthread_t thread;
+	struct resampler rs;
+	int32_t in[FRAMES_PER_TICK * MAX_CHANNELS]; // converted, track rate
+	int32_t pcm[FRAMES_PER_TICK * MAX_CHANNELS]; // resampled
+	int32_t mapped[FRAMES_PER_TICK * MAX_CHANNELS]; // output channels
+	uint8_t* buf; // EXPORT_WRITE_BYTES of encoded frames
+	size_t buf_len;
+};
+
+// a track being exported by a worker
+struct export_file {
+	struct wav_stream ws;
+	struct fmt_sub_chunk fmt;
+	const struct convert_kernel* kernel;
+	const struct resample_bank* bank; // NULL: the rate stays
+	struct gain_stage gain;
+	size_t in_channels;
+	size_t out_channels;
+	size_t bits;
+	size_t cursor; // input frames read
+	size_t frames; // input frames
+	size_t total; // output frames
+	int fd;
+};
+
+int export_check(const struct export_options* opt) {
+	if (!opt->dest || !*opt->dest) {
+		return -1;
+	}
+
+	if (opt->bits != 0 && opt->bits != 8 && opt->bits != 16 &&
+		opt->bits != 24 && opt->bits != 32) {
+		return -1;
+	}
+
+	if (opt->rate != 0 && (opt->rate < 8000 || opt->rate > 384000)) {
+		return -1;
+	}
+
+	if (opt->channels > MAX_CHANNELS || opt->gain < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// creates every missing directory of path up to its last '/'
+static int make_dirs(const char* path) {
+	char dir[PATH_MAX_LENGTH];
+
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	for (char* p = dir + 1; *p; p++) {
+		if (*p != '/') {
+			continue;
+		}
+
+		*p = '\0';
+
+		// another worker may just have made it
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			return -1;
+		}
+
+		*p = '/';
+	}
+
+	return 0;
+}
+
+// dest/ plus the track's path below the library root
+static int export_path
+(
+	const struct export_options* opt,
+	const struct track* t,
+	char* out,
+	size_t len
+)
+{
+	const char* rel = t->dir;
+	size_t root_len = opt->root ? strlen(opt->root) : 0;
+
+	if (root_len && strncmp(t->dir, opt->root, root_len) == 0 &&
+		(t->dir[root_len] == '/' || t->dir[root_len] == '\0')) {
+		rel = t->dir + root_len;
+	}
+
+	while (*rel == '/') {
+		rel++;
+	}
+
+	int n = *rel ?
+		snprintf(out, len, "%s/%s/%s", opt->dest, rel, t->name) :
+		snprintf(out, len, "%s/%s", opt->dest, t->name);
+
+	return n < 0 || (size_t) n >= len ? -1 : 0;
+}
+
+// the channels asked for out of the track's: the same, mono copied to
+// every channel or everything averaged down to mono
+static int channels_mappable(size_t in, size_t out) {
+	return in == out || in == 1 || out == 1;
+}
+
+static const int32_t* map_channels(struct export_worker* w, const struct export_file* f, size_t frames) {
+	size_t in = f->in_channels;
+	size_t out = f->out_channels;
+
+	if (in == out) {
+		return w->pcm;
+	}
+
+	for (size_t i = 0; i < frames; i++) {
+		const int32_t* src = w->pcm + i * in;
+		int32_t* dst = w->mapped + i * out;
+
+		if (in == 1) {
+			for (size_t c = 0; c < out; c++) {
+				dst[c] = src[0];
+			}
+		} else {
+			int64_t sum = 0;
+
+			for (size_t c = 0; c < in; c++) {
+				sum += src[c];
+			}
+
+			dst[0] = (int32_t) (sum / (int64_t) in);
+		}
+	}
+
+	return w->mapped;
+}
+
+// S32 down to the top bits of a sample, rounded to the nearest
+static inline int32_t requantize(int32_t v, int shift) {
+	int64_t r = (int64_t) v + ((int64_t) 1 << (shift - 1));
+
+	if (r > INT32_MAX) {
+		r = INT32_MAX;
+	}
+
+	return (int32_t) (r >> shift);
+}
+
+static void encode(const int32_t* src, uint8_t* dst, size_t samples, size_t bits) {
+	switch (bits) {
+	case 8:
+		for (size_t i = 0; i < samples; i++) {
+			dst[i] = (uint8_t) (requantize(src[i], 24) + 128);
+		}
+		break;
+	case 16:
+		for (size_t i = 0; i < samples; i++) {
+			int16_t s = (int16_t) requantize(src[i], 16);
+			memcpy(dst + i * 2, &s, 2);
+		}
+		break;
+	case 24:
+		for (size_t i = 0; i < samples; i++) {
+			int32_t s = requantize(src[i], 8);
+			dst[i * 3] = s & 0xff;
+			dst[i * 3 + 1] = (s >> 8) & 0xff;
+			dst[i * 3 + 2] = (s >> 16) & 0xff;
+		}
+		break;
+	default:
+		memcpy(dst, src, samples * 4);
+		break;
+	}
+}
+
+static int flush(struct export_worker* w, int fd) {
+	if (!w->buf_len) {
+		return 0;
+	}
+
+	if (write_bytes_to_file(fd, w->buf, w->buf_len) != (ssize_t) w->buf_len) {
+		return -1;
+	}
+
+	atomic_fetch_add(&w->ex->bytes_written, w->buf_len);
+	w->buf_len = 0;
+
+	return 0;
+}
+
+// the next up to FRAMES_PER_TICK output frames into w->pcm (track
+// channels), 0 at the end
+static size_t next_block(struct export_worker* w, struct export_file* f) {
+	size_t ch = f->in_channels;
+
+	if (!f->bank) {
+		const uint8_t* src;
+		size_t n = wav_stream_frames(&f->ws, f->cursor, FRAMES_PER_TICK, &src);
+
+		f->kernel->fn(src, w->pcm, n * ch);
+		f->cursor += n;
+
+		return n;
+	}
+
+	size_t got = 0;
+
+	while (got < FRAMES_PER_TICK) {
+		got += resample_pull(&w->rs, w->pcm + got * ch, FRAMES_PER_TICK - got);
+
+		if (got == FRAMES_PER_TICK) {
+			break;
+		}
+
+		size_t want = resample_wants(&w->rs, FRAMES_PER_TICK - got);
+
+		if (!want) {
+			break;
+		}
+
+		if (want > FRAMES_PER_TICK) {
+			want = FRAMES_PER_TICK;
+		}
+
+		const uint8_t* src;
+		size_t read = wav_stream_frames(&f->ws, f->cursor, want, &src);
+
+		if (!read) {
+			resample_finish(&w->rs);
+			continue;
+		}
+
+		f->kernel->fn(src, w->in, read * ch);
+		resample_push(&w->rs, w->in, read);
+		f->cursor += read;
+	}
+
+	return got;
+}
+
+// everything of an opened track after its header, -1 with why set
+static int export_frames(struct export_worker* w, struct export_file* f, const char** why) {
+	size_t frame_bytes = f->out_channels * f->bits / 8;
+	size_t done = 0;
+
+	w->buf_len = 0;
+
+	while (done < f->total) {
+		size_t n = next_block(w, f);
+
+		if (!n) {
+			break;
+		}
+
+		if (n > f->total - done) {
+			n = f->total - done;
+		}
+
+		if (!gain_is_unity(&f->gain)) {
+			gain_apply(&f->gain, w->pcm, n, f->in_channels);
+		}
+
+		const int32_t* frames = map_channels(w, f, n);
+
+		if (w->buf_len + n * frame_bytes > EXPORT_WRITE_BYTES && flush(w, f->fd) < 0) {
+			*why = strerror(errno);
+			return -1;
+		}
+
+		encode(frames, w->buf + w->buf_len, n * f->out_channels, f->bits);
+		w->buf_len += n * frame_bytes;
+		done += n;
+
+		// the pages behind the reader won't be read again
+		wav_stream_release(&f->ws, f->cursor);
+	}
+
+	if (flush(w, f->fd) < 0) {
+		*why = strerror(errno);
+		return -1;
+	}
+
+	// the header promised total frames, a file that got shorter since
+	// it was opened can't keep that
+	if (done != f->total) {
+		*why = "the track got shorter";
+		return -1;
+	}
+
+	return 0;
+}
+
+static int export_track(struct export_worker* w, const struct track* t) {
+	const struct export_options* opt = w->ex->opt;
+	char src[PATH_MAX_LENGTH];
+	char dst[PATH_MAX_LENGTH];
+	char part[PATH_MAX_LENGTH];
+	struct wav_info info = t->info;
+	struct export_file f = { .fd = -1 };
+
+	if (track_path(t, src, sizeof(src)) < 0 ||
+		export_path(opt, t, dst, sizeof(dst)) < 0 ||
+		snprintf(part, sizeof(part), "%s.part", dst) >= (int) sizeof(part)) {
+		fprintf(stderr, "exporting %s: path too long\n", t->name);
+		return -1;
+	}
+
+	if (wav_stream_open(src, &info, &f.ws) < 0) {
+		fprintf(stderr, "exporting %s: opening failed\n", src);
+		return -1;
+	}
+
+	f.fmt = info.fmt;
+	f.kernel = convert_select(&f.fmt);
+	f.in_channels = f.fmt.num_channels;
+	f.out_channels = opt->channels ? opt->channels : f.in_channels;
+	f.bits = opt->bits ? opt->bits : f.fmt.bits_per_sample;
+	f.frames = f.ws.data_len / f.ws.frame_size;
+
+	unsigned int rate = opt->rate ? opt->rate : f.fmt.sample_rate;
+	const char* err = NULL;
+
+	if (!f.kernel || f.in_channels == 0 || f.in_channels > MAX_CHANNELS ||
+		(f.bits != 8 && f.bits != 16 && f.bits != 24 && f.bits != 32)) {
+		err = "unsupported format";
+	} else if (!channels_mappable(f.in_channels, f.out_channels)) {
+		err = "channels can't be mapped";
+	} else if (rate != f.fmt.sample_rate &&
+		!(f.bank = resample_bank_get(f.fmt.sample_rate, rate, opt->quality))) {
+		err = "rate can't be converted";
+	}
+
+	f.total = f.bank ? resample_frames_out(f.bank, f.frames) : f.frames;
+
+	uint64_t data_len = (uint64_t) f.total * f.out_channels * f.bits / 8;
+
+	if (!err && data_len > UINT32_MAX - WAV_HEADER_BYTES) {
+		err = "too long for a wav";
+	}
+
+	struct stat src_sb;
+	struct stat dst_sb;
+
+	// dest is the library itself: the rename would replace the track
+	if (!err && stat(src, &src_sb) == 0 && stat(dst, &dst_sb) == 0 &&
+		src_sb.st_dev == dst_sb.st_dev && src_sb.st_ino == dst_sb.st_ino) {
+		err = "it would replace itself";
+	}
+
+	if (!err && make_dirs(dst) < 0) {
+		err = strerror(errno);
+	}
+
+	if (!err) {
+		f.fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (f.fd < 0) {
+			err = strerror(errno);
+		}
+	}
+
+	if (err) {
+		fprintf(stderr, "exporting %s: %s\n", src, err);
+		wav_stream_close(&f.ws);
+		return -1;
+	}
+
+	struct fmt_sub_chunk out_fmt;
+	wav_pcm_fmt(&out_fmt, f.out_channels, rate, f.bits);
+
+	gain_init(&f.gain, opt->gain, rate);
+
+	if (f.bank) {
+		resample_reset(&w->rs, f.bank, f.in_channels);
+	}
+
+	if (wav_write_header(f.fd, &out_fmt, data_len) < 0 ||
+		lseek(f.fd, WAV_HEADER_BYTES, SEEK_SET) < 0) {
+		err = strerror(errno);
+	} else {
+		export_frames(w, &f, &err);
+	}
+
+	if (close(f.fd) < 0 && !err) {
+		err = strerror(errno);
+	}
+
+	if (!err && rename(part, dst) < 0) {
+		err = strerror(errno);
+	}
+
+	int ret = err ? -1 : 0;
+
+	if (err) {
+		fprintf(stderr, "exporting %s: writing %s failed: %s\n", src, dst, err);
+		unlink(part);
+	} else {
+		atomic_fetch_add(&w->ex->bytes_read, f.ws.data_len);
+	}
+
+	wav_stream_close(&f.ws);
+
+	return ret;
+}
+
+static void* export_worker_main(void* arg) {
+	struct export_worker* w = arg;
+	struct exporter* ex = w->ex;
+
+	for (;;) {
+		size_t i = atomic_fetch_add(&ex->next, 1);
+
+		if (i >= ex->pl->len) {
+			break;
+		}
+
+		if (export_track(w, &ex->pl->items[i]) < 0) {
+			atomic_fetch_add(&ex->failed, 1);
+		}
+
+		atomic_fetch_add(&ex->done, 1);
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	ex->running--;
+	pthread_cond_signal(&ex->finished);
+	pthread_mutex_unlock(&ex->lock);
+
+	return NULL;
+}
+
+static void report(struct exporter* ex, uint64_t started_ns, int last) {
+	double secs = (telemetry_now() - started_ns) / 1e9;
+	size_t done = atomic_load(&ex->done);
+	double mb_read = atomic_load(&ex->bytes_read) / 1e6;
+	double mb_written = atomic_load(&ex->bytes_written) / 1e6;
+
+	if (secs <= 0) {
+		secs = 1e-9;
+	}
+
+	printf("\rexported %zu/%zu files  %.1f files/s  %.1f MB/s read  %.1f MB/s written ",
+		done, ex->pl->len, done / secs, mb_read / secs, mb_written / secs);
+
+	if (last) {
+		printf("\n%zu failed, %.1f MB written in %.2f s\n",
+			atomic_load(&ex->failed), mb_written, secs);
+	}
+
+	fflush(stdout);
+}
+
+int export_playlist(const struct playlist* pl, const struct export_options* opt) {
+	if (export_check(opt) < 0) {
+		return -1;
+	}
+
+	if (mkdir(opt->dest, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "creating %s failed: %s\n", opt->dest, strerror(errno));
+		return -1;
+	}
+
+	// decoding and resampling keep a core busy, the writes are few and
+	// large, so one worker per core
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = opt->jobs ? opt->jobs : (cpus > 0 ? (size_t) cpus : 1);
+
+	if (count > EXPORT_MAX_WORKERS) {
+		count = EXPORT_MAX_WORKERS;
+	}
+
+	if (count > pl->len) {
+		count = pl->len;
+	}
+
+	struct exporter ex = { .pl = pl, .opt = opt };
+	struct export_worker* workers = calloc(count ? count : 1, sizeof(*workers));
+	size_t started = 0;
+
+	if (!workers) {
+		return -1;
+	}
+
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.finished, NULL);
+
+	uint64_t started_ns = telemetry_now();
+
+	for (size_t i = 0; i < count; i++) {
+		workers[i].ex = &ex;
+		workers[i].buf = malloc(EXPORT_WRITE_BYTES);
+
+		if (!workers[i].buf) {
+			break;
+		}
+
+		pthread_mutex_lock(&ex.lock);
+		ex.running++;
+		pthread_mutex_unlock(&ex.lock);
+
+		if (pthread_create(&workers[i].thread, NULL,
+			export_worker_main, &workers[i]) != 0) {
+			pthread_mutex_lock(&ex.lock);
+			ex.running--;
+			pthread_mutex_unlock(&ex.lock);
+			free(workers[i].buf);
+			workers[i].buf = NULL;
+			break;
+		}
+
+		started++;
+	}
+
+	if (count && !started) {
+		fprintf(stderr, "starting export workers failed\n");
+		free(workers);
+		pthread_cond_destroy(&ex.finished);
+		pthread_mutex_destroy(&ex.lock);
+		return -1;
+	}
+
+	// the line is only redrawn on a terminal, a log gets the summary
+	int live = isatty(STDOUT_FILENO);
+
+	pthread_mutex_lock(&ex.lock);
+
+	while (ex.running) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += EXPORT_REPORT_MS * 1000000L;
+
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&ex.finished, &ex.lock, &ts);
+
+		if (live && ex.running) {
+			pthread_mutex_unlock(&ex.lock);
+			report(&ex, started_ns, 0);
+			pthread_mutex_lock(&ex.lock);
+		}
+	}
+
+	pthread_mutex_unlock(&ex.lock);
+
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].buf);
+	}
+
+	report(&ex, started_ns, 1);
+
+	free(workers);
+	pthread_cond_destroy(&ex.finished);
+	pthread_mutex_destroy(&ex.lock);
+
+	return (int) atomic_load(&ex.failed);
+}
@@ -0,0 +1,48 @@
+/*
+offline export (transcode) of the playlist
+
+every track is read, converted to S32, gained, resampled, remapped to
+the channel count asked for and encoded to the bit depth asked for,
+into dest/ under the same relative path it has in the library. a pool
+of worker threads takes files one at a time, a file is never split, so
+throughput follows the number of cores as long as there are files left
+
+a worker reads through the file's mapping (released behind it, like
+playback) and encodes into one big buffer written out with a single
+write() when full, so each output file is a few large sequential
+writes. the exact length is known before the first frame, the header
+goes first and is never rewritten. a file is written as name.part and
+renamed once complete, an interrupted export leaves no truncated wav
+
+the thread that started the export reports progress (files/s, MB/s)
+until the workers are done
+*/
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "types.h"
+
+#define EXPORT_MAX_WORKERS 16
+#define EXPORT_WRITE_BYTES (4 << 20) // output buffered before a write()
+#define EXPORT_REPORT_MS 250 // progress line refresh
+
+struct export_options {
+	const char* dest; // directory the library is recreated under
+	const char* root; // library root, stripped from the tracks' paths
+	unsigned int rate; // 0: the track's own
+	unsigned int bits; // 8, 16, 24 or 32, 0: the track's own
+	unsigned int channels; // 0: the track's own
+	float gain;
+	int quality; // enum resample_quality
+	size_t jobs; // worker threads, 0: one per core
+};
+
+// -1 if an option can't be used (everything else is per file)
+int export_check(const struct export_options* opt);
+
+// exports every track of pl, returns how many failed (-1 if none could
+// even be started)
+int export_playlist(const struct playlist* pl, const struct export_options* opt);
+
+#endif
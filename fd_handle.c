@@ -3,8 +3,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ECHO_FILE_NAME "echo.wav"
+#define RELEASE_WINDOW (1 << 20) // played bytes kept mapped before madvise
+#define PROBE_BYTES 4096 // read at once, the headers of most files fit
+#define PROBE_MAX_CHUNKS 256 // chunk headers walked before giving up
+#define TAGS_MAX_BYTES (64 << 10) // of a LIST chunk
+#define SEEK_READAHEAD (256 << 10) // bytes asked for right after a seek
 
 ssize_t read_bytes_from_file(int fd, void* buf, size_t size) {
 	ssize_t total_read = 0;;
@@ -30,7 +37,6 @@ ssize_t read_bytes_from_file(int fd, void* buf, size_t size) {
 
 ssize_t write_bytes_to_file(int fd, const void* buf, size_t size) {
 	ssize_t total_written = 0;
-	ssize_t n;
 
 	while (total_written < size) {
 		ssize_t n = write(fd, 
@@ -97,6 +103,206 @@ int read_data_chunk
 	return -1;
 }
 
+/* --- PROBING --- */
+
+// a chunk header (or payload) at pos, from the probe buffer when it's
+// in there, from the file otherwise
+static int probe_read
+(
+	int fd,
+	const uint8_t* buf,
+	size_t buf_len,
+	uint64_t pos,
+	void* out,
+	size_t len
+)
+{
+	if (pos + len <= buf_len) {
+		memcpy(out, buf + pos, len);
+		return 0;
+	}
+
+	return pread(fd, out, len, pos) == (ssize_t) len ? 0 : -1;
+}
+
+// reads the first PROBE_BYTES at once and walks every chunk header
+// from there. chunks are only read from the file again when they start
+// past that (e.g. a LIST after the data chunk)
+int wav_probe(int fd, struct wav_info* info, struct wav_chunks* chunks) {
+	uint8_t buf[PROBE_BYTES];
+	struct riff_header riff;
+	struct stat sb;
+	ssize_t n = pread(fd, buf, sizeof(buf), 0);
+
+	if (n < (ssize_t) sizeof(riff) || fstat(fd, &sb) < 0) {
+		return -1;
+	}
+
+	memcpy(&riff, buf, sizeof(riff));
+
+	if (memcmp(riff.chunk_id, "RIFF", 4) != 0 || memcmp(riff.format, "WAVE", 4) != 0) {
+		return -1;
+	}
+
+	memset(info, 0, sizeof(*info));
+
+	if (chunks) {
+		chunks->count = 0;
+	}
+
+	info->mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	info->size = sb.st_size;
+
+	// the riff size is often wrong in files written as a stream
+	uint64_t end = sb.st_size;
+	uint64_t pos = sizeof(riff);
+	int have_fmt = 0;
+	int have_data = 0;
+
+	for (int i = 0; i < PROBE_MAX_CHUNKS && pos + sizeof(struct chunk_header) <= end; i++) {
+		struct chunk_header chunk;
+		uint64_t payload = pos + sizeof(chunk);
+
+		if (probe_read(fd, buf, n, pos, &chunk, sizeof(chunk)) < 0) {
+			break;
+		}
+
+		if (chunks) {
+			if (chunks->count < WAV_MAX_CHUNKS) {
+				struct wav_chunk* c = &chunks->chunk[chunks->count];
+
+				memcpy(c->id, chunk.id, 4);
+				c->size = chunk.size;
+				c->offset = payload;
+			}
+
+			chunks->count++;
+		}
+
+		if (memcmp(chunk.id, "fmt ", 4) == 0 && chunk.size >= 16) {
+			uint8_t fmt[26];
+			size_t len = chunk.size < sizeof(fmt) ? chunk.size : sizeof(fmt);
+
+			if (probe_read(fd, buf, n, payload, fmt, len) < 0) {
+				return -1;
+			}
+
+			// the 16 bytes every fmt chunk starts with, whatever its size
+			memcpy(info->fmt.subchunk1_id, chunk.id, 4);
+			info->fmt.subchunk1_size = chunk.size;
+			memcpy(&info->fmt.audio_format, fmt, 16);
+
+			// WAVE_FORMAT_EXTENSIBLE: the sub format guid starts with it
+			if (info->fmt.audio_format == 0xFFFE && len >= 26) {
+				memcpy(&info->fmt.audio_format, fmt + 24, 2);
+			}
+
+			have_fmt = 1;
+		} else if (memcmp(chunk.id, "data", 4) == 0) {
+			info->data_offset = payload;
+			info->data_len = chunk.size;
+
+			if (info->data_len > end - payload) {
+				info->data_len = end - payload;
+			}
+
+			have_data = 1;
+		} else if (memcmp(chunk.id, "LIST", 4) == 0 && chunk.size >= 4 &&
+			info->tags_len == 0) {
+			char form[4];
+
+			// other lists (adtl, ...) hold no tags
+			if (probe_read(fd, buf, n, payload, form, sizeof(form)) == 0 &&
+				memcmp(form, "INFO", 4) == 0) {
+				info->tags_offset = payload;
+				info->tags_len = chunk.size;
+			}
+		}
+
+		// chunks are word aligned
+		pos = payload + chunk.size + (chunk.size & 1);
+	}
+
+	return have_fmt && have_data ? 0 : -1;
+}
+
+const struct wav_chunk* wav_find_chunk(const struct wav_chunks* chunks, const char* id, size_t from) {
+	size_t count = chunks->count < WAV_MAX_CHUNKS ? chunks->count : WAV_MAX_CHUNKS;
+
+	for (size_t i = from; i < count; i++) {
+		if (memcmp(chunks->chunk[i].id, id, 4) == 0) {
+			return &chunks->chunk[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void copy_tag(char* dst, const uint8_t* src, size_t len) {
+	if (len >= TAG_LENGTH) {
+		len = TAG_LENGTH - 1;
+	}
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+// one read of the LIST/INFO chunk, straight from where the probe found it
+int wav_read_tags(const char* path, const struct wav_info* info, struct wav_tags* tags) {
+	memset(tags, 0, sizeof(*tags));
+
+	if (info->tags_len < 4) {
+		return 0;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	size_t len = info->tags_len < TAGS_MAX_BYTES ? info->tags_len : TAGS_MAX_BYTES;
+	uint8_t* buf = malloc(len);
+
+	// the file changed since it was probed
+	if (!buf || pread(fd, buf, len, info->tags_offset) != (ssize_t) len ||
+		memcmp(buf, "INFO", 4) != 0) {
+		free(buf);
+		close(fd);
+		return -1;
+	}
+
+	for (size_t pos = 4; pos + sizeof(struct chunk_header) <= len; ) {
+		struct chunk_header sub;
+		memcpy(&sub, buf + pos, sizeof(sub));
+		pos += sizeof(sub);
+
+		size_t size = sub.size < len - pos ? sub.size : len - pos;
+		const uint8_t* text = buf + pos;
+
+		if (memcmp(sub.id, "INAM", 4) == 0) {
+			copy_tag(tags->title, text, size);
+		} else if (memcmp(sub.id, "IART", 4) == 0) {
+			copy_tag(tags->artist, text, size);
+		} else if (memcmp(sub.id, "IPRD", 4) == 0) {
+			copy_tag(tags->album, text, size);
+		} else if (memcmp(sub.id, "ICRD", 4) == 0) {
+			copy_tag(tags->date, text, size);
+		} else if (memcmp(sub.id, "IGNR", 4) == 0) {
+			copy_tag(tags->genre, text, size);
+		} else if (memcmp(sub.id, "ICMT", 4) == 0) {
+			copy_tag(tags->comment, text, size);
+		}
+
+		pos += size + (size & 1);
+	}
+
+	free(buf);
+	close(fd);
+
+	return 0;
+}
+
 int read_wav_from_filename
 (
 	const char* filename,
@@ -108,23 +314,21 @@ int read_wav_from_filename
 	struct read_wav_result* read_result
 )
 {
-	int file = open(filename, O_RDONLY | O_CREAT, 0644);
-	ssize_t n;
+	int file = open(filename, O_RDONLY | O_CLOEXEC);
+	struct wav_info info;
 
 	if (file < 0) {
 		perror("open");
 		return -1;
 	}
 
-	if (!riff) {
-		if (lseek(file, sizeof(struct riff_header), SEEK_CUR) == -1) {
-			perror("lseek riff_header");
-			return -1;
-		}
-	} else {
-		n = read_bytes_from_file(file, riff, sizeof(struct riff_header));
+	if (wav_probe(file, &info, NULL) < 0) {
+		close(file);
+		return -1;
+	}
 
-		if (n != sizeof(struct riff_header)) {
+	if (riff) {
+		if (pread(file, riff, sizeof(*riff), 0) != sizeof(*riff)) {
 			close(file);
 			return -1;
 		}
@@ -134,25 +338,45 @@ int read_wav_from_filename
 		}
 	}
 
-	if (!fmt) {
-		if (lseek(file, sizeof(struct fmt_sub_chunk), SEEK_CUR) == -1) {
-			perror("lseek fmt_sub_chunk");
-			return -1;
+	if (fmt) {
+		*fmt = info.fmt;
+
+		if (read_result) {
+			read_result->fmt = 1;
 		}
-	} else {
-		n = read_bytes_from_file(file, fmt, sizeof(struct fmt_sub_chunk));
+	}
+
+	if (data) {
+		memcpy(data->subchunk2_id, "data", 4);
+		data->subchunk2_size = info.data_len;
+	}
+
+	// the offset is left at the start of the samples
+	if (lseek(file, info.data_offset, SEEK_SET) < 0) {
+		perror("lseek");
+		close(file);
+		return -1;
+	}
+
+	if (data_buf) {
+		*data_buf = malloc(info.data_len);
 
-		if (n != sizeof(struct fmt_sub_chunk)) {
+		if (!*data_buf) {
+			perror("malloc");
 			close(file);
 			return -1;
 		}
 
-		if (read_result) {
-			read_result->fmt = 1;
+		ssize_t n = read_bytes_from_file(file, *data_buf, info.data_len);
+
+		if (n != (ssize_t) info.data_len) {
+			free(*data_buf);
+			close(file);
+			return -1;
 		}
-	}
 
-	read_data_chunk(file, data, data_buf, buf_len);
+		*buf_len = (size_t) n;
+	}
 
 	if (data && read_result) {
 		read_result->data = 1;
@@ -161,6 +385,222 @@ int read_wav_from_filename
 	return file;
 }
 
+// reads only the headers of name, relative to the directory dirfd
+// (used by the library scanner, which never builds full paths to open)
+int read_wav_header_at
+(
+	int dirfd,
+	const char* name,
+	struct wav_info* info,
+	struct wav_chunks* chunks
+)
+{
+	int file = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+
+	if (file < 0) {
+		return -1;
+	}
+
+	int ret = wav_probe(file, info, chunks);
+	close(file);
+
+	return ret;
+}
+
+/* --- STREAMING --- */
+
+static atomic_uint_least64_t next_stream_id = 1;
+
+// info is what's already known about the file (e.g. from the library
+// index), it's only probed again when its mtime or size changed
+int wav_stream_open
+(
+	const char* filename,
+	struct wav_info* info,
+	struct wav_stream* ws
+)
+{
+	int file = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+
+	if (file < 0 || fstat(file, &sb) < 0) {
+		perror("open");
+
+		if (file >= 0) {
+			close(file);
+		}
+
+		return -1;
+	}
+
+	int64_t mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+
+	if ((info->mtime != mtime || info->size != (uint64_t) sb.st_size ||
+		info->data_offset == 0) && wav_probe(file, info, NULL) < 0) {
+		close(file);
+		return -1;
+	}
+
+	if (info->fmt.byte_align == 0 || info->data_len < info->fmt.byte_align) {
+		close(file);
+		return -1;
+	}
+
+	uint8_t* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(file);
+		return -1;
+	}
+
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	// truncated files are played up to their last complete frame
+	ws->fd = file;
+	ws->id = atomic_fetch_add(&next_stream_id, 1);
+	ws->map = map;
+	ws->map_len = sb.st_size;
+	ws->data = map + info->data_offset;
+	ws->frame_size = info->fmt.byte_align;
+	ws->data_len = info->data_len - (info->data_len % ws->frame_size);
+	ws->released = 0;
+
+	return 0;
+}
+
+// points *out at up to frames frames starting at frame
+// returns how many frames are available there
+size_t wav_stream_frames
+(
+	struct wav_stream* ws,
+	size_t frame,
+	size_t frames,
+	const uint8_t** out
+)
+{
+	size_t total = ws->data_len / ws->frame_size;
+
+	if (frame >= total) {
+		return 0;
+	}
+
+	if (frames > total - frame) {
+		frames = total - frame;
+	}
+
+	*out = ws->data + frame * ws->frame_size;
+	return frames;
+}
+
+// drops the pages that were already played, so the resident size
+// stays bounded no matter how long the track is
+void wav_stream_release(struct wav_stream* ws, size_t frame) {
+	size_t played = frame * ws->frame_size;
+
+	if (played < ws->released + RELEASE_WINDOW) {
+		return;
+	}
+
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = (size_t) (ws->data - ws->map) + ws->released;
+	size_t end = (size_t) (ws->data - ws->map) + played;
+
+	start &= ~(page - 1);
+	end &= ~(page - 1);
+
+	if (end > start) {
+		madvise(ws->map + start, end - start, MADV_DONTNEED);
+	}
+
+	ws->released = played;
+}
+
+// playback jumps from frame from to frame to: what was kept mapped
+// behind from is handed back, and the pages at to are asked for right
+// away. the decoder hands back what it released before a seek, so at
+// most RELEASE_WINDOW is left behind from: neither depends on the size
+// of the file or on where playback is
+void wav_stream_seek(struct wav_stream* ws, size_t from, size_t to) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t base = (size_t) (ws->data - ws->map);
+	size_t start = (base + ws->released) & ~(page - 1);
+	size_t end = (base + from * ws->frame_size) & ~(page - 1);
+
+	if (end > start) {
+		madvise(ws->map + start, end - start, MADV_DONTNEED);
+	}
+
+	ws->released = to * ws->frame_size;
+
+	if (ws->released > ws->data_len) {
+		ws->released = ws->data_len;
+	}
+
+	start = (base + ws->released) & ~(page - 1);
+	size_t len = ws->map_len - start;
+
+	if (len > SEEK_READAHEAD) {
+		len = SEEK_READAHEAD;
+	}
+
+	if (len) {
+		madvise(ws->map + start, len, MADV_WILLNEED);
+	}
+}
+
+void wav_stream_close(struct wav_stream* ws) {
+	if (!ws->map) {
+		return;
+	}
+
+	munmap(ws->map, ws->map_len);
+	close(ws->fd);
+	memset(ws, 0, sizeof(*ws));
+}
+
+/* --- WRITING --- */
+
+void wav_pcm_fmt
+(
+	struct fmt_sub_chunk* fmt,
+	unsigned int channels,
+	unsigned int rate,
+	unsigned int bits
+)
+{
+	memcpy(fmt->subchunk1_id, "fmt ", 4);
+	fmt->subchunk1_size = 16;
+	fmt->audio_format = 1;
+	fmt->num_channels = channels;
+	fmt->sample_rate = rate;
+	fmt->byte_align = channels * bits / 8;
+	fmt->byte_rate = rate * fmt->byte_align;
+	fmt->bits_per_sample = bits;
+}
+
+int wav_write_header(int fd, const struct fmt_sub_chunk* fmt, uint64_t data_len) {
+	uint8_t header[WAV_HEADER_BYTES];
+	struct riff_header riff = { {'R','I','F','F'}, 0, {'W','A','V','E'} };
+	struct data_sub_chunk data = { {'d','a','t','a'}, 0 };
+
+	if (data_len > UINT32_MAX - (WAV_HEADER_BYTES - 8)) {
+		return -1;
+	}
+
+	riff.chunk_size = WAV_HEADER_BYTES - 8 + data_len;
+	data.subchunk2_size = data_len;
+
+	memcpy(header, &riff, sizeof(riff));
+	memcpy(header + sizeof(riff), fmt, sizeof(*fmt));
+	memcpy(header + sizeof(riff) + sizeof(*fmt), &data, sizeof(data));
+
+	if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+		return -1;
+	}
+
+	return 0;
+}
 
 int echo_wav
 (
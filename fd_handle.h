@@ -25,6 +25,65 @@ int read_wav_from_filename
 	struct read_wav_result* read_result
 );
 
+// reads the headers of an open file (any fmt chunk size,
+// WAVE_FORMAT_EXTENSIBLE, chunks after data), and indexes its chunks
+// into chunks unless it's NULL
+int wav_probe(int fd, struct wav_info* info, struct wav_chunks* chunks);
+
+int read_wav_header_at
+(
+	int dirfd,
+	const char* name,
+	struct wav_info* info,
+	struct wav_chunks* chunks
+);
+
+// the first chunk with that id at or after chunk[from], NULL if none
+const struct wav_chunk* wav_find_chunk(const struct wav_chunks* chunks, const char* id, size_t from);
+
+// fills tags from the LIST/INFO chunk info points at in path (empty
+// strings if none)
+int wav_read_tags(const char* path, const struct wav_info* info, struct wav_tags* tags);
+
+/* --- STREAMING --- */
+
+int wav_stream_open
+(
+	const char* filename,
+	struct wav_info* info,
+	struct wav_stream* ws
+);
+
+size_t wav_stream_frames
+(
+	struct wav_stream* ws,
+	size_t frame,
+	size_t frames,
+	const uint8_t** out
+);
+
+void wav_stream_release(struct wav_stream* ws, size_t frame);
+void wav_stream_seek(struct wav_stream* ws, size_t from, size_t to);
+void wav_stream_close(struct wav_stream* ws);
+
+/* --- WRITING --- */
+
+#define WAV_HEADER_BYTES 44 // riff, 16 byte fmt and data chunk headers
+
+// a plain pcm fmt chunk (integer samples, bits 8, 16, 24 or 32)
+void wav_pcm_fmt
+(
+	struct fmt_sub_chunk* fmt,
+	unsigned int channels,
+	unsigned int rate,
+	unsigned int bits
+);
+
+// writes the header of a file holding data_len bytes of fmt frames at
+// the start of fd (the frames follow it). -1 if they can't fit in a
+// riff chunk or the write failed
+int wav_write_header(int fd, const struct fmt_sub_chunk* fmt, uint64_t data_len);
+
 int echo_wav
 (
 	const struct riff_header* riff,
@@ -0,0 +1,152 @@
+#include "gain.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+typedef void (*gain_fn)(int32_t* buf, size_t samples, float gain);
+
+static inline int32_t clamp_s32(int64_t v) {
+	if (v > INT32_MAX) {
+		return INT32_MAX;
+	}
+
+	if (v < INT32_MIN) {
+		return INT32_MIN;
+	}
+
+	return (int32_t) v;
+}
+
+static void gain_scalar(int32_t* buf, size_t samples, float gain) {
+	for (size_t i = 0; i < samples; i++) {
+		int64_t v = (int64_t)(buf[i] * gain);
+		buf[i] = clamp_s32(v);
+	}
+}
+
+#ifdef HAVE_X86
+
+// same result as gain_scalar: truncation, and anything at or above
+// 2^31 saturates to INT32_MAX instead of wrapping
+__attribute__((target("sse2")))
+static void gain_sse2(int32_t* buf, size_t samples, float gain) {
+	const __m128 g = _mm_set1_ps(gain);
+	const __m128 lo = _mm_set1_ps(-2147483648.0f);
+	const __m128 hi = _mm_set1_ps(2147483648.0f);
+	const __m128i max = _mm_set1_epi32(INT32_MAX);
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (buf + i));
+		__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(v), g);
+		__m128i over = _mm_castps_si128(_mm_cmpge_ps(x, hi));
+		__m128i r = _mm_cvttps_epi32(_mm_max_ps(x, lo));
+
+		r = _mm_or_si128(_mm_andnot_si128(over, r), _mm_and_si128(over, max));
+		_mm_storeu_si128((__m128i*) (buf + i), r);
+	}
+
+	gain_scalar(buf + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void gain_avx2(int32_t* buf, size_t samples, float gain) {
+	const __m256 g = _mm256_set1_ps(gain);
+	const __m256 lo = _mm256_set1_ps(-2147483648.0f);
+	const __m256 hi = _mm256_set1_ps(2147483648.0f);
+	const __m256i max = _mm256_set1_epi32(INT32_MAX);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (buf + i));
+		__m256 x = _mm256_mul_ps(_mm256_cvtepi32_ps(v), g);
+		__m256i over = _mm256_castps_si256(_mm256_cmp_ps(x, hi, _CMP_GE_OQ));
+		__m256i r = _mm256_cvttps_epi32(_mm256_max_ps(x, lo));
+
+		r = _mm256_blendv_epi8(r, max, over);
+		_mm256_storeu_si256((__m256i*) (buf + i), r);
+	}
+
+	gain_scalar(buf + i, samples - i, gain);
+}
+
+#endif
+
+static gain_fn kernel = gain_scalar;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// export workers set their gain up at the same time
+static void pick_kernel(void) {
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = gain_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel = gain_sse2;
+	}
+#endif
+}
+
+static gain_fn gain_kernel(void) {
+	pthread_once(&kernel_once, pick_kernel);
+	return kernel;
+}
+
+void gain_init(struct gain_stage* g, float gain, unsigned int sample_rate) {
+	g->current = gain;
+	g->target = gain;
+	g->step = 0.0f;
+	g->ramp_left = 0;
+	g->ramp_frames = (size_t) sample_rate * GAIN_RAMP_MS / 1000;
+
+	if (!g->ramp_frames) {
+		g->ramp_frames = 1;
+	}
+
+	gain_kernel();
+}
+
+// starts a ramp from wherever the gain is right now
+void gain_set(struct gain_stage* g, float target) {
+	if (target == g->target) {
+		return;
+	}
+
+	g->target = target;
+	g->ramp_left = g->ramp_frames;
+	g->step = (target - g->current) / (float) g->ramp_frames;
+}
+
+int gain_is_unity(const struct gain_stage* g) {
+	return g->ramp_left == 0 && g->current == 1.0f;
+}
+
+void gain_apply
+(
+	struct gain_stage* g,
+	int32_t* buf,
+	size_t frames,
+	size_t channels
+)
+{
+	size_t frame = 0;
+
+	// ramp: every frame gets its own gain
+	for (; frame < frames && g->ramp_left; frame++) {
+		g->current += g->step;
+
+		if (--g->ramp_left == 0) {
+			g->current = g->target;
+		}
+
+		gain_scalar(buf + frame * channels, channels, g->current);
+	}
+
+	if (frame == frames || g->current == 1.0f) {
+		return;
+	}
+
+	gain_kernel()(buf + frame * channels, (frames - frame) * channels,
+		g->current);
+}
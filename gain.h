@@ -0,0 +1,37 @@
+/*
+live gain stage
+
+gain is applied per block on the playback path (decode thread), so a
+volume change is heard within one ring of audio. a change never jumps:
+the gain moves linearly to the new value over GAIN_RAMP_MS, frame by
+frame, and only the constant part of a block goes through the simd kernel
+*/
+
+#ifndef GAIN_H
+#define GAIN_H
+
+#include "types.h"
+
+#define GAIN_RAMP_MS 10
+
+struct gain_stage {
+	float current; // gain of the last processed frame
+	float target; // gain being ramped to
+	float step; // added to current on every frame of a ramp
+	size_t ramp_left; // frames until current reaches target
+	size_t ramp_frames; // length of a full ramp at the track's rate
+};
+
+void gain_init(struct gain_stage* g, float gain, unsigned int sample_rate);
+void gain_set(struct gain_stage* g, float target);
+int gain_is_unity(const struct gain_stage* g);
+
+void gain_apply
+(
+	struct gain_stage* g,
+	int32_t* buf,
+	size_t frames,
+	size_t channels
+);
+
+#endif
@@ -0,0 +1,309 @@
+#include "index.h"
+#include "fd_handle.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// fnv-1a, only to give every library root (or track) its own file name
+static uint64_t hash_path(const char* s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (uint8_t) *s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int make_dir(const char* path) {
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int cache_file_path
+(
+	const char* prefix,
+	const char* path,
+	uint64_t salt,
+	char* out,
+	size_t len
+)
+{
+	char real[PATH_MAX];
+	char dir[PATH_MAX_LENGTH];
+	const char* cache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+
+	if (!realpath(path, real)) {
+		return -1;
+	}
+
+	if (cache && *cache) {
+		snprintf(dir, sizeof(dir), "%s", cache);
+	} else if (home && *home) {
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	} else {
+		return -1;
+	}
+
+	if (make_dir(dir) < 0 ||
+		strlen(dir) + sizeof("/wav_player") > sizeof(dir)) {
+		return -1;
+	}
+
+	strcat(dir, "/wav_player");
+
+	if (make_dir(dir) < 0) {
+		return -1;
+	}
+
+	int n = snprintf(out, len, "%s/%s-%016llx", dir, prefix,
+		(unsigned long long) (hash_path(real) ^ salt));
+
+	return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+int index_file_path(const char* root, int recursive, char* out, size_t len) {
+	return cache_file_path("index", root, (uint64_t) recursive, out, len);
+}
+
+// everything is checked once here, so lookups can trust the offsets
+static int index_valid
+(
+	const struct library_index* idx,
+	const char* root,
+	int recursive
+)
+{
+	const struct index_header* hdr = idx->hdr;
+
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != INDEX_VERSION ||
+		hdr->recursive != (uint32_t) recursive) {
+		return 0;
+	}
+
+	size_t entries = idx->map_len - sizeof(*hdr);
+
+	if (hdr->count > entries / sizeof(struct index_entry) ||
+		hdr->strings_len != entries - hdr->count * sizeof(struct index_entry) ||
+		hdr->strings_len == 0 || idx->strings[hdr->strings_len - 1] != '\0') {
+		return 0;
+	}
+
+	if (hdr->root >= hdr->strings_len ||
+		strcmp(idx->strings + hdr->root, root) != 0) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < hdr->count; i++) {
+		const struct index_entry* e = &idx->entries[i];
+
+		if (e->path >= hdr->strings_len || e->name <= e->path ||
+			e->name >= hdr->strings_len || idx->strings[e->name - 1] != '/') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int index_open
+(
+	const char* file,
+	const char* root,
+	int recursive,
+	struct library_index* idx
+)
+{
+	memset(idx, 0, sizeof(*idx));
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(struct index_header)) {
+		close(fd);
+		return -1;
+	}
+
+	uint8_t* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	idx->map = map;
+	idx->map_len = sb.st_size;
+	idx->hdr = (const struct index_header*) map;
+	idx->entries = (const struct index_entry*) (map + sizeof(*idx->hdr));
+	idx->count = idx->hdr->count;
+	idx->strings = (const char*) (idx->entries + idx->count);
+
+	if (idx->count > sb.st_size / sizeof(struct index_entry) ||
+		!index_valid(idx, root, recursive)) {
+		index_close(idx);
+		return -1;
+	}
+
+	return 0;
+}
+
+void index_close(struct library_index* idx) {
+	if (!idx->map) {
+		return;
+	}
+
+	munmap(idx->map, idx->map_len);
+	memset(idx, 0, sizeof(*idx));
+}
+
+const struct index_entry* index_find(const struct library_index* idx, const char* path) {
+	size_t lo = 0;
+	size_t hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(path, idx->strings + idx->entries[mid].path);
+
+		if (cmp == 0) {
+			return &idx->entries[mid];
+		}
+
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+int index_load_playlist(const struct library_index* idx, struct playlist* pl) {
+	char path[PATH_MAX_LENGTH];
+
+	for (size_t i = 0; i < idx->count; i++) {
+		const struct index_entry* e = &idx->entries[i];
+		size_t dir_len = e->name - e->path;
+		struct track t;
+
+		// the directory is everything before the name and its /
+		if (dir_len >= sizeof(path)) {
+			return -1;
+		}
+
+		memcpy(path, idx->strings + e->path, dir_len - 1);
+		path[dir_len - 1] = '\0';
+		t.dir = path;
+		t.name = idx->strings + e->name;
+		t.duration = e->duration;
+		t.info = e->info;
+		t.loudness = e->loudness;
+		t.peak = e->peak;
+
+		if (playlist_push(pl, t) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// written next to file and renamed over it, so a reader never sees
+// half an index
+int index_write
+(
+	const char* file,
+	const char* root,
+	int recursive,
+	const struct playlist* pl
+)
+{
+	char tmp[PATH_MAX_LENGTH];
+	struct index_header hdr = {0};
+	size_t strings_len = strlen(root) + 1;
+
+	for (size_t i = 0; i < pl->len; i++) {
+		strings_len += strlen(pl->items[i].dir) + strlen(pl->items[i].name) + 2;
+	}
+
+	struct index_entry* entries = calloc(pl->len ? pl->len : 1, sizeof(*entries));
+	char* strings = malloc(strings_len);
+
+	if (!entries || !strings) {
+		free(entries);
+		free(strings);
+		return -1;
+	}
+
+	size_t off = strlen(root) + 1;
+	memcpy(strings, root, off);
+
+	for (size_t i = 0; i < pl->len; i++) {
+		const struct track* t = &pl->items[i];
+		size_t dir_len = strlen(t->dir);
+		size_t name_len = strlen(t->name);
+
+		memcpy(strings + off, t->dir, dir_len);
+		strings[off + dir_len] = '/';
+		memcpy(strings + off + dir_len + 1, t->name, name_len + 1);
+		entries[i].path = off;
+		entries[i].name = off + dir_len + 1;
+		entries[i].duration = t->duration;
+		entries[i].info = t->info;
+		entries[i].loudness = t->loudness;
+		entries[i].peak = t->peak;
+		off += dir_len + name_len + 2;
+	}
+
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.recursive = recursive;
+	hdr.count = pl->len;
+	hdr.strings_len = strings_len;
+	hdr.root = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int ret = -1;
+
+	if (fd >= 0) {
+		size_t entries_len = pl->len * sizeof(*entries);
+
+		if (write_bytes_to_file(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+			write_bytes_to_file(fd, entries, entries_len) == (ssize_t) entries_len &&
+			write_bytes_to_file(fd, strings, strings_len) == (ssize_t) strings_len) {
+			ret = 0;
+		}
+
+		close(fd);
+
+		if (ret == 0 && rename(tmp, file) < 0) {
+			ret = -1;
+		}
+
+		if (ret < 0) {
+			unlink(tmp);
+		}
+	}
+
+	free(entries);
+	free(strings);
+
+	return ret;
+}
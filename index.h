@@ -0,0 +1,84 @@
+/*
+on-disk library index
+
+one file per library root (and recursive flag) in the user's cache
+directory, with what the scanner found out about every .wav: its mtime
+and size, to tell whether it changed since, its fmt chunk, where its
+data chunk and its LIST/INFO tags are, its duration, and its loudness
+once measured
+
+it's mapped read only at startup, so the playlist is ready without
+touching the library at all. the scanner then only opens the files
+whose mtime or size don't match their entry (see library.h)
+
+layout:
+
+struct index_header
+struct index_entry[count] // sorted by path
+char strings[strings_len] // nul terminated root and paths
+*/
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "types.h"
+
+#define INDEX_MAGIC "WAVINDEX"
+#define INDEX_VERSION 5
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recursive;
+	uint64_t count; // entries
+	uint64_t strings_len;
+	uint64_t root; // offset of the library root in strings
+};
+
+struct index_entry {
+	uint64_t path; // offset in strings
+	uint64_t name; // offset in strings of the file name inside path
+	double duration;
+	struct wav_info info;
+	float loudness; // see loudness.h
+	float peak;
+};
+
+// a file of the player's cache directory (created if needed) for path:
+// prefix-HASH, HASH of path's real path and salt. -1 if there is no
+// cache directory or path doesn't exist
+int cache_file_path
+(
+	const char* prefix,
+	const char* path,
+	uint64_t salt,
+	char* out,
+	size_t len
+);
+
+// where the index of root lives, -1 if there is no cache directory
+int index_file_path(const char* root, int recursive, char* out, size_t len);
+
+int index_open
+(
+	const char* file,
+	const char* root,
+	int recursive,
+	struct library_index* idx
+);
+
+void index_close(struct library_index* idx);
+
+const struct index_entry* index_find(const struct library_index* idx, const char* path);
+int index_load_playlist(const struct library_index* idx, struct playlist* pl);
+
+// pl must be sorted by path
+int index_write
+(
+	const char* file,
+	const char* root,
+	int recursive,
+	const struct playlist* pl
+);
+
+#endif
@@ -0,0 +1,429 @@
+#include "library.h"
+#include "index.h"
+#include "scanner.h"
+#include "prefetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a change made by the watcher while a rescan runs, the rescan may have
+// walked past it already
+struct library_change {
+	int removed;
+	char* path;
+	struct track t; // its strings aren't kept, see path
+};
+
+static void* rescan_thread_main(void* arg) {
+	struct player_state* st = arg;
+
+	playlist_init(&st->rescanned);
+
+	int probed = scan_library(st->dir_path, st->recursive, &st->index,
+		&st->rescan_cancel, &st->rescanned);
+
+	// the entries of the old index were all reused: nothing to write
+	if (probed >= 0 && !atomic_load(&st->rescan_cancel) &&
+		(probed > 0 || st->rescanned.len != st->index.count)) {
+		index_write(st->index_file, st->dir_path, st->recursive, &st->rescanned);
+	}
+
+	if (probed < 0) {
+		atomic_store(&st->rescan_cancel, 1);
+	}
+
+	atomic_store(&st->rescan_done, 1);
+
+	return NULL;
+}
+
+static int rescan_start(struct player_state* st) {
+	atomic_store(&st->rescan_done, 0);
+	atomic_store(&st->rescan_cancel, 0);
+
+	if (pthread_create(&st->rescan_thread, NULL, rescan_thread_main, st) != 0) {
+		return -1;
+	}
+
+	st->rescanning = 1;
+	return 0;
+}
+
+int library_load(struct player_state* st) {
+	playlist_init(&st->playlist);
+
+	if (index_file_path(st->dir_path, st->recursive,
+		st->index_file, sizeof(st->index_file)) < 0) {
+		st->index_file[0] = '\0';
+	}
+
+	if (st->index_file[0] &&
+		index_open(st->index_file, st->dir_path, st->recursive, &st->index) == 0) {
+		if (index_load_playlist(&st->index, &st->playlist) == 0 &&
+			rescan_start(st) == 0) {
+			return 0;
+		}
+
+		// not usable after all, start over
+		index_close(&st->index);
+		playlist_free(&st->playlist);
+		playlist_init(&st->playlist);
+	}
+
+	if (scan_library(st->dir_path, st->recursive, NULL, NULL, &st->playlist) < 0) {
+		return -1;
+	}
+
+	if (st->index_file[0] &&
+		index_write(st->index_file, st->dir_path, st->recursive, &st->playlist) < 0) {
+		fprintf(stderr, "writing library index failed\n");
+	}
+
+	return 0;
+}
+
+void library_rescan(struct player_state* st) {
+	if (st->rescanning) {
+		return;
+	}
+
+	if (rescan_start(st) < 0) {
+		fprintf(stderr, "rescanning library failed\n");
+	}
+}
+
+static void rescan_join(struct player_state* st) {
+	pthread_join(st->rescan_thread, NULL);
+	st->rescanning = 0;
+	index_close(&st->index);
+}
+
+// the current track and a prefetched track the decoder already took
+// are playing, their entries stay until they aren't
+static int track_in_use(struct player_state* st, size_t pos) {
+	if (st->mode != PLAYER) {
+		return 0;
+	}
+
+	if (pos == st->current_track) {
+		return 1;
+	}
+
+	if (pos == st->next_index) {
+		int state = prefetch_state(st);
+
+		if (state == NEXT_TAKEN ||
+			((state == NEXT_READY || state == NEXT_LOADING) && !prefetch_release(st))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void undefer_removal(struct player_state* st, const char* path) {
+	for (size_t i = 0; i < st->deferred_len; i++) {
+		if (strcmp(st->deferred[i], path) == 0) {
+			free(st->deferred[i]);
+			st->deferred[i] = st->deferred[--st->deferred_len];
+			return;
+		}
+	}
+}
+
+// inserts t or updates the entry with its path
+static int apply_add(struct player_state* st, struct track t) {
+	char path[PATH_MAX_LENGTH];
+	size_t pos;
+
+	if (track_path(&t, path, sizeof(path)) < 0) {
+		return -1;
+	}
+
+	// back before the deferred removal happened
+	undefer_removal(st, path);
+
+	if (playlist_find(&st->playlist, path, &pos)) {
+		st->playlist.items[pos].duration = t.duration;
+		st->playlist.items[pos].info = t.info;
+		st->playlist.items[pos].loudness = t.loudness;
+		st->playlist.items[pos].peak = t.peak;
+		st->library_dirty = 1;
+		return 0;
+	}
+
+	if (playlist_insert(&st->playlist, pos, t) < 0) {
+		return -1;
+	}
+
+	// entries after pos moved one up
+	if (st->mode == PLAYER) {
+		if (pos <= st->current_track) {
+			st->current_track++;
+		}
+
+		if (pos <= st->next_index) {
+			st->next_index++;
+		}
+	}
+
+	st->library_dirty = 1;
+	return 0;
+}
+
+static void defer_removal(struct player_state* st, const char* path) {
+	for (size_t i = 0; i < st->deferred_len; i++) {
+		if (strcmp(st->deferred[i], path) == 0) {
+			return;
+		}
+	}
+
+	char** deferred = realloc(st->deferred,
+		(st->deferred_len + 1) * sizeof(*deferred));
+	char* copy = strdup(path);
+
+	if (deferred) {
+		st->deferred = deferred;
+	}
+
+	if (!deferred || !copy) {
+		free(copy);
+		return;
+	}
+
+	st->deferred[st->deferred_len++] = copy;
+}
+
+// returns 0 when the entry had to stay for now
+static int apply_remove(struct player_state* st, const char* path) {
+	size_t pos;
+
+	if (!playlist_find(&st->playlist, path, &pos)) {
+		return 1;
+	}
+
+	if (track_in_use(st, pos)) {
+		return 0;
+	}
+
+	playlist_remove(&st->playlist, pos);
+
+	if (st->mode == PLAYER) {
+		if (pos < st->current_track) {
+			st->current_track--;
+		}
+
+		if (pos < st->next_index) {
+			st->next_index--;
+		}
+	}
+
+	st->library_dirty = 1;
+	return 1;
+}
+
+static void log_change
+(
+	struct player_state* st,
+	int removed,
+	const char* path,
+	const struct track* t
+)
+{
+	if (st->changes_len == st->changes_cap) {
+		size_t cap = st->changes_cap ? st->changes_cap * 2 : 16;
+		struct library_change* changes = realloc(st->changes, cap * sizeof(*changes));
+
+		if (!changes) {
+			return;
+		}
+
+		st->changes = changes;
+		st->changes_cap = cap;
+	}
+
+	struct library_change* c = &st->changes[st->changes_len];
+
+	c->removed = removed;
+	c->path = strdup(path);
+
+	if (t) {
+		c->t = *t;
+	}
+
+	if (!c->path) {
+		return;
+	}
+
+	st->changes_len++;
+}
+
+static void free_changes(struct player_state* st) {
+	for (size_t i = 0; i < st->changes_len; i++) {
+		free(st->changes[i].path);
+	}
+
+	free(st->changes);
+	st->changes = NULL;
+	st->changes_len = 0;
+	st->changes_cap = 0;
+}
+
+int library_add(struct player_state* st, struct track t) {
+	char path[PATH_MAX_LENGTH];
+
+	if (st->rescanning && track_path(&t, path, sizeof(path)) == 0) {
+		log_change(st, 0, path, &t);
+	}
+
+	return apply_add(st, t);
+}
+
+static void library_remove_entry(struct player_state* st, const char* path) {
+	if (!apply_remove(st, path)) {
+		defer_removal(st, path);
+	}
+}
+
+void library_remove(struct player_state* st, const char* path) {
+	if (st->rescanning) {
+		log_change(st, 1, path, NULL);
+	}
+
+	library_remove_entry(st, path);
+}
+
+void library_settle(struct player_state* st) {
+	size_t kept = 0;
+
+	for (size_t i = 0; i < st->deferred_len; i++) {
+		if (apply_remove(st, st->deferred[i])) {
+			free(st->deferred[i]);
+		} else {
+			st->deferred[kept++] = st->deferred[i];
+		}
+	}
+
+	st->deferred_len = kept;
+}
+
+// applies the difference between the playlist and the rescanned one
+// as single changes, so the current track and the prefetched one keep
+// their entries (both lists are sorted by path)
+static void merge_rescan(struct player_state* st, struct playlist* fresh) {
+	struct playlist* pl = &st->playlist;
+	char** gone = malloc((pl->len ? pl->len : 1) * sizeof(*gone));
+	size_t gone_len = 0;
+	size_t i = 0;
+	size_t j = 0;
+
+	if (!gone) {
+		return;
+	}
+
+	while (i < pl->len || j < fresh->len) {
+		int cmp = i == pl->len ? 1 : j == fresh->len ? -1 :
+			track_compare(&pl->items[i], &fresh->items[j]);
+
+		if (cmp < 0) {
+			char path[PATH_MAX_LENGTH];
+
+			gone[gone_len++] = track_path(&pl->items[i++], path, sizeof(path)) == 0 ?
+				strdup(path) : NULL;
+		} else if (cmp > 0) {
+			j++;
+		} else {
+			struct track* t = &pl->items[i];
+			const struct track* f = &fresh->items[j];
+
+			// measured since the index the rescan started from was written
+			if (f->loudness != LOUDNESS_UNKNOWN || t->info.mtime != f->info.mtime ||
+				t->info.size != f->info.size) {
+				t->loudness = f->loudness;
+				t->peak = f->peak;
+			}
+
+			t->duration = f->duration;
+			t->info = f->info;
+			fresh->items[j].name = NULL; // not new
+			i++;
+			j++;
+		}
+	}
+
+	for (size_t k = 0; k < gone_len; k++) {
+		if (gone[k]) {
+			library_remove_entry(st, gone[k]);
+		}
+
+		free(gone[k]);
+	}
+
+	free(gone);
+
+	// what is left in fresh is new
+	for (size_t k = 0; k < fresh->len; k++) {
+		if (fresh->items[k].name) {
+			apply_add(st, fresh->items[k]);
+		}
+	}
+
+	playlist_free(fresh);
+	playlist_init(fresh);
+}
+
+int library_adopt(struct player_state* st) {
+	if (!st->rescanning || !atomic_load(&st->rescan_done)) {
+		return 0;
+	}
+
+	rescan_join(st);
+
+	if (atomic_load(&st->rescan_cancel)) {
+		playlist_free(&st->rescanned);
+		free_changes(st);
+		return 0;
+	}
+
+	merge_rescan(st, &st->rescanned);
+
+	// the watcher's changes win over what the walk saw
+	for (size_t i = 0; i < st->changes_len; i++) {
+		struct library_change* c = &st->changes[i];
+
+		if (c->removed) {
+			library_remove_entry(st, c->path);
+		} else if (track_split_path(c->path, &c->t) == 0) {
+			apply_add(st, c->t);
+		}
+	}
+
+	free_changes(st);
+	return 1;
+}
+
+void library_close(struct player_state* st) {
+	if (st->rescanning) {
+		atomic_store(&st->rescan_cancel, 1);
+		rescan_join(st);
+		playlist_free(&st->rescanned);
+	}
+
+	// picked up by the next run without opening anything
+	if (st->library_dirty && st->index_file[0] &&
+		index_write(st->index_file, st->dir_path, st->recursive, &st->playlist) < 0) {
+		fprintf(stderr, "writing library index failed\n");
+	}
+
+	free_changes(st);
+
+	for (size_t i = 0; i < st->deferred_len; i++) {
+		free(st->deferred[i]);
+	}
+
+	free(st->deferred);
+	st->deferred = NULL;
+	st->deferred_len = 0;
+
+	playlist_free(&st->playlist);
+}
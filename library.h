@@ -0,0 +1,42 @@
+/*
+the playlist and where it comes from
+
+at startup the playlist is built straight from the library index when
+there is one (see index.h), without reading the library. a background
+thread then walks the library again, reusing every index entry whose
+file didn't change, and the main loops merge the result into the
+playlist entry by entry, like the watcher's changes below. the index
+is rewritten whenever something changed
+
+without an index (first run, or no cache directory) the library is
+scanned right away and the index is written for the next run
+
+while running, the watcher (see watcher.h) adds and removes single
+entries. the entries after a change move, so the current and the
+prefetched track indexes follow them. a track that is playing is only
+taken out of the playlist once it stops playing
+*/
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include "types.h"
+
+int library_load(struct player_state* st);
+
+// merges the revalidated playlist once it's ready, returns 1 if it did
+int library_adopt(struct player_state* st);
+
+// walks the whole library again in the background (watcher overflow)
+void library_rescan(struct player_state* st);
+
+// inserts or updates t, its strings are copied
+int library_add(struct player_state* st, struct track t);
+void library_remove(struct player_state* st, const char* path);
+
+// takes out removed tracks that stopped playing
+void library_settle(struct player_state* st);
+
+void library_close(struct player_state* st);
+
+#endif
@@ -0,0 +1,581 @@
+#include "loudness.h"
+#include "convert.h"
+#include "fd_handle.h"
+#include "telemetry.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define ABSOLUTE_GATE -70.0 // LUFS
+#define RELATIVE_GATE -10.0 // LU under the mean of the blocks above the absolute gate
+
+typedef float (*peak_fn)(const float* x, size_t n, float peak);
+
+// the oversampling filter: coeffs[k][p] weighs input sample n - k for
+// the phase p value between samples n - 6 and n - 5
+static float coeffs[LOUDNESS_TP_TAPS][LOUDNESS_TP_PHASES] __attribute__((aligned(16)));
+
+/* --- TRUE PEAK --- */
+
+// x holds LOUDNESS_TP_TAPS - 1 samples of history, then n new ones
+static float peak_scalar(const float* x, size_t n, float peak) {
+	for (size_t i = 0; i < n; i++) {
+		const float* s = x + i + LOUDNESS_TP_TAPS - 1;
+
+		for (size_t p = 0; p < LOUDNESS_TP_PHASES; p++) {
+			float acc = 0.0f;
+
+			for (size_t k = 0; k < LOUDNESS_TP_TAPS; k++) {
+				acc += s[-(ptrdiff_t) k] * coeffs[k][p];
+			}
+
+			acc = fabsf(acc);
+
+			if (acc > peak) {
+				peak = acc;
+			}
+		}
+	}
+
+	return peak;
+}
+
+#ifdef HAVE_X86
+
+// the 4 phases of a sample are one vector: each tap is a broadcast
+// sample times a row of coeffs
+__attribute__((target("sse2")))
+static float peak_sse2(const float* x, size_t n, float peak) {
+	__m128 c[LOUDNESS_TP_TAPS];
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 max = _mm_set1_ps(peak);
+
+	for (size_t k = 0; k < LOUDNESS_TP_TAPS; k++) {
+		c[k] = _mm_load_ps(coeffs[k]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const float* s = x + i + LOUDNESS_TP_TAPS - 1;
+		__m128 acc = _mm_setzero_ps();
+
+		for (size_t k = 0; k < LOUDNESS_TP_TAPS; k++) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(s[-(ptrdiff_t) k]), c[k]));
+		}
+
+		max = _mm_max_ps(max, _mm_andnot_ps(sign, acc));
+	}
+
+	max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(1, 0, 3, 2)));
+	max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtss_f32(max);
+}
+
+#endif
+
+static peak_fn kernel = peak_scalar;
+static const char* kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static double sinc(double t) {
+	return t == 0.0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+}
+
+// every analysis thread starts with a meter, the filter is built once
+static void pick_kernel(void) {
+	double half = LOUDNESS_TP_TAPS / 2;
+
+	// hann windowed sinc, each phase normalized to unity gain
+	for (size_t p = 0; p < LOUDNESS_TP_PHASES; p++) {
+		double sum = 0.0;
+
+		for (size_t k = 0; k < LOUDNESS_TP_TAPS; k++) {
+			double t = half - (double) k - (double) p / LOUDNESS_TP_PHASES;
+			double h = sinc(t) * 0.5 * (1.0 + cos(M_PI * t / half));
+
+			coeffs[k][p] = (float) h;
+			sum += h;
+		}
+
+		for (size_t k = 0; k < LOUDNESS_TP_TAPS; k++) {
+			coeffs[k][p] = (float) (coeffs[k][p] / sum);
+		}
+	}
+
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("sse2")) {
+		kernel = peak_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+}
+
+const char* loudness_kernel_name(void) {
+	pthread_once(&kernel_once, pick_kernel);
+	return kernel_name;
+}
+
+/* --- METER --- */
+
+// the k-weighting filter of BS.1770 at any rate (its coefficients are
+// only given for 48 khz): a high shelf, then a high pass
+static void k_weighting(struct loudness_meter* m, unsigned int rate) {
+	double k = tan(M_PI * 1681.974450955533 / rate);
+	double q = 0.7071752369554196;
+	double vh = pow(10.0, 3.999843853973347 / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	m->b[0][0] = (vh + vb * k / q + k * k) / a0;
+	m->b[0][1] = 2.0 * (k * k - vh) / a0;
+	m->b[0][2] = (vh - vb * k / q + k * k) / a0;
+	m->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+	k = tan(M_PI * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1.0 + k / q + k * k;
+
+	m->b[1][0] = 1.0;
+	m->b[1][1] = -2.0;
+	m->b[1][2] = 1.0;
+	m->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[1][2] = (1.0 - k / q + k * k) / a0;
+}
+
+int loudness_meter_init(struct loudness_meter* m, unsigned int rate, size_t channels) {
+	if (channels == 0 || channels > MAX_CHANNELS || rate < 10) {
+		return -1;
+	}
+
+	pthread_once(&kernel_once, pick_kernel);
+
+	memset(m, 0, sizeof(*m));
+	m->channels = channels;
+	m->step = rate / 10;
+	k_weighting(m, rate);
+
+	// wav channel order: L R C, then LFE and the surrounds from 5.1 on
+	for (size_t c = 0; c < channels; c++) {
+		m->weight[c] = 1.0;
+
+		if (channels == 5 && c >= 3) {
+			m->weight[c] = 1.41;
+		} else if (channels >= 6 && c >= 3) {
+			m->weight[c] = c == 3 ? 0.0 : 1.41;
+		}
+	}
+
+	return 0;
+}
+
+void loudness_meter_free(struct loudness_meter* m) {
+	free(m->blocks);
+	m->blocks = NULL;
+	m->blocks_len = 0;
+	m->blocks_cap = 0;
+}
+
+// a 100 ms step is complete, and with the 3 before it a block
+static void end_step(struct loudness_meter* m) {
+	m->steps[m->steps_len % 4] = m->step_sum;
+	m->steps_len++;
+	m->step_sum = 0.0;
+	m->step_fill = 0;
+
+	if (m->steps_len < 4) {
+		return;
+	}
+
+	if (m->blocks_len == m->blocks_cap) {
+		size_t cap = m->blocks_cap ? m->blocks_cap * 2 : 1024;
+		double* blocks = realloc(m->blocks, cap * sizeof(*blocks));
+
+		// the block is lost, the rest of the track is still measured
+		if (!blocks) {
+			return;
+		}
+
+		m->blocks = blocks;
+		m->blocks_cap = cap;
+	}
+
+	m->blocks[m->blocks_len++] =
+		(m->steps[0] + m->steps[1] + m->steps[2] + m->steps[3]) / (4.0 * m->step);
+}
+
+static void meter_block(struct loudness_meter* m, const int32_t* frames, size_t n) {
+	size_t channels = m->channels;
+	const float scale = 1.0f / 2147483648.0f;
+
+	for (size_t f = 0; f < n; f++) {
+		double sum = 0.0;
+
+		for (size_t c = 0; c < channels; c++) {
+			float x = (float) frames[f * channels + c] * scale;
+			double (*z)[2] = m->z[c];
+			double v = x;
+
+			m->history[c][LOUDNESS_TP_TAPS - 1 + f] = x;
+
+			// transposed direct form ii, shelf then high pass
+			for (size_t s = 0; s < 2; s++) {
+				double y = m->b[s][0] * v + z[s][0];
+
+				z[s][0] = m->b[s][1] * v - m->a[s][1] * y + z[s][1];
+				z[s][1] = m->b[s][2] * v - m->a[s][2] * y;
+				v = y;
+			}
+
+			sum += m->weight[c] * v * v;
+		}
+
+		m->step_sum += sum;
+
+		if (++m->step_fill == m->step) {
+			end_step(m);
+		}
+	}
+
+	for (size_t c = 0; c < channels; c++) {
+		m->peak = kernel(m->history[c], n, m->peak);
+		memmove(m->history[c], m->history[c] + n,
+			(LOUDNESS_TP_TAPS - 1) * sizeof(float));
+	}
+}
+
+void loudness_meter_add(struct loudness_meter* m, const int32_t* frames, size_t n) {
+	for (size_t f = 0; f < n; f += FRAMES_PER_TICK) {
+		size_t len = n - f < FRAMES_PER_TICK ? n - f : FRAMES_PER_TICK;
+
+		meter_block(m, frames + f * m->channels, len);
+	}
+}
+
+void loudness_meter_result(const struct loudness_meter* m, float* loudness, float* peak) {
+	double absolute = pow(10.0, (ABSOLUTE_GATE + 0.691) / 10.0);
+	double sum = 0.0;
+	size_t count = 0;
+
+	for (size_t i = 0; i < m->blocks_len; i++) {
+		if (m->blocks[i] > absolute) {
+			sum += m->blocks[i];
+			count++;
+		}
+	}
+
+	*peak = m->peak;
+
+	if (!count) {
+		*loudness = LOUDNESS_NONE;
+		return;
+	}
+
+	double relative = sum / count * pow(10.0, RELATIVE_GATE / 10.0);
+	double gated = 0.0;
+	size_t gated_count = 0;
+
+	for (size_t i = 0; i < m->blocks_len; i++) {
+		if (m->blocks[i] > absolute && m->blocks[i] > relative) {
+			gated += m->blocks[i];
+			gated_count++;
+		}
+	}
+
+	*loudness = (float) (-0.691 + 10.0 * log10(gated / gated_count));
+}
+
+int loudness_analyze
+(
+	const char* path,
+	struct wav_info* info,
+	struct loudness_meter* m,
+	atomic_int* cancel,
+	float* loudness,
+	float* peak
+)
+{
+	struct wav_stream ws;
+
+	if (wav_stream_open(path, info, &ws) < 0) {
+		return -1;
+	}
+
+	const struct convert_kernel* convert = convert_select(&info->fmt);
+	size_t channels = info->fmt.num_channels;
+
+	if (!convert || loudness_meter_init(m, info->fmt.sample_rate, channels) < 0) {
+		wav_stream_close(&ws);
+		return -1;
+	}
+
+	int32_t block[FRAMES_PER_TICK * MAX_CHANNELS];
+	const uint8_t* src;
+	size_t cursor = 0;
+	size_t n;
+
+	while (!atomic_load(cancel) &&
+		(n = wav_stream_frames(&ws, cursor, FRAMES_PER_TICK, &src)) > 0) {
+		convert->fn(src, block, n * channels);
+		loudness_meter_add(m, block, n);
+		cursor += n;
+
+		// measured once, the pages won't be needed again
+		wav_stream_release(&ws, cursor);
+	}
+
+	int ret = atomic_load(cancel) ? -1 : 0;
+
+	if (ret == 0) {
+		loudness_meter_result(m, loudness, peak);
+	}
+
+	loudness_meter_free(m);
+	wav_stream_close(&ws);
+
+	return ret;
+}
+
+float loudness_gain(const struct track* t) {
+	if (t->loudness <= LOUDNESS_NONE) {
+		return 1.0f;
+	}
+
+	float db = LOUDNESS_TARGET - t->loudness;
+
+	// a quiet track with loud peaks is brought up less
+	if (t->peak > 0.0f) {
+		float headroom = LOUDNESS_MAX_PEAK - 20.0f * log10f(t->peak);
+
+		if (db > headroom) {
+			db = headroom;
+		}
+	}
+
+	return powf(10.0f, db / 20.0f);
+}
+
+/* --- BACKGROUND ANALYSIS --- */
+
+struct loudness_job {
+	char* path;
+	struct wav_info info; // what the playlist knew, the file's once measured
+	float loudness;
+	float peak;
+	atomic_int done;
+	int adopted; // main thread only
+};
+
+struct loudness_analyzer {
+	struct loudness_job* jobs; // NULL: nothing running
+	size_t len;
+	atomic_size_t next; // first job no thread took yet
+	atomic_size_t finished; // jobs done
+	atomic_int cancel;
+	pthread_t threads[LOUDNESS_MAX_WORKERS];
+	size_t started;
+	size_t seen; // finished when the results were last handed over
+	uint64_t checked_ns; // last look at the playlist, or hand over
+};
+
+static void* analyzer_thread_main(void* arg) {
+	struct loudness_analyzer* an = arg;
+	struct loudness_meter* m = malloc(sizeof(*m));
+
+	// only this thread (linux sets the nice value per thread)
+	setpriority(PRIO_PROCESS, 0, LOUDNESS_NICE);
+
+	while (m && !atomic_load(&an->cancel)) {
+		size_t i = atomic_fetch_add(&an->next, 1);
+
+		if (i >= an->len) {
+			break;
+		}
+
+		struct loudness_job* job = &an->jobs[i];
+
+		if (loudness_analyze(job->path, &job->info, m, &an->cancel,
+			&job->loudness, &job->peak) < 0) {
+			if (atomic_load(&an->cancel)) {
+				break;
+			}
+
+			// not retried until the file changes
+			job->loudness = LOUDNESS_NONE;
+			job->peak = 0.0f;
+		}
+
+		atomic_store(&job->done, 1);
+		atomic_fetch_add(&an->finished, 1);
+	}
+
+	free(m);
+
+	return NULL;
+}
+
+// the results of the jobs done since the last call, into the entries
+// of the same files as they were measured
+static void adopt_results(struct player_state* st, struct loudness_analyzer* an) {
+	an->seen = atomic_load(&an->finished);
+
+	for (size_t i = 0; i < an->len; i++) {
+		struct loudness_job* job = &an->jobs[i];
+		size_t pos;
+
+		if (job->adopted || !atomic_load(&job->done)) {
+			continue;
+		}
+
+		job->adopted = 1;
+
+		if (!playlist_find(&st->playlist, job->path, &pos)) {
+			continue;
+		}
+
+		struct track* t = &st->playlist.items[pos];
+
+		if (t->info.mtime == job->info.mtime && t->info.size == job->info.size) {
+			t->loudness = job->loudness;
+			t->peak = job->peak;
+			st->library_dirty = 1;
+		}
+	}
+}
+
+static void analyzer_join(struct loudness_analyzer* an) {
+	for (size_t i = 0; i < an->started; i++) {
+		pthread_join(an->threads[i], NULL);
+	}
+
+	for (size_t i = 0; i < an->len; i++) {
+		free(an->jobs[i].path);
+	}
+
+	free(an->jobs);
+	an->jobs = NULL;
+	an->len = 0;
+	an->started = 0;
+}
+
+// a job for every track of the playlist that wasn't measured
+static void analyzer_start(struct player_state* st, struct loudness_analyzer* an) {
+	const struct playlist* pl = &st->playlist;
+	size_t count = 0;
+
+	for (size_t i = 0; i < pl->len; i++) {
+		count += pl->items[i].loudness == LOUDNESS_UNKNOWN;
+	}
+
+	if (!count || !(an->jobs = calloc(count, sizeof(*an->jobs)))) {
+		return;
+	}
+
+	for (size_t i = 0; i < pl->len; i++) {
+		char path[PATH_MAX_LENGTH];
+		struct loudness_job* job = &an->jobs[an->len];
+
+		if (pl->items[i].loudness != LOUDNESS_UNKNOWN ||
+			track_path(&pl->items[i], path, sizeof(path)) < 0 ||
+			!(job->path = strdup(path))) {
+			continue;
+		}
+
+		job->info = pl->items[i].info;
+		atomic_init(&job->done, 0);
+		an->len++;
+	}
+
+	atomic_store(&an->next, 0);
+	atomic_store(&an->finished, 0);
+	atomic_store(&an->cancel, 0);
+	an->seen = 0;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cpus > 0 ? (size_t) cpus : 1;
+
+	if (threads > LOUDNESS_MAX_WORKERS) {
+		threads = LOUDNESS_MAX_WORKERS;
+	}
+
+	if (threads > an->len) {
+		threads = an->len;
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		if (pthread_create(&an->threads[i], NULL, analyzer_thread_main, an) != 0) {
+			break;
+		}
+
+		an->started++;
+	}
+
+	// tried again at the next check
+	if (!an->started) {
+		analyzer_join(an);
+	}
+}
+
+void loudness_update(struct player_state* st) {
+	struct loudness_analyzer* an = st->analyzer;
+	uint64_t now = telemetry_now();
+
+	if (!an) {
+		an = st->analyzer = calloc(1, sizeof(*an));
+
+		if (!an) {
+			return;
+		}
+	}
+
+	// results are handed over (and new tracks looked for) once in a
+	// while, a pass over the playlist per tick would be wasted
+	if (an->checked_ns && now - an->checked_ns < LOUDNESS_RECHECK_MS * 1000000ull &&
+		(!an->jobs || atomic_load(&an->finished) != an->len)) {
+		return;
+	}
+
+	an->checked_ns = now;
+
+	if (!an->jobs) {
+		analyzer_start(st, an);
+		return;
+	}
+
+	if (atomic_load(&an->finished) != an->seen) {
+		adopt_results(st, an);
+	}
+
+	if (an->seen == an->len) {
+		analyzer_join(an);
+	}
+}
+
+void loudness_stop(struct player_state* st) {
+	struct loudness_analyzer* an = st->analyzer;
+
+	if (!an) {
+		return;
+	}
+
+	if (an->jobs) {
+		atomic_store(&an->cancel, 1);
+
+		for (size_t i = 0; i < an->started; i++) {
+			pthread_join(an->threads[i], NULL);
+		}
+
+		an->started = 0;
+		adopt_results(st, an);
+		analyzer_join(an);
+	}
+
+	free(an);
+	st->analyzer = NULL;
+}
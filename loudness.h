@@ -0,0 +1,91 @@
+/*
+loudness normalization (EBU R128 / ReplayGain 2.0)
+
+every track gets its integrated loudness (ITU-R BS.1770: k-weighted,
+400 ms blocks every 100 ms, gated at -70 LUFS and 10 LU under the
+ungated mean) and its true peak (4x oversampled) measured once, in the
+background, and both are kept in its playlist entry and the library
+index. a track is then played at the gain that brings it to
+LOUDNESS_TARGET, lowered if its true peak would go over
+LOUDNESS_MAX_PEAK, on top of the volume (the decoder's gain stage
+ramps between tracks' gains like a volume change)
+
+a pool of niced threads measures the tracks nobody measured yet, the
+main loops hand their results to the playlist between commands or
+ticks, like the library rescan. a track that plays before it was
+measured is played at its own level, nothing waits for the analysis
+
+the oversampling filter is the hot loop: every input sample is a dot
+product giving its 4 interpolated values at once, an sse2 kernel when
+the cpu has it
+*/
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include "types.h"
+
+#define LOUDNESS_TARGET -18.0f // LUFS, the ReplayGain 2.0 reference
+#define LOUDNESS_MAX_PEAK -1.0f // dBTP a normalized track can reach
+#define LOUDNESS_MAX_WORKERS 8
+#define LOUDNESS_NICE 10 // analysis threads yield to playback
+#define LOUDNESS_RECHECK_MS 1000 // idle: how often new tracks are looked for
+#define LOUDNESS_TP_PHASES 4 // true peak oversampling
+#define LOUDNESS_TP_TAPS 12 // input samples per interpolated sample
+
+// k-weighting and gating of one stream
+struct loudness_meter {
+	size_t channels;
+	double weight[MAX_CHANNELS]; // of each channel's mean square, 0: lfe
+	double b[2][3]; // the two k-weighting biquads
+	double a[2][3];
+	double z[MAX_CHANNELS][2][2]; // their state, per channel
+	size_t step; // frames per 100 ms
+	size_t step_fill; // frames in the current 100 ms
+	double step_sum; // its weighted sum of squares
+	double steps[4]; // the last 4 of them, a 400 ms block
+	size_t steps_len;
+	double* blocks; // mean square of every block
+	size_t blocks_len;
+	size_t blocks_cap;
+	float peak; // linear, of the oversampled signal
+	float history[MAX_CHANNELS][LOUDNESS_TP_TAPS - 1 + FRAMES_PER_TICK];
+};
+
+// "scalar" or "sse2"
+const char* loudness_kernel_name(void);
+
+int loudness_meter_init(struct loudness_meter* m, unsigned int rate, size_t channels);
+void loudness_meter_free(struct loudness_meter* m);
+
+// frames interleaved S32 frames of the stream
+void loudness_meter_add(struct loudness_meter* m, const int32_t* frames, size_t n);
+
+// integrated loudness in LUFS (LOUDNESS_NONE if every block was gated
+// out, e.g. silence) and true peak (linear) of what was added
+void loudness_meter_result(const struct loudness_meter* m, float* loudness, float* peak);
+
+// measures a whole file with m (set up here), -1 if it can't be read
+// or cancel was set
+int loudness_analyze
+(
+	const char* path,
+	struct wav_info* info,
+	struct loudness_meter* m,
+	atomic_int* cancel,
+	float* loudness,
+	float* peak
+);
+
+// the gain a track is played at on top of the volume, 1 if it wasn't
+// measured (yet)
+float loudness_gain(const struct track* t);
+
+// main loops: hands finished measurements to the playlist, and starts
+// measuring the tracks that need it when nothing is running
+void loudness_update(struct player_state* st);
+
+// stops the analysis, what was already measured is kept
+void loudness_stop(struct player_state* st);
+
+#endif
@@ -0,0 +1,170 @@
+#include "output.h"
+#include "telemetry.h"
+#include <stdio.h>
+#include <string.h>
+
+static const struct output_backend* backend(const struct output_session* out) {
+	return out->backend ? out->backend : &output_alsa;
+}
+
+int output_select(struct output_session* out, const char* spec) {
+	const struct output_backend* backends[] = {
+		&output_alsa, &output_null, &output_file
+	};
+
+	const char* colon = strchr(spec, ':');
+	size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+	const char* arg = colon ? colon + 1 : NULL;
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strlen(backends[i]->name) != len ||
+			strncmp(spec, backends[i]->name, len) != 0) {
+			continue;
+		}
+
+		if (backends[i] == &output_null && arg && strcmp(arg, "paced") != 0) {
+			return -1;
+		}
+
+		if (backends[i] == &output_file && (!arg || !*arg)) {
+			return -1;
+		}
+
+		out->backend = backends[i];
+		out->device = backends[i] == &output_null ? NULL : arg;
+		out->paced = backends[i] == &output_null && arg;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+const char* output_name(const struct output_session* out) {
+	return backend(out)->name;
+}
+
+int output_open(struct output_session* out) {
+	if (out->open) {
+		return 0;
+	}
+
+	if (backend(out)->open(out) < 0) {
+		return -1;
+	}
+
+	out->open = 1;
+	out->format = SND_PCM_FORMAT_UNKNOWN;
+	out->opens++;
+	telemetry_reset(&out->telemetry);
+
+	return 0;
+}
+
+int output_configure
+(
+	struct output_session* out,
+	snd_pcm_format_t format,
+	unsigned int channels,
+	unsigned int rate
+)
+{
+	if (!out->open) {
+		return -1;
+	}
+
+	if (out->format == format && out->channels == channels &&
+		out->rate == rate) {
+		return 0;
+	}
+
+	if (out->format != SND_PCM_FORMAT_UNKNOWN) {
+		output_drain(out);
+	}
+
+	out->paused = 0;
+
+	out->format = SND_PCM_FORMAT_UNKNOWN;
+
+	if (backend(out)->configure(out, format, channels, rate) < 0) {
+		return -1;
+	}
+
+	out->format = format;
+	out->channels = channels;
+	out->rate = rate;
+	out->setups++;
+
+	return 0;
+}
+
+snd_pcm_sframes_t output_avail(struct output_session* out) {
+	return backend(out)->avail(out);
+}
+
+int output_wait(struct output_session* out, int wake_fd) {
+	return backend(out)->wait(out, wake_fd);
+}
+
+snd_pcm_sframes_t output_write(struct output_session* out, const void* buf, size_t frames) {
+	return backend(out)->write(out, buf, frames);
+}
+
+int output_delay(struct output_session* out, snd_pcm_sframes_t* delay) {
+	if (!out->open) {
+		return -1;
+	}
+
+	return backend(out)->delay(out, delay);
+}
+
+int output_recover(struct output_session* out, int err) {
+	return backend(out)->recover(out, err);
+}
+
+void output_drain(struct output_session* out) {
+	if (!out->open) {
+		return;
+	}
+
+	backend(out)->drain(out);
+	out->paused = 0;
+}
+
+void output_drop(struct output_session* out) {
+	if (!out->open) {
+		return;
+	}
+
+	backend(out)->drop(out);
+	out->paused = 0;
+}
+
+int output_pause(struct output_session* out, int enable) {
+	if (!out->open || out->format == SND_PCM_FORMAT_UNKNOWN) {
+		return -1;
+	}
+
+	if (out->paused == enable) {
+		return 0;
+	}
+
+	if (backend(out)->pause(out, enable) < 0) {
+		return -1;
+	}
+
+	out->paused = enable;
+
+	return 0;
+}
+
+void output_close(struct output_session* out) {
+	if (!out->open) {
+		return;
+	}
+
+	output_drain(out);
+	backend(out)->close(out);
+	out->open = 0;
+	out->format = SND_PCM_FORMAT_UNKNOWN;
+}
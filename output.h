@@ -0,0 +1,102 @@
+/*
+output session
+
+the device is opened the first time something plays and stays open
+until the player exits, stopping playback only drains it. its params
+are only negotiated again when a track's format, channels or rate
+differ from what it is set up with: opening and setting up a device
+costs tens of milliseconds, and often a pop, which every play and every
+track change used to pay
+
+where the frames go is a backend (-o):
+- alsa: a pcm, "default" unless a name is given
+- null: frames are thrown away, as fast as they come, or at the rate
+  they would be played (paced) so the engine behaves as with a device
+- file: frames are written to a wav, as fast as they come, so a whole
+  playlist renders without a sound card
+
+the output threads only go through output_avail(), output_wait() and
+output_write(); mmap access is alsa's alone and only ever set up there
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "types.h"
+
+#define OUTPUT_LATENCY_US 500000 // asked of the device at every setup
+
+struct output_backend {
+	const char* name;
+	int (*open)(struct output_session* out);
+	int (*configure)
+	(
+		struct output_session* out,
+		snd_pcm_format_t format,
+		unsigned int channels,
+		unsigned int rate
+	);
+	snd_pcm_sframes_t (*avail)(struct output_session* out);
+	int (*wait)(struct output_session* out, int wake_fd);
+	snd_pcm_sframes_t (*write)(struct output_session* out, const void* buf, size_t frames);
+	int (*delay)(struct output_session* out, snd_pcm_sframes_t* delay);
+	int (*recover)(struct output_session* out, int err);
+	void (*drain)(struct output_session* out);
+	void (*drop)(struct output_session* out);
+	int (*pause)(struct output_session* out, int enable);
+	void (*close)(struct output_session* out);
+};
+
+extern const struct output_backend output_alsa;
+extern const struct output_backend output_null;
+extern const struct output_backend output_file;
+
+// "alsa[:DEVICE]", "null[:paced]" or "file:PATH", before anything plays
+// -1 if spec isn't one of them
+int output_select(struct output_session* out, const char* spec);
+
+const char* output_name(const struct output_session* out);
+
+// opens the device if it isn't yet, non blocking
+int output_open(struct output_session* out);
+
+// sets the device up for format/channels/rate if it isn't already,
+// waiting for the frames it still holds first. -1 leaves it unset up
+int output_configure
+(
+	struct output_session* out,
+	snd_pcm_format_t format,
+	unsigned int channels,
+	unsigned int rate
+);
+
+// frames the device can take right now, or a negative alsa error
+snd_pcm_sframes_t output_avail(struct output_session* out);
+
+// sleeps until the device has room (1) or wake_fd (-1: none) is
+// written (0), a negative alsa error when the device reports one
+int output_wait(struct output_session* out, int wake_fd);
+
+// up to frames interleaved frames, how many were taken, -EAGAIN if none
+// could be or another negative alsa error
+snd_pcm_sframes_t output_write(struct output_session* out, const void* buf, size_t frames);
+
+// frames written but not heard yet
+int output_delay(struct output_session* out, snd_pcm_sframes_t* delay);
+
+// gets the device going again after err, -1 if it can't be
+int output_recover(struct output_session* out, int err);
+
+// waits until every queued frame was played
+void output_drain(struct output_session* out);
+
+// discards the queued frames, the device is ready for new ones
+void output_drop(struct output_session* out);
+
+// stops the device where it is, keeping the frames it holds, or (enable
+// 0) lets it go on. -1 if it can't, the caller drops them instead
+int output_pause(struct output_session* out, int enable);
+
+void output_close(struct output_session* out);
+
+#endif
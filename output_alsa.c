@@ -0,0 +1,170 @@
+#include "output.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+
+#define MAX_PCM_FDS 8 // poll descriptors of a pcm we can wait on
+
+static int alsa_open(struct output_session* out) {
+	// non blocking: the output threads sleep in poll() instead
+	int err = snd_pcm_open(&out->pcm, out->device ? out->device : "default",
+		SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+
+	if (err < 0) {
+		fprintf(stderr, "opening pcm failed: %s\n", snd_strerror(err));
+		out->pcm = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int alsa_configure
+(
+	struct output_session* out,
+	snd_pcm_format_t format,
+	unsigned int channels,
+	unsigned int rate
+)
+{
+	out->access = out->use_mmap ?
+		SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED;
+
+	int err = snd_pcm_set_params(out->pcm, format, out->access,
+		channels, rate, 1, OUTPUT_LATENCY_US);
+
+	// not every device can be mapped, plain writes always work
+	if (err < 0 && out->access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+		out->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+		out->mmap_refused = 1;
+
+		err = snd_pcm_set_params(out->pcm, format, out->access,
+			channels, rate, 1, OUTPUT_LATENCY_US);
+	}
+
+	if (err < 0) {
+		return -1;
+	}
+
+	snd_pcm_hw_params_t* hw;
+	snd_pcm_hw_params_alloca(&hw);
+
+	out->can_pause = snd_pcm_hw_params_current(out->pcm, hw) == 0 &&
+		snd_pcm_hw_params_can_pause(hw);
+
+	return 0;
+}
+
+static snd_pcm_sframes_t alsa_avail(struct output_session* out) {
+	return snd_pcm_avail_update(out->pcm);
+}
+
+// the error behind a POLLERR, from the state the device is in
+static int device_error(snd_pcm_t* pcm) {
+	switch (snd_pcm_state(pcm)) {
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	default:
+		return -EIO;
+	}
+}
+
+static int alsa_wait(struct output_session* out, int wake_fd) {
+	struct pollfd fds[1 + MAX_PCM_FDS];
+
+	fds[0].fd = wake_fd;
+	fds[0].events = POLLIN;
+
+	int count = snd_pcm_poll_descriptors(out->pcm, fds + 1, MAX_PCM_FDS);
+
+	if (count < 0) {
+		return count;
+	}
+
+	if (poll(fds, 1 + count, -1) <= 0) {
+		return 0;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		uint64_t events;
+		ssize_t n = read(wake_fd, &events, sizeof(events));
+		(void) n;
+	}
+
+	unsigned short revents = 0;
+	snd_pcm_poll_descriptors_revents(out->pcm, fds + 1, count, &revents);
+
+	if (revents & POLLERR) {
+		return device_error(out->pcm);
+	}
+
+	return (revents & POLLOUT) ? 1 : 0;
+}
+
+static snd_pcm_sframes_t alsa_write(struct output_session* out, const void* buf, size_t frames) {
+	return snd_pcm_writei(out->pcm, buf, frames);
+}
+
+static int alsa_delay(struct output_session* out, snd_pcm_sframes_t* delay) {
+	return snd_pcm_delay(out->pcm, delay);
+}
+
+// snd_pcm_recover() only knows xruns and suspends, the rest was always
+// answered with a prepare
+static int alsa_recover(struct output_session* out, int err) {
+	if (snd_pcm_recover(out->pcm, err, 1) < 0 && snd_pcm_prepare(out->pcm) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// the pcm is non blocking, but a drain has to wait for the device. a
+// drain leaves it set up but not ready for frames
+static void alsa_drain(struct output_session* out) {
+	snd_pcm_nonblock(out->pcm, 0);
+	snd_pcm_drain(out->pcm);
+	snd_pcm_nonblock(out->pcm, 1);
+	snd_pcm_prepare(out->pcm);
+}
+
+static void alsa_drop(struct output_session* out) {
+	snd_pcm_drop(out->pcm);
+	snd_pcm_prepare(out->pcm);
+}
+
+static int alsa_pause(struct output_session* out, int enable) {
+	if (!out->can_pause) {
+		return -1;
+	}
+
+	// a device not started yet (or already stopped) has nothing to hold
+	if (snd_pcm_state(out->pcm) !=
+		(enable ? SND_PCM_STATE_RUNNING : SND_PCM_STATE_PAUSED)) {
+		return 0;
+	}
+
+	return snd_pcm_pause(out->pcm, enable) < 0 ? -1 : 0;
+}
+
+static void alsa_close(struct output_session* out) {
+	snd_pcm_close(out->pcm);
+	out->pcm = NULL;
+}
+
+const struct output_backend output_alsa = {
+	.name = "alsa",
+	.open = alsa_open,
+	.configure = alsa_configure,
+	.avail = alsa_avail,
+	.wait = alsa_wait,
+	.write = alsa_write,
+	.delay = alsa_delay,
+	.recover = alsa_recover,
+	.drain = alsa_drain,
+	.drop = alsa_drop,
+	.pause = alsa_pause,
+	.close = alsa_close,
+};
@@ -0,0 +1,375 @@
+#include "output.h"
+#include "fd_handle.h"
+#include "telemetry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// the null and file sinks: no device, frames are taken as soon as they
+// are written (or, paced, as fast as a device at out->rate would play
+// them, out of a buffer as long as the latency asked of alsa)
+struct output_sink {
+	pthread_mutex_t lock; // the output thread writes, the main thread asks the delay
+	size_t buffer; // frames, paced only
+	size_t frame_size;
+	int running; // paced: the clock below runs
+	uint64_t started_ns;
+	uint64_t paused_ns; // paused: the clock stands still since, 0: not paused
+	uint64_t queued; // frames written since the clock started
+
+	// file sink
+	int fd;
+	uint64_t data_bytes;
+	int failed; // a write failed, frames are thrown away since
+};
+
+static int sink_open(struct output_session* out) {
+	struct output_sink* s = calloc(1, sizeof(*s));
+
+	if (!s) {
+		return -1;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	s->fd = -1;
+	out->sink = s;
+
+	return 0;
+}
+
+static void sink_close(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	out->sink = NULL;
+}
+
+static int sink_configure
+(
+	struct output_session* out,
+	snd_pcm_format_t format,
+	unsigned int channels,
+	unsigned int rate
+)
+{
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+
+	s->buffer = (size_t) rate * OUTPUT_LATENCY_US / 1000000;
+	s->frame_size = channels * snd_pcm_format_physical_width(format) / 8;
+	s->running = 0;
+	s->paused_ns = 0;
+	s->queued = 0;
+
+	pthread_mutex_unlock(&s->lock);
+
+	out->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	out->mmap_refused = out->use_mmap;
+
+	return 0;
+}
+
+// frames of the buffer not played yet, paced only. once it ran dry the
+// clock stops, and the next write starts it again
+static uint64_t sink_fill(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	if (!out->paced || !s->running) {
+		return 0;
+	}
+
+	uint64_t now = s->paused_ns ? s->paused_ns : telemetry_now();
+	uint64_t played = (now - s->started_ns) * out->rate / 1000000000u;
+
+	if (played >= s->queued) {
+		s->running = 0;
+		return 0;
+	}
+
+	return s->queued - played;
+}
+
+static snd_pcm_sframes_t sink_avail(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+	snd_pcm_sframes_t avail = s->buffer - sink_fill(out);
+	pthread_mutex_unlock(&s->lock);
+
+	return avail;
+}
+
+// paced: sleeps until a quarter of the buffer was played
+static int sink_wait(struct output_session* out, int wake_fd) {
+	struct output_sink* s = out->sink;
+	struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+	int timeout = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	uint64_t fill = sink_fill(out);
+	uint64_t target = s->buffer - s->buffer / 4;
+
+	if (fill > target) {
+		timeout = (int) ((fill - target) * 1000 / out->rate) + 1;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+		uint64_t events;
+		ssize_t n = read(wake_fd, &events, sizeof(events));
+		(void) n;
+		return 0;
+	}
+
+	return 1;
+}
+
+static snd_pcm_sframes_t sink_write(struct output_session* out, const void* buf, size_t frames) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (out->paced) {
+		uint64_t room = s->buffer - sink_fill(out);
+
+		if (!room) {
+			pthread_mutex_unlock(&s->lock);
+			return -EAGAIN;
+		}
+
+		if (frames > room) {
+			frames = room;
+		}
+
+		if (!s->running) {
+			s->running = 1;
+			s->started_ns = telemetry_now();
+			s->queued = 0;
+
+			// a write that raced a pause: the clock starts stopped
+			if (s->paused_ns) {
+				s->paused_ns = s->started_ns;
+			}
+		}
+
+		s->queued += frames;
+	}
+
+	if (s->fd >= 0 && !s->failed) {
+		size_t bytes = frames * s->frame_size;
+
+		if (write_bytes_to_file(s->fd, buf, bytes) != (ssize_t) bytes) {
+			// the rest of the playlist still plays, into nothing
+			fprintf(stderr, "writing %s failed: %s\n", out->device, strerror(errno));
+			s->failed = 1;
+		} else {
+			s->data_bytes += bytes;
+		}
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return frames;
+}
+
+static int sink_delay(struct output_session* out, snd_pcm_sframes_t* delay) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+	*delay = sink_fill(out);
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+// nothing can go wrong with a sink that needs recovering from
+static int sink_recover(struct output_session* out, int err) {
+	(void) out;
+	(void) err;
+
+	return 0;
+}
+
+static void sink_drain(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+	uint64_t fill = sink_fill(out);
+	pthread_mutex_unlock(&s->lock);
+
+	if (fill) {
+		struct timespec ts = {
+			.tv_sec = fill / out->rate,
+			.tv_nsec = (fill % out->rate) * 1000000000u / out->rate
+		};
+
+		nanosleep(&ts, NULL);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	s->paused_ns = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void sink_drop(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	s->paused_ns = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// paced: the clock stops, and starts again as if no time went by
+static int sink_pause(struct output_session* out, int enable) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (enable) {
+		s->paused_ns = telemetry_now();
+	} else if (s->paused_ns) {
+		s->started_ns += telemetry_now() - s->paused_ns;
+		s->paused_ns = 0;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+const struct output_backend output_null = {
+	.name = "null",
+	.open = sink_open,
+	.configure = sink_configure,
+	.avail = sink_avail,
+	.wait = sink_wait,
+	.write = sink_write,
+	.delay = sink_delay,
+	.recover = sink_recover,
+	.drain = sink_drain,
+	.drop = sink_drop,
+	.pause = sink_pause,
+	.close = sink_close,
+};
+
+/* --- FILE SINK --- */
+
+// the header in front of the frames written so far, the sizes are only
+// right once it's rewritten (at every drain and at the end)
+static int write_header(struct output_session* out) {
+	struct output_sink* s = out->sink;
+	struct fmt_sub_chunk fmt;
+	uint64_t data = s->data_bytes;
+
+	// a riff chunk can't hold more than 4 GB, the rest is still written
+	if (data > UINT32_MAX - WAV_HEADER_BYTES) {
+		data = UINT32_MAX - WAV_HEADER_BYTES;
+	}
+
+	wav_pcm_fmt(&fmt, out->channels, out->rate, s->frame_size * 8 / out->channels);
+
+	return wav_write_header(s->fd, &fmt, data);
+}
+
+static int file_open(struct output_session* out) {
+	if (sink_open(out) < 0) {
+		return -1;
+	}
+
+	struct output_sink* s = out->sink;
+
+	s->fd = open(out->device, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (s->fd < 0) {
+		fprintf(stderr, "opening %s failed: %s\n", out->device, strerror(errno));
+		sink_close(out);
+		return -1;
+	}
+
+	return 0;
+}
+
+// a wav holds one format: everything is rendered as S32 (so a track's
+// bit depth never matters), and channels and rate are the first track's
+static int file_configure
+(
+	struct output_session* out,
+	snd_pcm_format_t format,
+	unsigned int channels,
+	unsigned int rate
+)
+{
+	struct output_sink* s = out->sink;
+
+	if (format != SND_PCM_FORMAT_S32_LE) {
+		return -1;
+	}
+
+	if (s->frame_size && (channels != out->channels || rate != out->rate)) {
+		fprintf(stderr, "%s holds %u channels at %u hz, a track with %u at %u hz "
+			"can't go in it (-R renders every track at one rate)\n",
+			out->device, out->channels, out->rate, channels, rate);
+		return -1;
+	}
+
+	if (s->frame_size) {
+		return sink_configure(out, format, channels, rate);
+	}
+
+	sink_configure(out, format, channels, rate);
+	out->channels = channels;
+	out->rate = rate;
+
+	// room for the header, the frames follow it
+	if (write_header(out) < 0 || lseek(s->fd, 0, SEEK_END) < 0) {
+		fprintf(stderr, "writing %s failed: %s\n", out->device, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void file_drain(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->frame_size && !s->failed && write_header(out) < 0) {
+		fprintf(stderr, "writing %s failed: %s\n", out->device, strerror(errno));
+		s->failed = 1;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void file_close(struct output_session* out) {
+	struct output_sink* s = out->sink;
+
+	close(s->fd);
+	sink_close(out);
+}
+
+const struct output_backend output_file = {
+	.name = "file",
+	.open = file_open,
+	.configure = file_configure,
+	.avail = sink_avail,
+	.wait = sink_wait,
+	.write = sink_write,
+	.delay = sink_delay,
+	.recover = sink_recover,
+	.drain = file_drain,
+	.drop = sink_drop,
+	.pause = sink_pause,
+	.close = file_close,
+};
@@ -3,10 +3,10 @@ simple wav player using ALSA (Advance Linux Sound Architecture)
 
 INTRO:
 
-in this player, i'm copying to program memory all the relevant data information
-from the .wav that is actualy playing, which is not a great ideia
-for efficiency, but the ideia is to get used to this world, then 
-get things a little bit faster later using dynamic reading with mmap
+in this player, the .wav that is actualy playing is mapped with mmap and
+its data chunk is read on demand: each tick converts only the frames it
+is about to write, and the pages already played are given back to the
+kernel, so memory stays bounded no matter how long the file is
 
 
 
@@ -108,7 +108,20 @@ snd_strerror(int err) -> converts ALSA error codes to human readable format
 #include "fd_handle.h"
 #include "sound_engine.h"
 #include "cli_interface.h"
+#include "library.h"
+#include "watcher.h"
+#include "readahead.h"
+#include "resample.h"
+#include "output.h"
+#include "export.h"
+#include "loudness.h"
+#include "waveform.h"
+#include "screen.h"
+#include "realtime.h"
+#include <sched.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
 
 volatile sig_atomic_t should_exit = 0;
 
@@ -117,48 +130,6 @@ void handle_signal(int sig) {
 	should_exit = 1;
 }
 
-void add_track(const char* path, const char* fullname, void* userdata) {
-	struct player_state* st = (struct player_state*) userdata;
-
-	if (!st) {
-		return;
-	}
-
-	struct track t;
-	t.path = strdup(path);
-	t.name = strdup(fullname);
-
-	struct fmt_sub_chunk fmt;
-	struct data_sub_chunk data;
-
-	int file = read_wav_from_filename(path,
-		NULL, &fmt, &data, NULL, NULL, NULL);
-
-	if (file < 0) {
-		fprintf(stderr, "reading wav failed\n");
-		return;
-	}
-
-	close(file);
-
-	double duration = (double) (data.subchunk2_size / fmt.byte_rate);
-	t.duration = duration;
-
-	if (playlist_push(&st->playlist, t) < 0) {
-		if (st->playlist.len > 0) {
-			playlist_free(&st->playlist);
-
-			free(t.path);
-			free(t.name);
-		}
-	}
-}
-
-void create_playlist(const char* path, int recursive, struct player_state* st) {
-	playlist_init(&st->playlist);
-	list_wavs(path, recursive, add_track, st);
-}
-
 int init
 (
 	const char* path,
@@ -180,17 +151,78 @@ int init
 	st->mode = COMMAND;
 	st->play_state = STOPPED;
 	st->player_gain = 1.0; // default
+	st->normalize = 1;
 	st->played = 0;
 
-	create_playlist(st->dir_path, recursive, st);
+	if (library_load(st) < 0) {
+		return -1;
+	}
+
+	// without inotify the playlist just doesn't follow the directory
+	watcher_init(st);
+
 	st->current_track = 0;
 	st->cursor = 0;
 
-	st->pcm = NULL;
+	st->out.pcm = NULL;
+	st->out.format = SND_PCM_FORMAT_UNKNOWN;
+
+	if (ring_init(&st->ring, RING_FRAMES, MAX_CHANNELS) < 0) {
+		fprintf(stderr, "allocating ring buffer failed\n");
+		watcher_free(st);
+		library_close(st);
+		return -1;
+	}
+
+	if (audio_events_init(st) < 0) {
+		ring_free(&st->ring);
+		watcher_free(st);
+		library_close(st);
+		return -1;
+	}
 
 	return 0;
 }
 
+// -e: what's on disk, not what the index remembers, so the rescan is
+// waited for
+static int batch_export(struct player_state* st, const struct export_options* opt) {
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+
+	while (st->rescanning && !library_adopt(st)) {
+		nanosleep(&ts, NULL);
+	}
+
+	return export_playlist(&st->playlist, opt);
+}
+
+void print_usage(const char* name) {
+	printf("usage: %s [-m] [-o OUTPUT] [-r DEPTH] [-R RATE [-q QUALITY]] [-t PRIORITY] [PATH] [RECURSIVE]\n", name);
+	printf("       %s -e DIR [-R RATE [-q QUALITY]] [-b BITS] [-c CHANNELS] [-j JOBS] [PATH] [RECURSIVE]\n", name);
+	printf("if [PATH] (relative or global) is omitted, then the directory\n");
+	printf("that will be used by the player will be the current directory ./\n");
+	printf("[RECURSIVE] must be 1 if you want the program to read the\n");
+	printf("directory recursively (default) or 0 otherwise\n\n");
+	printf("-m  write to the device through mmap (snd_pcm_mmap_begin/commit)\n");
+	printf("    instead of snd_pcm_writei, falls back if the device refuses\n");
+	printf("-o  where frames go: alsa[:DEVICE] (default), null (thrown away as\n");
+	printf("    fast as they come), null:paced (at the rate they'd be played) or\n");
+	printf("    file:PATH (a wav, as fast as they come)\n");
+	printf("-r  reads of the track kept in flight ahead of playback (default %d,\n",
+		READAHEAD_DEPTH);
+	printf("    0 turns the read-ahead off)\n");
+	printf("-R  plays every track at RATE hz, converted by the built-in\n");
+	printf("    resampler, so the device is never set up again for a rate\n");
+	printf("-q  resampler quality: fast, medium (default), high or best\n");
+	printf("-t  feeds the device from a SCHED_FIFO thread at PRIORITY (1-99) with\n");
+	printf("    its buffers locked in memory; every track is decoded into the\n");
+	printf("    ring first (no passthrough, -m is ignored)\n");
+	printf("-e  exports every track to DIR (same paths as in PATH) and exits,\n");
+	printf("    at RATE hz if -R is given, with -b BITS (8, 16, 24 or 32) and\n");
+	printf("    -c CHANNELS (the track's own by default), on JOBS threads (-j,\n");
+	printf("    one per core by default)\n");
+}
+
 int main(int argc, const char* argv[]) {
 	struct sigaction sa = {0};
 	sa.sa_handler = handle_signal;
@@ -202,6 +234,46 @@ int main(int argc, const char* argv[]) {
 	// --- READING .WAV ---
 	char path[PATH_MAX_LENGTH];
 	int recursive = 1;
+	int use_mmap = 0;
+	const char* output = "alsa";
+	int readahead_depth = READAHEAD_DEPTH;
+	unsigned int device_rate = 0;
+	int quality = RESAMPLE_DEFAULT;
+	int rt_priority = 0;
+	struct export_options export_opt = { .gain = 1.0 };
+	const char* name = argv[0];
+	int opt;
+
+	while ((opt = getopt(argc, (char* const*) argv, "mo:r:R:q:t:e:b:c:j:")) != -1) {
+		if (opt == 'm') {
+			use_mmap = 1;
+		} else if (opt == 'o') {
+			output = optarg;
+		} else if (opt == 'r' && atoi(optarg) >= 0 && atoi(optarg) <= READAHEAD_MAX_DEPTH) {
+			readahead_depth = atoi(optarg);
+		} else if (opt == 'R' && atoi(optarg) >= 8000 && atoi(optarg) <= 384000) {
+			device_rate = atoi(optarg);
+		} else if (opt == 'q' && resample_quality_parse(optarg) >= 0) {
+			quality = resample_quality_parse(optarg);
+		} else if (opt == 't' && atoi(optarg) >= sched_get_priority_min(SCHED_FIFO) &&
+			atoi(optarg) <= sched_get_priority_max(SCHED_FIFO)) {
+			rt_priority = atoi(optarg);
+		} else if (opt == 'e') {
+			export_opt.dest = optarg;
+		} else if (opt == 'b' && atoi(optarg) > 0) {
+			export_opt.bits = atoi(optarg);
+		} else if (opt == 'c' && atoi(optarg) > 0) {
+			export_opt.channels = atoi(optarg);
+		} else if (opt == 'j' && atoi(optarg) > 0) {
+			export_opt.jobs = atoi(optarg);
+		} else {
+			print_usage(name);
+			return -1;
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc == 1) {
 		snprintf(path, PATH_MAX_LENGTH, "%s", ".");
@@ -211,29 +283,74 @@ int main(int argc, const char* argv[]) {
 		snprintf(path, PATH_MAX_LENGTH, "%s", argv[1]);
 		recursive = atoi(argv[2]);
 	} else {
-		printf("usage: %s [PATH] [RECURSIVE]\n", argv[0]);
-		printf("if [PATH] (relative or global) is omitted, then the directory\n");
-		printf("that will be used by the player will be the current directory ./\n");
-		printf("[RECURSIVE] must be 1 if you want the program to read the\n");
-		printf("directory recursively (default) or 0 otherwise\n");
+		print_usage(name);
+		return -1;
+	}
+
+	export_opt.rate = device_rate;
+	export_opt.quality = quality;
+	export_opt.root = path;
+
+	if (export_opt.dest && export_check(&export_opt) < 0) {
+		print_usage(name);
 		return -1;
 	}
 
 	struct player_state st = {0};
 
+	if (output_select(&st.out, output) < 0) {
+		print_usage(name);
+		return -1;
+	}
+
 	int ret = init(path, recursive, &st);
+	st.out.use_mmap = use_mmap && !rt_priority;
+	st.device_rate = device_rate;
+	st.resample_quality = quality;
+	st.rt_priority = rt_priority;
 
 	if (ret < 0) {
 		fprintf(stderr, "reading dir failed\n");
 		return -1;
 	}
 
+	if (export_opt.dest) {
+		int failed = batch_export(&st, &export_opt);
+
+		watcher_free(&st);
+		library_close(&st);
+		ring_free(&st.ring);
+		audio_events_free(&st);
+		resample_banks_free();
+
+		return failed == 0 ? 0 : 1;
+	}
+
+	// what the output thread reads never pages out (see realtime.h)
+	if (rt_priority && realtime_lock(&st, sizeof(st)) == 0) {
+		realtime_lock(st.ring.data, st.ring.size * MAX_CHANNELS * sizeof(int32_t));
+	}
+
+	// playback works without it, only less well on slow storage
+	if (readahead_init(&st.readahead, readahead_depth) < 0) {
+		fprintf(stderr, "starting read-ahead failed\n");
+	}
+
 	while (should_exit == 0 && st.running == 1) {
 		command_loop(&st, &should_exit);
 		player_loop(&st, &should_exit);
 	}
 
-	playlist_free(&st.playlist);
+	output_close(&st.out);
+	readahead_free(&st.readahead);
+	loudness_stop(&st);
+	waveform_stop(&st);
+	screen_close(st.screen);
+	watcher_free(&st);
+	library_close(&st);
+	ring_free(&st.ring);
+	audio_events_free(&st);
+	resample_banks_free();
 
 	return 0;
 }
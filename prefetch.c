@@ -0,0 +1,215 @@
+#include "prefetch.h"
+#include "fd_handle.h"
+#include "convert.h"
+#include "resample.h"
+#include "loudness.h"
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+int track_source_open
+(
+	const char* path,
+	size_t index,
+	struct wav_info* info,
+	struct track_source* src
+)
+{
+	struct track_source s = {0};
+
+	if (wav_stream_open(path, info, &s.stream) < 0) {
+		return -1;
+	}
+
+	s.fmt = info->fmt;
+
+	s.convert = convert_select(&s.fmt);
+
+	if (!s.convert || s.fmt.num_channels == 0 ||
+		s.fmt.num_channels > MAX_CHANNELS) {
+		wav_stream_close(&s.stream);
+		return -1;
+	}
+
+	s.index = index;
+	s.frames = s.stream.data_len / s.stream.frame_size;
+	s.norm = 1.0f;
+	*src = s;
+
+	return 0;
+}
+
+void track_source_close(struct track_source* src) {
+	wav_stream_close(&src->stream);
+}
+
+void track_source_resample(struct track_source* src, unsigned int rate, int quality) {
+	src->resample = NULL;
+
+	if (rate && rate != src->fmt.sample_rate) {
+		src->resample = resample_bank_get(src->fmt.sample_rate, rate, quality);
+	}
+}
+
+unsigned int track_source_rate(const struct track_source* src) {
+	return src->resample ? src->resample->out_rate : src->fmt.sample_rate;
+}
+
+// can next follow cur on the device as it is set up right now?
+int track_source_compatible
+(
+	const struct track_source* cur,
+	const struct track_source* next,
+	int passthrough
+)
+{
+	if (cur->fmt.num_channels != next->fmt.num_channels ||
+		track_source_rate(cur) != track_source_rate(next)) {
+		return 0;
+	}
+
+	// the device takes the file's bytes as they are
+	if (passthrough) {
+		return cur->fmt.bits_per_sample == next->fmt.bits_per_sample;
+	}
+
+	return 1;
+}
+
+static void signal_prefetch(struct player_state* st, int state) {
+	uint64_t one = 1;
+
+	atomic_store(&st->next_state, state);
+
+	ssize_t n = write(st->prefetch_fd, &one, sizeof(one));
+	(void) n;
+}
+
+// opens the next track and faults in its first seconds, so the decoder
+// never waits on the disk at the track change
+static void* prefetch_thread_main(void* arg) {
+	struct player_state* st = arg;
+	struct track_source src;
+
+	// the playlist index stays with the main thread (st->next_index),
+	// entries can move while this runs. what the library knew about the
+	// file was copied with its path, so it's usually not probed again
+	if (track_source_open(st->next_path, 0, &st->next_info, &src) < 0) {
+		fprintf(stderr, "prefetching wav failed\n");
+		signal_prefetch(st, NEXT_FAILED);
+		return NULL;
+	}
+
+	track_source_resample(&src, st->device_rate, st->resample_quality);
+	src.norm = st->next_norm;
+
+	size_t bytes = (size_t) src.fmt.byte_rate * PREFETCH_SECONDS;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	volatile uint8_t sink = 0;
+
+	if (bytes > src.stream.data_len) {
+		bytes = src.stream.data_len;
+	}
+
+	madvise((void*) ((uintptr_t) src.stream.data & ~(page - 1)),
+		bytes + page, MADV_WILLNEED);
+
+	for (size_t off = 0; off < bytes; off += page) {
+		sink ^= src.stream.data[off];
+	}
+
+	(void) sink;
+
+	st->next = src;
+	signal_prefetch(st, NEXT_READY);
+
+	return NULL;
+}
+
+static void prefetch_join(struct player_state* st) {
+	if (st->prefetching) {
+		pthread_join(st->prefetch_thread, NULL);
+		st->prefetching = 0;
+	}
+}
+
+int prefetch_state(struct player_state* st) {
+	int state;
+
+	// a few comparisons on the decoder's side, not worth a wakeup
+	while ((state = atomic_load(&st->next_state)) == NEXT_CHECKING) {
+		sched_yield();
+	}
+
+	return state;
+}
+
+// drops a prefetched track the decoder didn't take
+// returns 0 if the decoder already took it
+int prefetch_release(struct player_state* st) {
+	prefetch_join(st);
+
+	for (;;) {
+		int state = NEXT_READY;
+
+		if (atomic_compare_exchange_strong(&st->next_state, &state, NEXT_PENDING)) {
+			track_source_close(&st->next);
+			return 1;
+		}
+
+		if (state != NEXT_CHECKING) {
+			return state != NEXT_TAKEN;
+		}
+
+		prefetch_state(st);
+	}
+}
+
+void prefetch_request(struct player_state* st, size_t index, const struct track* t) {
+	prefetch_join(st);
+
+	// already prefetched (e.g. after a loop toggle that didn't change it)
+	if (prefetch_state(st) == NEXT_READY && st->next_index == index &&
+		track_compare_path(t, st->next_path) == 0) {
+		return;
+	}
+
+	if (!prefetch_release(st)) {
+		return;
+	}
+
+	atomic_store(&st->next_state, NEXT_LOADING);
+	st->next_index = index;
+	track_path(t, st->next_path, sizeof(st->next_path));
+	st->next_info = t->info;
+	st->next_norm = loudness_gain(t);
+
+	if (pthread_create(&st->prefetch_thread, NULL,
+		prefetch_thread_main, st) != 0) {
+		signal_prefetch(st, NEXT_FAILED);
+		return;
+	}
+
+	st->prefetching = 1;
+}
+
+void prefetch_end(struct player_state* st) {
+	if (prefetch_release(st)) {
+		signal_prefetch(st, NEXT_END);
+	}
+}
+
+// only called while the decoder isn't running, so nobody else can own
+// a track that is still taken
+void prefetch_cancel(struct player_state* st) {
+	prefetch_join(st);
+
+	int state = atomic_load(&st->next_state);
+
+	if (state == NEXT_READY || state == NEXT_TAKEN) {
+		track_source_close(&st->next);
+	}
+
+	atomic_store(&st->next_state, NEXT_PENDING);
+}
@@ -0,0 +1,56 @@
+/*
+next track prefetch, for gapless playback
+
+as soon as a track starts, the main thread asks for the one that will
+follow it. a background thread opens it, maps it and faults in its first
+seconds, then leaves it in st->next as NEXT_READY
+
+when the decoder reaches the end of the current track and st->next is
+ready and compatible (same channels and rate once resampled, and same
+sample format on passthrough), it takes it (NEXT_TAKEN) and keeps producing frames
+without stopping the device. it claims it (NEXT_CHECKING) before comparing
+and puts it back as NEXT_READY if it can't follow. the main thread adopts
+it as the current track once its first frame was written (track_changed)
+*/
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "types.h"
+
+#define PREFETCH_SECONDS 3 // audio faulted in ahead of the track change
+
+// info is updated if the file changed since it was probed
+int track_source_open
+(
+	const char* path,
+	size_t index,
+	struct wav_info* info,
+	struct track_source* src
+);
+
+void track_source_close(struct track_source* src);
+
+// plays src at rate through the resampler, if its own rate differs and
+// the ratio can be converted (otherwise the device follows the track)
+void track_source_resample(struct track_source* src, unsigned int rate, int quality);
+
+// the rate src's frames reach the device at
+unsigned int track_source_rate(const struct track_source* src);
+
+int track_source_compatible
+(
+	const struct track_source* cur,
+	const struct track_source* next,
+	int passthrough
+);
+
+void prefetch_request(struct player_state* st, size_t index, const struct track* t);
+void prefetch_end(struct player_state* st); // no track follows
+int prefetch_release(struct player_state* st); // 0: the decoder took it
+
+// st->next_state, once the decoder is done checking the prefetched track
+int prefetch_state(struct player_state* st);
+void prefetch_cancel(struct player_state* st);
+
+#endif
@@ -0,0 +1,552 @@
+#include "readahead.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#define WAKE_DATA UINT64_MAX // user_data of the poll on wake_fd
+
+// a window being read
+struct window {
+	uint64_t offset;
+	size_t len;
+	uint64_t started; // ns
+	int busy;
+};
+
+// what the thread works on, only touched by it
+struct reader {
+	int fd; // its own dup of the stream's fd, -1 for none
+	uint64_t end; // end of the data chunk in the file
+	uint64_t next; // offset of the next window to read
+	struct window windows[READAHEAD_MAX_DEPTH];
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wake(struct readahead* ra) {
+	uint64_t one = 1;
+	ssize_t n = write(ra->wake_fd, &one, sizeof(one));
+	(void) n;
+}
+
+static void drain_wake(struct readahead* ra) {
+	uint64_t events;
+	ssize_t n = read(ra->wake_fd, &events, sizeof(events));
+	(void) n;
+}
+
+static void read_started(struct readahead* ra, struct window* w) {
+	w->busy = 1;
+	w->started = now_ns();
+	atomic_fetch_add(&ra->inflight, 1);
+	atomic_fetch_add(&ra->inflight_bytes, w->len);
+}
+
+static void read_done(struct readahead* ra, struct window* w) {
+	uint64_t latency = now_ns() - w->started;
+	uint64_t max = atomic_load(&ra->latency_max_ns);
+
+	w->busy = 0;
+	atomic_fetch_sub(&ra->inflight, 1);
+	atomic_fetch_sub(&ra->inflight_bytes, w->len);
+	atomic_fetch_add(&ra->reads, 1);
+	atomic_fetch_add(&ra->latency_ns, latency);
+
+	if (latency > max) {
+		atomic_store(&ra->latency_max_ns, latency);
+	}
+}
+
+// switches to the stream the decoder moved on to
+static void pick_up_stream(struct readahead* ra, struct reader* r) {
+	pthread_mutex_lock(&ra->lock);
+
+	if (ra->pending_fd >= 0) {
+		// reads already in flight on the old one keep their own reference
+		if (r->fd >= 0) {
+			close(r->fd);
+		}
+
+		r->fd = ra->pending_fd;
+		r->end = ra->pending_end;
+		r->next = 0;
+		ra->pending_fd = -1;
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+}
+
+// the next window worth reading, 0 if there is none right now
+static size_t next_window(struct readahead* ra, struct reader* r, uint64_t* offset) {
+	uint64_t pos = atomic_load(&ra->pos);
+	uint64_t limit = pos + (uint64_t) ra->depth * READAHEAD_WINDOW;
+
+	if (r->fd < 0) {
+		return 0;
+	}
+
+	// started, or the decoder jumped away (a seek)
+	if (r->next < pos || r->next > limit) {
+		r->next = pos & ~((uint64_t) 4096 - 1);
+	}
+
+	if (limit > r->end) {
+		limit = r->end;
+	}
+
+	if (r->next >= limit) {
+		return 0;
+	}
+
+	size_t len = limit - r->next < READAHEAD_WINDOW ?
+		(size_t) (limit - r->next) : READAHEAD_WINDOW;
+
+	*offset = r->next;
+	r->next += len;
+
+	return len;
+}
+
+static struct window* free_window(struct readahead* ra, struct reader* r) {
+	for (int i = 0; i < ra->depth; i++) {
+		if (!r->windows[i].busy) {
+			return &r->windows[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* --- IO_URING --- */
+
+#ifdef HAVE_IO_URING
+
+struct readahead_uring {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_entries;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_map;
+	size_t sq_map_len;
+	void* cq_map; // the same as sq_map with IORING_FEAT_SINGLE_MMAP
+	size_t cq_map_len;
+	size_t sqes_len;
+	unsigned queued; // sqes not submitted yet
+};
+
+static void uring_free(struct readahead_uring* u) {
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_len);
+	}
+
+	if (u->cq_map && u->cq_map != u->sq_map) {
+		munmap(u->cq_map, u->cq_map_len);
+	}
+
+	if (u->sq_map) {
+		munmap(u->sq_map, u->sq_map_len);
+	}
+
+	close(u->fd);
+	free(u);
+}
+
+static struct readahead_uring* uring_init(unsigned entries) {
+	struct io_uring_params p;
+	struct readahead_uring* u = calloc(1, sizeof(*u));
+
+	if (!u) {
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	// IORING_OP_READ came with the same kernel (5.6)
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(u->fd);
+		free(u);
+		return NULL;
+	}
+
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_len > u->sq_map_len) {
+			u->sq_map_len = u->cq_map_len;
+		}
+
+		u->cq_map_len = u->sq_map_len;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+
+	if (u->sq_map == MAP_FAILED) {
+		u->sq_map = NULL;
+		uring_free(u);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_map = u->sq_map;
+	} else {
+		u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+
+		if (u->cq_map == MAP_FAILED) {
+			u->cq_map = NULL;
+			uring_free(u);
+			return NULL;
+		}
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		uring_free(u);
+		return NULL;
+	}
+
+	uint8_t* sq = u->sq_map;
+	uint8_t* cq = u->cq_map;
+
+	u->sq_head = (unsigned*) (sq + p.sq_off.head);
+	u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	u->sq_entries = (unsigned*) (sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned*) (sq + p.sq_off.array);
+	u->cq_head = (unsigned*) (cq + p.cq_off.head);
+	u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	return u;
+}
+
+// queues an sqe filled like sqe, submitted by the next uring_enter()
+static int uring_queue(struct readahead_uring* u, const struct io_uring_sqe* sqe) {
+	unsigned tail = *u->sq_tail;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= *u->sq_entries) {
+		return -1;
+	}
+
+	unsigned index = tail & *u->sq_mask;
+
+	u->sqes[index] = *sqe;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+
+	return 0;
+}
+
+// submits what was queued and waits for at least wait completions
+static int uring_enter(struct readahead_uring* u, unsigned wait) {
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+		if (n >= 0) {
+			u->queued -= (unsigned) n < u->queued ? (unsigned) n : u->queued;
+			return 0;
+		}
+
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+static void uring_watch_wake(struct readahead* ra) {
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_POLL_ADD;
+	sqe.fd = ra->wake_fd;
+	sqe.poll_events = POLLIN;
+	sqe.user_data = WAKE_DATA;
+	uring_queue(ra->uring, &sqe);
+}
+
+static void uring_read(struct readahead* ra, struct reader* r, struct window* w) {
+	struct io_uring_sqe sqe;
+	int index = w - r->windows;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = r->fd;
+	sqe.off = w->offset;
+	sqe.addr = (uintptr_t) (ra->buffers + (size_t) index * READAHEAD_WINDOW);
+	sqe.len = w->len;
+	sqe.user_data = index;
+
+	if (uring_queue(ra->uring, &sqe) == 0) {
+		read_started(ra, w);
+	}
+}
+
+// returns 1 once the wake_fd fired (the poll has to be armed again)
+static int uring_reap(struct readahead* ra, struct reader* r) {
+	struct readahead_uring* u = ra->uring;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int woken = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+
+		if (cqe->user_data == WAKE_DATA) {
+			woken = 1;
+		} else if (cqe->user_data < READAHEAD_MAX_DEPTH) {
+			read_done(ra, &r->windows[cqe->user_data]);
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	return woken;
+}
+
+static void uring_loop(struct readahead* ra, struct reader* r) {
+	uring_watch_wake(ra);
+
+	while (!atomic_load(&ra->stop)) {
+		struct window* w;
+		uint64_t offset;
+		size_t len;
+
+		pick_up_stream(ra, r);
+
+		while ((w = free_window(ra, r)) && (len = next_window(ra, r, &offset))) {
+			w->offset = offset;
+			w->len = len;
+			uring_read(ra, r, w);
+		}
+
+		if (uring_enter(ra->uring, 1) < 0) {
+			break;
+		}
+
+		if (uring_reap(ra, r)) {
+			drain_wake(ra);
+			uring_watch_wake(ra);
+		}
+	}
+
+	// the buffers can't go away under reads still in flight
+	while (atomic_load(&ra->inflight) > 0 && uring_enter(ra->uring, 1) == 0) {
+		uring_reap(ra, r);
+	}
+}
+
+#else
+
+struct readahead_uring {
+	int unused;
+};
+
+static struct readahead_uring* uring_init(unsigned entries) {
+	(void) entries;
+	return NULL;
+}
+
+static void uring_free(struct readahead_uring* u) {
+	(void) u;
+}
+
+static void uring_loop(struct readahead* ra, struct reader* r) {
+	(void) ra;
+	(void) r;
+}
+
+#endif
+
+/* --- PREAD --- */
+
+static void pread_loop(struct readahead* ra, struct reader* r) {
+	struct pollfd pfd = { .fd = ra->wake_fd, .events = POLLIN };
+
+	while (!atomic_load(&ra->stop)) {
+		struct window* w = &r->windows[0];
+		uint64_t offset;
+
+		pick_up_stream(ra, r);
+		w->len = next_window(ra, r, &offset);
+
+		if (!w->len) {
+			if (poll(&pfd, 1, -1) > 0) {
+				drain_wake(ra);
+			}
+
+			continue;
+		}
+
+		w->offset = offset;
+		read_started(ra, w);
+		ssize_t n = pread(r->fd, ra->buffers, w->len, w->offset);
+		read_done(ra, w);
+
+		// nothing more to read there (truncated since, or an error)
+		if (n <= 0) {
+			r->next = r->end;
+		}
+	}
+}
+
+static void* readahead_thread_main(void* arg) {
+	struct readahead* ra = arg;
+	struct reader r = { .fd = -1 };
+
+	if (ra->uring) {
+		uring_loop(ra, &r);
+	} else {
+		pread_loop(ra, &r);
+	}
+
+	if (r.fd >= 0) {
+		close(r.fd);
+	}
+
+	return NULL;
+}
+
+int readahead_init(struct readahead* ra, int depth) {
+	memset(ra, 0, sizeof(*ra));
+	ra->pending_fd = -1;
+	ra->wake_fd = -1;
+
+	if (depth <= 0) {
+		return 0;
+	}
+
+	if (depth > READAHEAD_MAX_DEPTH) {
+		depth = READAHEAD_MAX_DEPTH;
+	}
+
+	ra->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ra->uring = uring_init(depth + 1); // the reads and the poll on wake_fd
+	ra->backend = ra->uring ? "io_uring" : "pread";
+
+	// pread only ever has one window in flight
+	size_t windows = ra->uring ? (size_t) depth : 1;
+	ra->buffers = malloc(windows * READAHEAD_WINDOW);
+
+	if (ra->wake_fd < 0 || !ra->buffers) {
+		perror("readahead");
+		readahead_free(ra);
+		return -1;
+	}
+
+	ra->depth = depth;
+	pthread_mutex_init(&ra->lock, NULL);
+
+	if (pthread_create(&ra->thread, NULL, readahead_thread_main, ra) != 0) {
+		pthread_mutex_destroy(&ra->lock);
+		readahead_free(ra);
+		return -1;
+	}
+
+	ra->running = 1;
+	return 0;
+}
+
+void readahead_free(struct readahead* ra) {
+	if (ra->running) {
+		atomic_store(&ra->stop, 1);
+		wake(ra);
+		pthread_join(ra->thread, NULL);
+		pthread_mutex_destroy(&ra->lock);
+		ra->running = 0;
+	}
+
+	if (ra->uring) {
+		uring_free(ra->uring);
+	}
+
+	if (ra->pending_fd >= 0) {
+		close(ra->pending_fd);
+	}
+
+	if (ra->wake_fd >= 0) {
+		close(ra->wake_fd);
+	}
+
+	free(ra->buffers);
+	memset(ra, 0, sizeof(*ra));
+	ra->pending_fd = -1;
+	ra->wake_fd = -1;
+}
+
+void readahead_advance(struct readahead* ra, const struct wav_stream* ws, size_t frame) {
+	if (!ra->running || !ws->map) {
+		return;
+	}
+
+	uint64_t data = (uint64_t) (ws->data - ws->map);
+	uint64_t pos = data + (uint64_t) frame * ws->frame_size;
+
+	atomic_store(&ra->pos, pos);
+
+	// another track: handed over with a dup of its fd, the stream may be
+	// closed before the thread gets to it
+	if (ws->id != ra->stream_id) {
+		pthread_mutex_lock(&ra->lock);
+
+		if (ra->pending_fd >= 0) {
+			close(ra->pending_fd);
+		}
+
+		ra->pending_fd = fcntl(ws->fd, F_DUPFD_CLOEXEC, 0);
+		ra->pending_end = data + ws->data_len;
+		ra->stream_id = ws->id;
+		ra->woken_at = UINT64_MAX;
+
+		pthread_mutex_unlock(&ra->lock);
+	}
+
+	// woken once per window read, or when it jumps back
+	if (pos >= ra->woken_at + READAHEAD_WINDOW || pos < ra->woken_at) {
+		ra->woken_at = pos;
+		wake(ra);
+	}
+}
@@ -0,0 +1,34 @@
+/*
+read-ahead of the track being played
+
+the decoder reads tracks through their mapping, so a page that isn't in
+the page cache yet stalls it (and the device behind it) on the disk. a
+read-ahead thread keeps up to depth windows ahead of the decoder in
+flight, so the pages are cached by the time it gets there
+
+the reads go through io_uring, all of them in flight at once. where
+io_uring isn't available (old kernel, seccomp...) the thread reads the
+windows one at a time with pread() instead
+
+the decoder only publishes how far it got (readahead_advance()), it
+never waits on a read. it follows the decoder from one track to the
+next, and jumps along with a seek
+*/
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "types.h"
+
+#define READAHEAD_WINDOW (256 << 10) // bytes per read
+#define READAHEAD_DEPTH 4 // windows in flight by default
+#define READAHEAD_MAX_DEPTH 32
+
+// depth 0 leaves it off, which isn't an error
+int readahead_init(struct readahead* ra, int depth);
+void readahead_free(struct readahead* ra);
+
+// called by the decoder after reading up to frame of ws
+void readahead_advance(struct readahead* ra, const struct wav_stream* ws, size_t frame);
+
+#endif
@@ -0,0 +1,102 @@
+#include "realtime.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// each refusal is only reported once per run
+static int fifo_refused;
+static int lock_refused;
+
+int realtime_lock(const void* addr, size_t len) {
+	if (mlock(addr, len) == 0) {
+		return 0;
+	}
+
+	if (!lock_refused) {
+		fprintf(stderr, "locking playback buffers failed: %s "
+			"(RLIMIT_MEMLOCK), they may be paged out\n", strerror(errno));
+		lock_refused = 1;
+	}
+
+	return -1;
+}
+
+static void* map_stack(void) {
+	long page = sysconf(_SC_PAGESIZE);
+	uint8_t* stack = mmap(NULL, REALTIME_STACK_BYTES, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+	if (stack == MAP_FAILED) {
+		return NULL;
+	}
+
+	// a guard page under it, an overflow faults instead of going on
+	// into whatever is mapped there
+	if (page <= 0 || mprotect(stack, page, PROT_NONE) < 0) {
+		munmap(stack, REALTIME_STACK_BYTES);
+		return NULL;
+	}
+
+	// locked (and faulted in) all at once, not page by page while playing
+	realtime_lock(stack + page, REALTIME_STACK_BYTES - page);
+
+	return stack;
+}
+
+int realtime_start
+(
+	pthread_t* thread,
+	void** stack,
+	int priority,
+	void* (*fn)(void*),
+	void* arg
+)
+{
+	pthread_attr_t attr;
+	struct sched_param param = { .sched_priority = priority };
+
+	if (!(*stack = map_stack())) {
+		fprintf(stderr, "mapping the output thread's stack failed\n");
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, *stack, REALTIME_STACK_BYTES);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+
+	int err = pthread_create(thread, &attr, fn, arg);
+	int fifo = err == 0;
+
+	if (err == EPERM) {
+		if (!fifo_refused) {
+			fprintf(stderr, "real-time scheduling refused (needs CAP_SYS_NICE "
+				"or an rtprio limit), playing at normal priority\n");
+			fifo_refused = 1;
+		}
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(thread, &attr, fn, arg);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (err != 0) {
+		munmap(*stack, REALTIME_STACK_BYTES);
+		*stack = NULL;
+		return -1;
+	}
+
+	return fifo;
+}
+
+void realtime_join(pthread_t thread, void* stack) {
+	pthread_join(thread, NULL);
+
+	if (stack) {
+		munmap(stack, REALTIME_STACK_BYTES);
+	}
+}
@@ -0,0 +1,47 @@
+/*
+real-time playback (-t)
+
+the output thread, the one that only moves frames from the ring to the
+device, can run under SCHED_FIFO, ahead of everything the system runs
+at normal priority, so a loaded host doesn't make the device underrun.
+nothing it needs may then make it wait:
+- its stack is mapped up front and locked in memory, as are the ring
+  and the player state it reads, so it never page faults
+- playback always goes through the decode thread and the ring (no
+  passthrough, no mmap access): only the decoder, at normal priority,
+  touches the mapped track and the read-ahead
+- in steady state it doesn't allocate, lock or make any syscall besides
+  the device's (avail, wait, write): the decoder isn't woken by it but
+  looks at the ring every REALTIME_DECODE_POLL of it
+(wav_bench's realtime stage checks it doesn't allocate)
+
+when the system refuses SCHED_FIFO (no CAP_SYS_NICE, rtprio limit) or
+mlock (RLIMIT_MEMLOCK), playback goes on without, after a warning
+*/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "types.h"
+
+#define REALTIME_STACK_BYTES (1 << 20) // locked stack of the output thread
+#define REALTIME_DECODE_POLL 4 // the decoder looks at the ring every 1/4 of it
+
+// locks len bytes at addr in memory, -1 if refused
+int realtime_lock(const void* addr, size_t len);
+
+// starts fn on a locked stack of its own (*stack, for realtime_join()),
+// under SCHED_FIFO at priority (1..99) when allowed. returns 1 if it
+// runs under SCHED_FIFO, 0 at normal priority, -1 if it didn't start
+int realtime_start
+(
+	pthread_t* thread,
+	void** stack,
+	int priority,
+	void* (*fn)(void*),
+	void* arg
+);
+
+void realtime_join(pthread_t thread, void* stack);
+
+#endif
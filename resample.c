@@ -0,0 +1,386 @@
+#include "resample.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+typedef float (*dot_fn)(const float* x, const float* h, size_t taps);
+
+static const struct resample_level levels[] = {
+	{ "fast", 8, 0.80, 5.0 },
+	{ "medium", 16, 0.88, 6.5 },
+	{ "high", 32, 0.92, 8.0 },
+	{ "best", 64, 0.95, 9.5 },
+};
+
+static struct resample_bank banks[RESAMPLE_MAX_BANKS];
+static size_t banks_len;
+static pthread_mutex_t banks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const struct resample_level* resample_levels(size_t* count) {
+	*count = sizeof(levels) / sizeof(levels[0]);
+	return levels;
+}
+
+int resample_quality_parse(const char* name) {
+	for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		if (strcasecmp(name, levels[i].name) == 0) {
+			return (int) i;
+		}
+	}
+
+	return -1;
+}
+
+/* --- KERNELS --- */
+
+static float dot_scalar(const float* x, const float* h, size_t taps) {
+	float sum = 0.0f;
+
+	for (size_t i = 0; i < taps; i++) {
+		sum += x[i] * h[i];
+	}
+
+	return sum;
+}
+
+#ifdef HAVE_X86
+
+// taps is always a multiple of 8, so there is no scalar tail. x is
+// wherever the window starts, only the coefficients are aligned
+__attribute__((target("sse2")))
+static float dot_sse2(const float* x, const float* h, size_t taps) {
+	__m128 a = _mm_setzero_ps();
+	__m128 b = _mm_setzero_ps();
+
+	for (size_t i = 0; i < taps; i += 8) {
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_load_ps(h + i)));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_load_ps(h + i + 4)));
+	}
+
+	a = _mm_add_ps(a, b);
+	a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+	a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+
+	return _mm_cvtss_f32(a);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* x, const float* h, size_t taps) {
+	__m256 a = _mm256_setzero_ps();
+	__m256 b = _mm256_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 16 <= taps; i += 16) {
+		a = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_load_ps(h + i), a);
+		b = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_load_ps(h + i + 8), b);
+	}
+
+	if (i < taps) {
+		a = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_load_ps(h + i), a);
+	}
+
+	a = _mm256_add_ps(a, b);
+
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+
+	return _mm_cvtss_f32(s);
+}
+
+#endif
+
+static dot_fn kernel = dot_scalar;
+static const char* kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// banks are built by whichever thread opens a track first, and the ui
+// asks for the name, so the pick is done exactly once
+static void pick_kernel(void) {
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		kernel = dot_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel = dot_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+}
+
+static dot_fn dot_kernel(void) {
+	pthread_once(&kernel_once, pick_kernel);
+	return kernel;
+}
+
+const char* resample_kernel_name(void) {
+	dot_kernel();
+	return kernel_name;
+}
+
+/* --- FILTER BANKS --- */
+
+static size_t gcd(size_t a, size_t b) {
+	while (b) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// zeroth order modified bessel function, for the kaiser window
+static double bessel_i0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+// coefficient k of phase p weighs the input frame that is
+// p / up + taps / 2 - 1 - k frames away from the output's time
+static void build_bank(struct resample_bank* b, const struct resample_level* level) {
+	double cutoff = level->passband;
+	double half = b->taps / 2.0;
+	double norm = bessel_i0(level->beta);
+
+	// downsampling: everything above the device's nyquist must go
+	if (b->out_rate < b->in_rate) {
+		cutoff *= (double) b->out_rate / b->in_rate;
+	}
+
+	for (size_t p = 0; p < b->up; p++) {
+		float* h = b->coeffs + p * b->taps;
+		double sum = 0.0;
+
+		for (size_t k = 0; k < b->taps; k++) {
+			double x = (double) p / b->up + half - 1.0 - k;
+			double r = x / half;
+			double sinc = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+			double window = r * r < 1.0 ? bessel_i0(level->beta * sqrt(1.0 - r * r)) / norm : 0.0;
+
+			h[k] = (float) (sinc * window);
+			sum += h[k];
+		}
+
+		// every phase passes dc unchanged, so no phase is louder
+		for (size_t k = 0; k < b->taps; k++) {
+			h[k] = (float) (h[k] / sum);
+		}
+	}
+}
+
+const struct resample_bank* resample_bank_get
+(
+	unsigned int in_rate,
+	unsigned int out_rate,
+	int quality
+)
+{
+	if (!in_rate || !out_rate || quality < 0 || quality >= RESAMPLE_QUALITIES) {
+		return NULL;
+	}
+
+	size_t g = gcd(in_rate, out_rate);
+	size_t up = out_rate / g;
+
+	if (up > RESAMPLE_MAX_PHASES) {
+		return NULL;
+	}
+
+	const struct resample_bank* found = NULL;
+
+	pthread_mutex_lock(&banks_lock);
+
+	for (size_t i = 0; i < banks_len && !found; i++) {
+		if (banks[i].in_rate == in_rate && banks[i].out_rate == out_rate &&
+			banks[i].quality == quality) {
+			found = &banks[i];
+		}
+	}
+
+	if (!found && banks_len < RESAMPLE_MAX_BANKS) {
+		struct resample_bank* b = &banks[banks_len];
+		const struct resample_level* level = &levels[quality];
+
+		b->in_rate = in_rate;
+		b->out_rate = out_rate;
+		b->quality = quality;
+		b->up = up;
+		b->down = in_rate / g;
+
+		// the filter has to span as many input frames as it gets
+		// narrower, rounded up to whole kernel steps
+		b->taps = level->taps * ((in_rate + out_rate - 1) / out_rate);
+		b->taps = (b->taps + 7) & ~(size_t) 7;
+
+		if (b->taps > RESAMPLE_MAX_TAPS) {
+			b->taps = RESAMPLE_MAX_TAPS;
+		}
+
+		b->coeffs = aligned_alloc(32, b->up * b->taps * sizeof(float));
+
+		if (b->coeffs) {
+			build_bank(b, level);
+			found = b;
+			banks_len++;
+		}
+	}
+
+	pthread_mutex_unlock(&banks_lock);
+
+	return found;
+}
+
+// only once nothing plays anymore
+void resample_banks_free(void) {
+	pthread_mutex_lock(&banks_lock);
+
+	for (size_t i = 0; i < banks_len; i++) {
+		free(banks[i].coeffs);
+		banks[i].coeffs = NULL;
+	}
+
+	banks_len = 0;
+
+	pthread_mutex_unlock(&banks_lock);
+}
+
+size_t resample_frames_out(const struct resample_bank* bank, size_t frames) {
+	return (frames * bank->up + bank->down - 1) / bank->down;
+}
+
+size_t resample_frames_in(const struct resample_bank* bank, size_t frames) {
+	return frames * bank->down / bank->up;
+}
+
+/* --- STREAMS --- */
+
+void resample_reset(struct resampler* rs, const struct resample_bank* bank, size_t channels) {
+	rs->bank = bank;
+	rs->channels = channels;
+	rs->pos = 0;
+	rs->phase = 0;
+	rs->finished = 0;
+
+	// the window of the first output is centered on the first input
+	// frame, the half before it is silence
+	rs->fill = bank->taps / 2 - 1;
+
+	for (size_t c = 0; c < channels; c++) {
+		memset(rs->history[c], 0, rs->fill * sizeof(float));
+	}
+}
+
+size_t resample_wants(const struct resampler* rs, size_t frames) {
+	const struct resample_bank* b = rs->bank;
+
+	if (rs->finished || !frames) {
+		return 0;
+	}
+
+	// the window of the last output asked for
+	size_t end = rs->pos + (rs->phase + (frames - 1) * b->down) / b->up + b->taps;
+	size_t room = RESAMPLE_HISTORY - (rs->fill - rs->pos);
+
+	if (end <= rs->fill) {
+		return 0;
+	}
+
+	return end - rs->fill < room ? end - rs->fill : room;
+}
+
+// moves what is still needed to the start of the history
+static void compact(struct resampler* rs) {
+	size_t keep = rs->fill - rs->pos;
+
+	for (size_t c = 0; c < rs->channels; c++) {
+		memmove(rs->history[c], rs->history[c] + rs->pos, keep * sizeof(float));
+	}
+
+	rs->pos = 0;
+	rs->fill = keep;
+}
+
+void resample_push(struct resampler* rs, const int32_t* in, size_t frames) {
+	size_t channels = rs->channels;
+
+	if (rs->fill + frames > RESAMPLE_HISTORY) {
+		compact(rs);
+	}
+
+	for (size_t c = 0; c < channels; c++) {
+		float* dst = rs->history[c] + rs->fill;
+
+		for (size_t f = 0; f < frames; f++) {
+			dst[f] = (float) in[f * channels + c];
+		}
+	}
+
+	rs->fill += frames;
+}
+
+void resample_finish(struct resampler* rs) {
+	size_t tail = rs->bank->taps / 2;
+
+	if (rs->finished) {
+		return;
+	}
+
+	if (rs->fill + tail > RESAMPLE_HISTORY) {
+		compact(rs);
+	}
+
+	for (size_t c = 0; c < rs->channels; c++) {
+		memset(rs->history[c] + rs->fill, 0, tail * sizeof(float));
+	}
+
+	rs->fill += tail;
+	rs->finished = 1;
+}
+
+static inline int32_t clamp_s32(float v) {
+	if (v >= 2147483648.0f) {
+		return INT32_MAX;
+	}
+
+	if (v <= -2147483648.0f) {
+		return INT32_MIN;
+	}
+
+	return (int32_t) v;
+}
+
+size_t resample_pull(struct resampler* rs, int32_t* out, size_t frames) {
+	const struct resample_bank* b = rs->bank;
+	dot_fn dot = dot_kernel();
+	size_t channels = rs->channels;
+	size_t done = 0;
+
+	for (; done < frames && rs->pos + b->taps <= rs->fill; done++) {
+		const float* h = b->coeffs + rs->phase * b->taps;
+
+		for (size_t c = 0; c < channels; c++) {
+			out[done * channels + c] = clamp_s32(dot(rs->history[c] + rs->pos, h, b->taps));
+		}
+
+		rs->phase += b->down;
+		rs->pos += rs->phase / b->up;
+		rs->phase %= b->up;
+	}
+
+	return done;
+}
@@ -0,0 +1,109 @@
+/*
+polyphase resampler (track rate -> device rate)
+
+with a device rate set (-R), every track is converted to that rate here
+instead of reopening the pcm at the track's own rate, so a playlist
+mixing rates plays through one device setup and stays gapless
+
+the ratio is kept exact: for in_rate -> out_rate both are divided by
+their gcd into down -> up, and output frame k lands on input time
+k * down / up. the windowed-sinc (kaiser) filter is cut into up phases
+of taps coefficients each, so every output frame is a single dot
+product of taps input frames per channel. that dot product is the hot
+loop and goes through a simd kernel picked once, like convert.h
+
+a bank (the coefficients) only depends on the two rates and the
+quality, banks are built on first use and shared by every track and
+thread until resample_banks_free(). a resampler is only the state of
+one stream (history, phase), fixed size, so a decoding thread never
+allocates
+*/
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "types.h"
+
+#define RESAMPLE_MAX_PHASES 1024 // ratios needing more aren't resampled
+#define RESAMPLE_MAX_TAPS 256
+#define RESAMPLE_MAX_BANKS 16
+#define RESAMPLE_HISTORY (RESAMPLE_MAX_TAPS + 2 * FRAMES_PER_TICK) // input frames buffered
+
+enum resample_quality {
+	RESAMPLE_FAST,
+	RESAMPLE_MEDIUM,
+	RESAMPLE_HIGH,
+	RESAMPLE_BEST,
+	RESAMPLE_QUALITIES
+};
+
+#define RESAMPLE_DEFAULT RESAMPLE_MEDIUM
+
+struct resample_level {
+	const char* name;
+	size_t taps; // per phase when upsampling, scaled up when downsampling
+	double passband; // fraction of the lower nyquist kept
+	double beta; // kaiser window, higher: more stopband attenuation
+};
+
+struct resample_bank {
+	unsigned int in_rate;
+	unsigned int out_rate;
+	int quality;
+	size_t up; // output frames for every down input frames
+	size_t down;
+	size_t taps; // multiple of 8
+	float* coeffs; // up phases of taps coefficients
+};
+
+struct resampler {
+	const struct resample_bank* bank;
+	size_t channels;
+	size_t pos; // first input frame of the next output's window
+	size_t fill; // input frames buffered
+	size_t phase; // of the next output, 0..up-1
+	int finished; // the end of the input was pushed
+	float history[MAX_CHANNELS][RESAMPLE_HISTORY]; // one row per channel
+};
+
+// every level, from fast to best
+const struct resample_level* resample_levels(size_t* count);
+
+// -1 if name isn't a level
+int resample_quality_parse(const char* name);
+
+// "scalar", "sse2" or "avx2"
+const char* resample_kernel_name(void);
+
+// NULL if in_rate can't be converted to out_rate (too many phases)
+const struct resample_bank* resample_bank_get
+(
+	unsigned int in_rate,
+	unsigned int out_rate,
+	int quality
+);
+
+void resample_banks_free(void);
+
+// output frames for frames input frames, and back (rounded down)
+size_t resample_frames_out(const struct resample_bank* bank, size_t frames);
+size_t resample_frames_in(const struct resample_bank* bank, size_t frames);
+
+// starts a stream, its first output frame is its first input frame
+void resample_reset(struct resampler* rs, const struct resample_bank* bank, size_t channels);
+
+// input frames still needed to produce frames more output frames,
+// bounded by the room left, 0 once finished
+size_t resample_wants(const struct resampler* rs, size_t frames);
+
+// frames (at most what resample_wants() asked for) interleaved S32
+void resample_push(struct resampler* rs, const int32_t* in, size_t frames);
+
+// no more input: the filter's tail is flushed with silence, so the
+// stream ends with exactly resample_frames_out(input) frames
+void resample_finish(struct resampler* rs);
+
+// up to frames interleaved S32 frames into out, as far as the input goes
+size_t resample_pull(struct resampler* rs, int32_t* out, size_t frames);
+
+#endif
@@ -0,0 +1,80 @@
+#include "ring_buffer.h"
+#include <stdlib.h>
+
+int ring_init(struct ring_buffer* rb, size_t frames, size_t max_channels) {
+	size_t size = 1;
+
+	while (size < frames) {
+		size <<= 1;
+	}
+
+	rb->data = malloc(size * max_channels * sizeof(int32_t));
+
+	if (!rb->data) {
+		return -1;
+	}
+
+	rb->size = size;
+	ring_reset(rb, max_channels);
+
+	return 0;
+}
+
+void ring_free(struct ring_buffer* rb) {
+	free(rb->data);
+	rb->data = NULL;
+	rb->size = 0;
+}
+
+void ring_reset(struct ring_buffer* rb, size_t channels) {
+	rb->channels = channels;
+	atomic_store(&rb->head, 0);
+	atomic_store(&rb->tail, 0);
+}
+
+size_t ring_readable(struct ring_buffer* rb) {
+	size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+
+	return head - tail;
+}
+
+size_t ring_writable(struct ring_buffer* rb) {
+	return rb->size - ring_readable(rb);
+}
+
+// contiguous free frames starting at the write position
+size_t ring_write_region(struct ring_buffer* rb, int32_t** region) {
+	size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+	size_t offset = head & (rb->size - 1);
+	size_t free_frames = rb->size - (head - tail);
+	size_t until_wrap = rb->size - offset;
+
+	*region = rb->data + offset * rb->channels;
+
+	return free_frames < until_wrap ? free_frames : until_wrap;
+}
+
+void ring_commit_write(struct ring_buffer* rb, size_t frames) {
+	size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+	atomic_store_explicit(&rb->head, head + frames, memory_order_release);
+}
+
+// contiguous queued frames starting at the read position
+size_t ring_read_region(struct ring_buffer* rb, const int32_t** region) {
+	size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+	size_t offset = tail & (rb->size - 1);
+	size_t queued = head - tail;
+	size_t until_wrap = rb->size - offset;
+
+	*region = rb->data + offset * rb->channels;
+
+	return queued < until_wrap ? queued : until_wrap;
+}
+
+void ring_commit_read(struct ring_buffer* rb, size_t frames) {
+	size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+	atomic_store_explicit(&rb->tail, tail + frames, memory_order_release);
+}
@@ -0,0 +1,42 @@
+/*
+single-producer/single-consumer ring of interleaved int32 frames
+
+the decode thread is the only writer and the output thread the only
+reader, so head and tail are plain atomics and nothing ever locks:
+- the producer asks for a contiguous writable region, fills it and
+commits it (ring_write_region/ring_commit_write)
+- the consumer asks for a contiguous readable region, hands it to the
+device and commits what was consumed (ring_read_region/ring_commit_read)
+*/
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct ring_buffer {
+	int32_t* data;
+	size_t size; // capacity in frames (power of two)
+	size_t channels; // samples per frame of the current track
+	atomic_size_t head; // frames written so far (producer side)
+	atomic_size_t tail; // frames read so far (consumer side)
+};
+
+int ring_init(struct ring_buffer* rb, size_t frames, size_t max_channels);
+void ring_free(struct ring_buffer* rb);
+
+// only valid while neither thread is using the ring
+void ring_reset(struct ring_buffer* rb, size_t channels);
+
+size_t ring_readable(struct ring_buffer* rb);
+size_t ring_writable(struct ring_buffer* rb);
+
+size_t ring_write_region(struct ring_buffer* rb, int32_t** region);
+void ring_commit_write(struct ring_buffer* rb, size_t frames);
+
+size_t ring_read_region(struct ring_buffer* rb, const int32_t** region);
+void ring_commit_read(struct ring_buffer* rb, size_t frames);
+
+#endif
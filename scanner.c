@@ -0,0 +1,376 @@
+#include "scanner.h"
+#include "fd_handle.h"
+#include "index.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+// a directory being walked, kept open while its entries are probed
+struct scan_dir {
+	int fd;
+	char* path;
+	atomic_int refs; // its directory job plus one per probe job
+};
+
+enum scan_job_type {
+	SCAN_DIR, // read dir
+	SCAN_PROBE // read the headers of name in dir
+};
+
+struct scan_job {
+	enum scan_job_type type;
+	struct scan_dir* dir;
+	char* name;
+};
+
+struct scanner {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct scan_job queue[SCAN_QUEUE_LEN];
+	size_t head;
+	size_t len;
+	size_t active; // jobs queued or running, the walk ends at 0
+	int recursive;
+	const struct library_index* index; // entries reused when unchanged
+	atomic_int* cancel;
+	atomic_size_t probed; // files that had to be opened
+};
+
+struct scan_worker {
+	struct scanner* sc;
+	struct playlist found; // merged once every worker is done
+	pthread_t thread;
+};
+
+int scan_is_wav(const char* name) {
+	const char* dot = strrchr(name, '.');
+
+	if (!dot) {
+		return 0;
+	}
+
+	return strcasecmp(dot, ".wav") == 0;
+}
+
+// opens name inside parent (or path itself for the root)
+static struct scan_dir* scan_dir_open(struct scan_dir* parent, const char* name) {
+	char path[PATH_MAX_LENGTH];
+	int len = parent ?
+		snprintf(path, sizeof(path), "%s/%s", parent->path, name) :
+		snprintf(path, sizeof(path), "%s", name);
+
+	if (len < 0 || (size_t) len >= sizeof(path)) {
+		return NULL;
+	}
+
+	struct scan_dir* dir = malloc(sizeof(*dir));
+
+	if (!dir) {
+		return NULL;
+	}
+
+	dir->fd = openat(parent ? parent->fd : AT_FDCWD, name,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir->path = strdup(path);
+	atomic_init(&dir->refs, 1);
+
+	if (dir->fd < 0 || !dir->path) {
+		if (dir->fd >= 0) {
+			close(dir->fd);
+		}
+
+		free(dir->path);
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+static void scan_dir_put(struct scan_dir* dir) {
+	if (atomic_fetch_sub(&dir->refs, 1) != 1) {
+		return;
+	}
+
+	close(dir->fd);
+	free(dir->path);
+	free(dir);
+}
+
+static void run_job(struct scan_worker* w, struct scan_job* job);
+
+// queues a job, or runs it right away when the queue is full
+static void submit(struct scan_worker* w, struct scan_job job) {
+	struct scanner* sc = w->sc;
+
+	pthread_mutex_lock(&sc->lock);
+
+	if (sc->len < SCAN_QUEUE_LEN) {
+		sc->queue[(sc->head + sc->len) % SCAN_QUEUE_LEN] = job;
+		sc->len++;
+		sc->active++;
+		pthread_cond_signal(&sc->work);
+		pthread_mutex_unlock(&sc->lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&sc->lock);
+	run_job(w, &job);
+}
+
+static void scan_directory(struct scan_worker* w, struct scan_dir* dir) {
+	// fdopendir() takes over the fd it is given, dir->fd stays ours
+	int fd = dup(dir->fd);
+	DIR* d = fd >= 0 ? fdopendir(fd) : NULL;
+
+	if (!d) {
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return;
+	}
+
+	struct dirent* ent;
+
+	while ((ent = readdir(d))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		int type = ent->d_type;
+
+		// not every filesystem fills d_type in, and links are followed
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat sb;
+
+			if (fstatat(dir->fd, ent->d_name, &sb, 0) != 0) {
+				continue;
+			}
+
+			type = S_ISDIR(sb.st_mode) ? DT_DIR :
+				S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR && w->sc->recursive) {
+			struct scan_dir* sub = scan_dir_open(dir, ent->d_name);
+
+			if (sub) {
+				submit(w, (struct scan_job) { SCAN_DIR, sub, NULL });
+			}
+		} else if (type == DT_REG && scan_is_wav(ent->d_name)) {
+			char* name = strdup(ent->d_name);
+
+			if (!name) {
+				continue;
+			}
+
+			atomic_fetch_add(&dir->refs, 1);
+			submit(w, (struct scan_job) { SCAN_PROBE, dir, name });
+		}
+	}
+
+	closedir(d);
+}
+
+// an indexed file whose mtime and size didn't change isn't opened
+static int scan_indexed
+(
+	struct scan_worker* w,
+	struct scan_dir* dir,
+	const char* name,
+	const char* path,
+	struct track* t
+)
+{
+	const struct library_index* index = w->sc->index;
+	const struct index_entry* e;
+	struct stat sb;
+
+	if (!index || !(e = index_find(index, path)) ||
+		fstatat(dir->fd, name, &sb, 0) != 0) {
+		return 0;
+	}
+
+	int64_t mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+
+	if (e->info.mtime != mtime || e->info.size != (uint64_t) sb.st_size) {
+		return 0;
+	}
+
+	t->duration = e->duration;
+	t->info = e->info;
+	t->loudness = e->loudness;
+	t->peak = e->peak;
+
+	return 1;
+}
+
+int scan_track(int dirfd, const char* dir, const char* name, struct track* t) {
+	char path[PATH_MAX_LENGTH];
+	int len = snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	if (len < 0 || (size_t) len >= sizeof(path) ||
+		read_wav_header_at(dirfd, dirfd == AT_FDCWD ? path : name, &t->info, NULL) < 0 ||
+		t->info.fmt.byte_rate == 0) {
+		return -1;
+	}
+
+	t->dir = dir;
+	t->name = name;
+	t->duration = (double) (t->info.data_len / t->info.fmt.byte_rate);
+	t->loudness = LOUDNESS_UNKNOWN;
+	t->peak = 0.0f;
+
+	return 0;
+}
+
+static void scan_probe(struct scan_worker* w, struct scan_dir* dir, char* name) {
+	char path[PATH_MAX_LENGTH];
+	struct track t;
+	int len = snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+
+	if (len >= 0 && (size_t) len < sizeof(path) &&
+		scan_indexed(w, dir, name, path, &t)) {
+		t.dir = dir->path;
+		t.name = name;
+	} else {
+		atomic_fetch_add(&w->sc->probed, 1);
+
+		if (scan_track(dir->fd, dir->path, name, &t) < 0) {
+			fprintf(stderr, "reading wav failed: %s\n", name);
+			free(name);
+			return;
+		}
+	}
+
+	playlist_push(&w->found, t);
+	free(name);
+}
+
+static void run_job(struct scan_worker* w, struct scan_job* job) {
+	// a cancelled walk only drains its queue
+	if (w->sc->cancel && atomic_load(w->sc->cancel)) {
+		free(job->name);
+	} else if (job->type == SCAN_DIR) {
+		scan_directory(w, job->dir);
+	} else {
+		scan_probe(w, job->dir, job->name);
+	}
+
+	scan_dir_put(job->dir);
+}
+
+static void* scan_worker_main(void* arg) {
+	struct scan_worker* w = arg;
+	struct scanner* sc = w->sc;
+
+	pthread_mutex_lock(&sc->lock);
+
+	for (;;) {
+		while (sc->len == 0 && sc->active > 0) {
+			pthread_cond_wait(&sc->work, &sc->lock);
+		}
+
+		if (sc->len == 0) {
+			break;
+		}
+
+		struct scan_job job = sc->queue[sc->head];
+		sc->head = (sc->head + 1) % SCAN_QUEUE_LEN;
+		sc->len--;
+
+		pthread_mutex_unlock(&sc->lock);
+		run_job(w, &job);
+		pthread_mutex_lock(&sc->lock);
+
+		// the last job done: wake everyone up to leave
+		if (--sc->active == 0) {
+			pthread_cond_broadcast(&sc->work);
+		}
+	}
+
+	pthread_mutex_unlock(&sc->lock);
+
+	return NULL;
+}
+
+int scan_library
+(
+	const char* path,
+	int recursive,
+	const struct library_index* index,
+	atomic_int* cancel,
+	struct playlist* pl
+)
+{
+	struct scan_dir* root = scan_dir_open(NULL, path);
+
+	if (!root) {
+		return -1;
+	}
+
+	struct scanner sc = {0};
+
+	pthread_mutex_init(&sc.lock, NULL);
+	pthread_cond_init(&sc.work, NULL);
+	sc.recursive = recursive;
+	sc.index = index && index->map ? index : NULL;
+	sc.cancel = cancel;
+	sc.queue[0] = (struct scan_job) { SCAN_DIR, root, NULL };
+	sc.len = 1;
+	sc.active = 1;
+
+	// probing mostly waits on the disk, so there are more workers than
+	// cores, and this thread is one of them
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = cpus > 0 ? (size_t) cpus * 2 : 2;
+
+	if (count > SCAN_MAX_WORKERS) {
+		count = SCAN_MAX_WORKERS;
+	}
+
+	struct scan_worker workers[SCAN_MAX_WORKERS];
+	size_t started = 1;
+
+	for (size_t i = 0; i < count; i++) {
+		workers[i].sc = &sc;
+		playlist_init(&workers[i].found);
+	}
+
+	for (size_t i = 1; i < count; i++) {
+		if (pthread_create(&workers[i].thread, NULL,
+			scan_worker_main, &workers[i]) != 0) {
+			break;
+		}
+
+		started++;
+	}
+
+	scan_worker_main(&workers[0]);
+
+	for (size_t i = 1; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	pthread_cond_destroy(&sc.work);
+	pthread_mutex_destroy(&sc.lock);
+
+	for (size_t i = 0; i < count; i++) {
+		struct playlist* found = &workers[i].found;
+
+		for (size_t j = 0; j < found->len; j++) {
+			playlist_push(pl, found->items[j]);
+		}
+
+		playlist_free(found);
+	}
+
+	playlist_sort(pl);
+
+	return atomic_load(&sc.probed);
+}
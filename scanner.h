@@ -0,0 +1,50 @@
+/*
+parallel library scanner
+
+the directory tree is walked by a pool of worker threads sharing a
+bounded job queue. there are two kinds of jobs:
+
+- reading a directory: entries are classified with d_type (fstatat()
+  only when the filesystem doesn't fill it in), subdirectories become
+  new directory jobs and .wav files become probe jobs
+- probing a .wav: its headers are read to get the duration
+
+every lookup is relative to the parent directory's fd (openat(),
+fstatat()), so the kernel never resolves the full path again. when the
+queue is full a job is run right away by the thread that found it,
+so workers never block each other
+
+the playlist is sorted by path at the end, so it doesn't depend on the
+order the workers finished in
+
+given a library index, files whose mtime and size match their entry
+are taken from it and never opened
+*/
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include "types.h"
+
+#define SCAN_QUEUE_LEN 1024 // pending jobs before they are run inline
+#define SCAN_MAX_WORKERS 16
+
+int scan_is_wav(const char* name);
+
+// probes name in dir (opened as dirfd, or AT_FDCWD) into t, whose dir
+// and name then point at the ones given
+int scan_track(int dirfd, const char* dir, const char* name, struct track* t);
+
+// appends every .wav under path to pl, sorted by path
+// returns how many files had to be opened (not found in index), or -1
+// when path can't be read. setting *cancel stops the walk early
+int scan_library
+(
+	const char* path,
+	int recursive,
+	const struct library_index* index,
+	atomic_int* cancel,
+	struct playlist* pl
+);
+
+#endif
@@ -0,0 +1,336 @@
+#include "screen.h"
+#include "fd_handle.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#define LINE_BYTES 4096 // of one screen_printf(), the rest is dropped
+#define CELL_BYTES 32 // worst case output of a cell: move, attributes, glyph
+#define ROW_BYTES 32 // and of a row: move, attributes, clear to its end
+
+static const struct screen_cell blank = { .glyph = " ", .len = 1, .attr = 0 };
+
+struct screen* screen_open(int fd) {
+	struct screen* sc = calloc(1, sizeof(*sc));
+
+	if (!sc) {
+		return NULL;
+	}
+
+	sc->frame[0] = calloc(SCREEN_ROWS * SCREEN_COLS, sizeof(struct screen_cell));
+	sc->frame[1] = calloc(SCREEN_ROWS * SCREEN_COLS, sizeof(struct screen_cell));
+	sc->out = malloc(SCREEN_ROWS * (SCREEN_COLS * CELL_BYTES + ROW_BYTES) + ROW_BYTES);
+
+	if (!sc->frame[0] || !sc->frame[1] || !sc->out) {
+		screen_close(sc);
+		return NULL;
+	}
+
+	sc->fd = fd;
+	sc->invalid = 1;
+
+	return sc;
+}
+
+void screen_close(struct screen* sc) {
+	if (!sc) {
+		return;
+	}
+
+	free(sc->frame[0]);
+	free(sc->frame[1]);
+	free(sc->out);
+	free(sc);
+}
+
+void screen_invalidate(struct screen* sc) {
+	sc->invalid = 1;
+}
+
+static struct screen_cell* row_cells(struct screen* sc, int frame, size_t row) {
+	return sc->frame[frame] + row * SCREEN_COLS;
+}
+
+void screen_begin(struct screen* sc) {
+	int next = !sc->shown;
+	struct winsize ws;
+	size_t width = SCREEN_COLS;
+	size_t height = SCREEN_ROWS;
+
+	// not a terminal (e.g. piped): as large as a frame can be
+	if (ioctl(sc->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row) {
+		width = ws.ws_col < SCREEN_COLS ? ws.ws_col : SCREEN_COLS;
+		height = ws.ws_row < SCREEN_ROWS ? ws.ws_row : SCREEN_ROWS;
+	}
+
+	// the terminal rewrapped what it showed
+	if (width != sc->width || height != sc->height) {
+		sc->width = width;
+		sc->height = height;
+		sc->invalid = 1;
+	}
+
+	for (size_t r = 0; r < sc->rows[next]; r++) {
+		struct screen_cell* cells = row_cells(sc, next, r);
+
+		for (size_t c = 0; c < SCREEN_COLS; c++) {
+			cells[c] = blank;
+		}
+	}
+
+	sc->rows[next] = 0;
+	sc->row = 0;
+	sc->col = 0;
+	sc->attr = 0;
+}
+
+// \033[...m: only the attributes a cell keeps
+static void apply_sgr(struct screen* sc, const char* params, size_t len) {
+	size_t i = 0;
+
+	do {
+		int n = 0;
+
+		while (i < len && params[i] >= '0' && params[i] <= '9') {
+			n = n * 10 + (params[i++] - '0');
+		}
+
+		if (n == 0) {
+			sc->attr = 0;
+		} else if (n == 1) {
+			sc->attr |= SCREEN_BOLD;
+		} else if (n == 2) {
+			sc->attr |= SCREEN_DIM;
+		} else if (n == 7) {
+			sc->attr |= SCREEN_REVERSE;
+		} else if (n == 22) {
+			sc->attr &= ~(SCREEN_BOLD | SCREEN_DIM);
+		} else if (n == 27) {
+			sc->attr &= ~SCREEN_REVERSE;
+		}
+	} while (i++ < len);
+}
+
+static void put_glyph(struct screen* sc, const char* glyph, size_t len) {
+	int next = !sc->shown;
+
+	if (sc->row < sc->height && sc->col < sc->width) {
+		struct screen_cell* cell = &row_cells(sc, next, sc->row)[sc->col];
+
+		memset(cell, 0, sizeof(*cell));
+		memcpy(cell->glyph, glyph, len);
+		cell->len = len;
+		cell->attr = sc->attr;
+
+		if (sc->row + 1 > sc->rows[next]) {
+			sc->rows[next] = sc->row + 1;
+		}
+	}
+
+	sc->col++;
+}
+
+// bytes of the utf-8 sequence starting with c, 0 if it can't start one
+static size_t utf8_len(unsigned char c) {
+	if (c < 0x80) {
+		return 1;
+	} else if ((c & 0xe0) == 0xc0) {
+		return 2;
+	} else if ((c & 0xf0) == 0xe0) {
+		return 3;
+	} else if ((c & 0xf8) == 0xf0) {
+		return 4;
+	}
+
+	return 0;
+}
+
+void screen_printf(struct screen* sc, const char* fmt, ...) {
+	char line[LINE_BYTES];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (n < 0) {
+		return;
+	}
+
+	size_t len = (size_t) n < sizeof(line) ? (size_t) n : sizeof(line) - 1;
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned char c = line[i];
+
+		if (c == '\033') {
+			// csi: parameters, then a final byte in 0x40..0x7e
+			if (i + 1 < len && line[i + 1] == '[') {
+				size_t start = i + 2;
+				size_t end = start;
+
+				while (end < len && (line[end] < 0x40 || line[end] > 0x7e)) {
+					end++;
+				}
+
+				if (end < len && line[end] == 'm') {
+					apply_sgr(sc, line + start, end - start);
+				}
+
+				i = end + 1;
+			} else {
+				i += 2;
+			}
+		} else if (c == '\n') {
+			sc->row++;
+			sc->col = 0;
+			i++;
+		} else if (c == '\r') {
+			sc->col = 0;
+			i++;
+		} else if (c == '\t') {
+			sc->col = (sc->col / 8 + 1) * 8;
+			i++;
+		} else if (c < 0x20 || c == 0x7f) {
+			i++;
+		} else {
+			size_t glyph = utf8_len(c);
+			size_t k = 1;
+
+			while (k < glyph && i + k < len && ((unsigned char) line[i + k] & 0xc0) == 0x80) {
+				k++;
+			}
+
+			if (glyph && k == glyph) {
+				put_glyph(sc, line + i, glyph);
+			} else {
+				put_glyph(sc, "?", 1);
+			}
+
+			i += k;
+		}
+	}
+}
+
+/* --- FLUSH --- */
+
+static void emit(struct screen* sc, const char* s, size_t len) {
+	memcpy(sc->out + sc->out_len, s, len);
+	sc->out_len += len;
+}
+
+static void emit_move(struct screen* sc, size_t row, size_t col) {
+	sc->out_len += sprintf(sc->out + sc->out_len, "\033[%zu;%zuH", row + 1, col + 1);
+}
+
+static void emit_attr(struct screen* sc, uint8_t attr) {
+	emit(sc, "\033[0", 3);
+
+	if (attr & SCREEN_BOLD) {
+		emit(sc, ";1", 2);
+	}
+
+	if (attr & SCREEN_DIM) {
+		emit(sc, ";2", 2);
+	}
+
+	if (attr & SCREEN_REVERSE) {
+		emit(sc, ";7", 2);
+	}
+
+	emit(sc, "m", 1);
+}
+
+// columns up to the last one that isn't blank
+static size_t row_len(const struct screen_cell* cells, size_t width) {
+	size_t len = width;
+
+	while (len > 0 && memcmp(&cells[len - 1], &blank, sizeof(blank)) == 0) {
+		len--;
+	}
+
+	return len;
+}
+
+int screen_flush(struct screen* sc) {
+	int next = !sc->shown;
+	size_t rows = sc->rows[next];
+	size_t prev_rows = sc->invalid ? 0 : sc->rows[sc->shown];
+	size_t cur_row = SIZE_MAX; // where the terminal's cursor is
+	size_t cur_col = SIZE_MAX;
+	uint8_t attr = 0;
+
+	sc->out_len = 0;
+
+	if (sc->invalid) {
+		emit(sc, "\033[0m\033[H\033[J", 10);
+		cur_row = 0;
+		cur_col = 0;
+	}
+
+	for (size_t r = 0; r < (rows > prev_rows ? rows : prev_rows); r++) {
+		const struct screen_cell* now = row_cells(sc, next, r);
+		const struct screen_cell* was = row_cells(sc, sc->shown, r);
+		size_t len = r < rows ? row_len(now, sc->width) : 0;
+		size_t was_len = r < prev_rows ? row_len(was, sc->width) : 0;
+
+		for (size_t c = 0; c < len; c++) {
+			if (c < was_len && memcmp(&now[c], &was[c], sizeof(now[c])) == 0) {
+				continue;
+			}
+
+			if (cur_row != r || cur_col != c) {
+				emit_move(sc, r, c);
+			}
+
+			if (now[c].attr != attr) {
+				emit_attr(sc, now[c].attr);
+				attr = now[c].attr;
+			}
+
+			emit(sc, now[c].glyph, now[c].len);
+			cur_row = r;
+			cur_col = c + 1;
+		}
+
+		// the row got shorter
+		if (was_len > len) {
+			if (cur_row != r || cur_col != len) {
+				emit_move(sc, r, len);
+			}
+
+			if (attr) {
+				emit_attr(sc, 0);
+				attr = 0;
+			}
+
+			emit(sc, "\033[K", 3);
+			cur_row = r;
+			cur_col = len;
+		}
+	}
+
+	// nothing changed, nothing is written
+	if (sc->out_len == 0) {
+		return 0;
+	}
+
+	if (attr) {
+		emit_attr(sc, 0);
+	}
+
+	// under the frame, where anything printed next goes
+	emit_move(sc, rows < sc->height ? rows : sc->height - 1, 0);
+
+	sc->shown = next;
+	sc->invalid = 0;
+
+	if (write_bytes_to_file(sc->fd, sc->out, sc->out_len) != (ssize_t) sc->out_len) {
+		sc->invalid = 1;
+		return -1;
+	}
+
+	return 0;
+}
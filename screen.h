@@ -0,0 +1,72 @@
+/*
+diffing terminal renderer for the player screen
+
+a frame is composed with screen_printf() into a grid of cells (one
+utf-8 glyph and its attributes each) instead of going straight to the
+terminal. screen_flush() compares it to the frame on the terminal and
+only moves the cursor to the cells that changed and rewrites those,
+all of it in a single write(); a frame identical to the last one
+writes nothing. the screen is never cleared, so it doesn't flicker,
+and a 1 s tick of the clock costs a few bytes instead of the whole
+screen
+
+the attributes of the SGR sequences (\033[...m) in the text are kept
+per cell (bold, dim, reverse), any other escape sequence is dropped.
+rows and columns past the terminal's size are dropped too (a long line
+would wrap and shift every row under it), a resize redraws everything
+*/
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include "types.h"
+
+#define SCREEN_ROWS 64 // rows kept of a frame
+#define SCREEN_COLS 256 // columns kept of a row
+
+#define SCREEN_BOLD 1
+#define SCREEN_DIM 2
+#define SCREEN_REVERSE 4
+
+struct screen_cell {
+	char glyph[4]; // utf-8, one column wide
+	uint8_t len;
+	uint8_t attr;
+};
+
+struct screen {
+	struct screen_cell* frame[2]; // SCREEN_ROWS * SCREEN_COLS each
+	size_t rows[2]; // rows holding something in each frame
+	int fd;
+	int shown; // the frame on the terminal, the other one is composed
+	int invalid; // the terminal holds something else, redraw it all
+	size_t width; // of the terminal, when the frame was begun
+	size_t height;
+	size_t row; // composing: next cell written
+	size_t col;
+	uint8_t attr;
+	char* out; // escape sequences and glyphs of a flush
+	size_t out_len;
+};
+
+// a screen drawn on the terminal fd, NULL if out of memory
+struct screen* screen_open(int fd);
+void screen_close(struct screen* sc);
+
+// the next frame redraws the whole terminal (something else was
+// printed over it)
+void screen_invalidate(struct screen* sc);
+
+// starts composing a frame, empty
+void screen_begin(struct screen* sc);
+
+// appends to the frame (escape sequences must be whole in one call)
+void screen_printf(struct screen* sc, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// the changes since the frame on the terminal, with one write() (nothing
+// if there are none), the cursor is left under the frame. returns -1 if
+// the write failed
+int screen_flush(struct screen* sc);
+
+#endif
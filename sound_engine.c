@@ -1,175 +1,1196 @@
 #include "types.h"
 #include "sound_engine.h"
+#include "fd_handle.h"
+#include "convert.h"
+#include "gain.h"
+#include "prefetch.h"
+#include "readahead.h"
+#include "resample.h"
+#include "output.h"
+#include "telemetry.h"
+#include "realtime.h"
 #include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
-static inline int32_t clamp_s32(int64_t v) {
-	if (v > INT32_MAX) {
-		return INT32_MAX;
+// converts frames frames of src (in the format described by fmt) to S32
+int convert_wav_to_32
+(
+	const struct fmt_sub_chunk* fmt,
+	const uint8_t* src,
+	int32_t* dst,
+	size_t frames
+)
+{
+	size_t total_samples = frames * fmt->num_channels;
+
+	for (size_t i = 0; i < total_samples; i++) {
+		int32_t sample = 0;
+
+		if (fmt->bits_per_sample == 8) {
+			uint8_t v = *src++;
+			sample = ((int32_t)v - 128) << 24;
+		} else if (fmt->bits_per_sample == 16) {
+			int16_t v = (int16_t)(src[0] | (src[1] << 8));
+			src += 2;
+			sample = ((int32_t) v) << 16;
+		} else if (fmt->bits_per_sample == 24) {
+			int32_t v = (src[0]) | (src[1] << 8) | (src[2] << 16);
+
+			if (v & 0x00800000) {
+				v |= 0xFF000000;
+			}
+
+			src += 3;
+			sample = v << 8;
+		} else {
+			return -1;
+		}
+
+		*dst++ = sample;
+	}
+
+	return 0;
+}
+
+// eventfds: a write wakes whoever sleeps in poll() on them
+static void notify(int fd) {
+	uint64_t one = 1;
+	ssize_t n = write(fd, &one, sizeof(one));
+	(void) n;
+}
+
+static void drain_events(int fd) {
+	uint64_t count;
+	ssize_t n = read(fd, &count, sizeof(count));
+	(void) n;
+}
+
+// timeout in ms, -1: until woken
+static void wait_event(int fd, int timeout) {
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN
+	};
+
+	if (poll(&pfd, 1, timeout) > 0) {
+		drain_events(fd);
 	}
+}
 
-	if (v < INT32_MIN) {
-		return INT32_MIN;
+// the output thread waits for the decoder, and the decoder for room in
+// the ring, only after raising their flag, so a wake is never lost
+static void wake_output(struct player_state* st) {
+	if (atomic_exchange(&st->output_waiting, 0)) {
+		notify(st->wake_fd);
 	}
+}
 
-	return (int32_t) v;
+// a real-time output thread only wakes it once the ring ran dry, not
+// every tick (one more syscall): the decoder looks at the ring on its
+// own (see realtime.h)
+static void wake_decoder(struct player_state* st, int starved) {
+	if ((starved || !st->rt_priority) && ring_writable(&st->ring) >= FRAMES_PER_TICK &&
+		atomic_exchange(&st->decode_waiting, 0)) {
+		notify(st->space_fd);
+	}
 }
 
-int play_wav
+// tells the main loop that the last frame reached the device
+static void finish_track(struct player_state* st) {
+	atomic_store(&st->track_done, 1);
+	notify(st->event_fd);
+}
+
+// counted, then the device is prepared again (see telemetry.h)
+static void recover(struct player_state* st, int err) {
+	telemetry_recover(&st->out, err);
+}
+
+// the frames the device can take right now, 0 after recovering from
+// an error
+static snd_pcm_sframes_t device_avail(struct player_state* st) {
+	snd_pcm_sframes_t avail = output_avail(&st->out);
+
+	if (avail < 0) {
+		recover(st, avail);
+		return 0;
+	}
+
+	if (avail == 0) {
+		int err = output_wait(&st->out, st->wake_fd);
+
+		if (err < 0) {
+			recover(st, err);
+		}
+	}
+
+	atomic_store_explicit(&st->out.telemetry.avail, avail, memory_order_relaxed);
+
+	return avail;
+}
+
+// every time frames are copied on their way to the device (by us or by
+// snd_pcm_writei), so rw and mmap access can be compared
+static void count_copy(struct player_state* st, size_t bytes) {
+	atomic_fetch_add_explicit(&st->copies, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->copied_bytes, bytes, memory_order_relaxed);
+}
+
+// a track as a decoding thread reads it: its frames at the device rate
+struct source {
+	struct track_source track;
+	size_t cursor; // next frame of track
+	size_t left; // frames still to produce, at the device rate
+	struct resampler rs; // used when track.resample is set
+};
+
+// the track a decoding thread is reading, it moves on to st->next by
+// itself at the end of the track (gapless) or during a crossfade
+struct decoder {
+	struct source sources[2];
+	struct source* cur; // track being decoded
+	struct source* in; // next track fading in
+	unsigned int rate; // of every frame produced
+	size_t fade_len; // frames of the running crossfade (0: none)
+	size_t fade_pos;
+	size_t produced; // frames produced since playback_start()
+	int passthrough; // the device takes cur's bytes as they are
+	struct gain_stage gain;
+	int32_t mix[FRAMES_PER_TICK * MAX_CHANNELS]; // incoming track
+	int32_t scratch[FRAMES_PER_TICK * MAX_CHANNELS]; // on its way to a resampler
+};
+
+// st->cursor counts frames at the device rate, the track's own frames
+// only differ from them while it is resampled
+static size_t to_track_frames(const struct player_state* st, size_t frames) {
+	return st->resample ? resample_frames_in(st->resample, frames) : frames;
+}
+
+static size_t to_device_frames(const struct player_state* st, size_t frames) {
+	return st->resample ? resample_frames_out(st->resample, frames) : frames;
+}
+
+static void source_start(struct source* s, const struct track_source* t, size_t cursor) {
+	s->track = *t;
+	s->cursor = cursor < t->frames ? cursor : t->frames;
+	s->left = t->frames - s->cursor;
+
+	if (t->resample) {
+		resample_reset(&s->rs, t->resample, t->fmt.num_channels);
+		s->left = resample_frames_out(t->resample, s->left);
+	}
+}
+
+// the loudness gain s is played at (see loudness.h), 1 when off
+static float source_level(struct player_state* st, const struct source* s) {
+	return atomic_load(&st->normalize) ? s->track.norm : 1.0f;
+}
+
+// what the gain stage applies: the volume, and the current track's
+// loudness gain except during a crossfade, which applies both tracks'
+// itself. when one changes into the other the stage jumps instead of
+// ramping, the frames around the change already are at the same level
+static float decoder_gain(struct player_state* st, const struct decoder* dec) {
+	if (dec->fade_len) {
+		return st->player_gain;
+	}
+
+	return st->player_gain * source_level(st, dec->cur);
+}
+
+static void decoder_init(struct player_state* st, struct decoder* dec) {
+	struct track_source cur = {
+		.index = st->current_track,
+		.stream = st->stream,
+		.fmt = st->fmt,
+		.convert = st->convert,
+		.frames = st->pcm_frames,
+		.resample = st->resample,
+		.norm = st->norm
+	};
+
+	dec->cur = &dec->sources[0];
+	dec->in = &dec->sources[1];
+	dec->in->track.stream.map = NULL; // nothing fading in yet
+	source_start(dec->cur, &cur, to_track_frames(st, st->cursor));
+	dec->rate = track_source_rate(&cur);
+	dec->fade_len = 0;
+	dec->produced = 0;
+	dec->passthrough = st->output_path == PATH_PASSTHROUGH;
+
+	gain_init(&dec->gain, decoder_gain(st, dec), dec->rate);
+}
+
+// the decoder reads its own copies of the streams: what it released
+// of them is handed back when it stops, so the next seek only releases
+// from there (not from the start of the data) and costs the same
+// wherever it lands
+static void decoder_release_back(struct player_state* st, const struct decoder* dec) {
+	for (size_t i = 0; i < 2; i++) {
+		const struct wav_stream* ws = &dec->sources[i].track.stream;
+
+		if (!ws->map) {
+			continue;
+		}
+
+		if (ws->id == st->stream.id) {
+			st->stream.released = ws->released;
+		} else if (atomic_load(&st->next_state) == NEXT_TAKEN &&
+			ws->id == st->next.stream.id) {
+			st->next.stream.released = ws->released;
+		}
+	}
+}
+
+// takes the prefetched track if it can follow the current one, waiting
+// for the main thread and the prefetch thread when block is set
+static int take_next(struct player_state* st, struct decoder* dec,
+	struct source* out, int block)
+{
+	while (!atomic_load(&st->stop_threads)) {
+		int state = atomic_load(&st->next_state);
+
+		if (state == NEXT_READY) {
+			// claim it before looking at it, so the main thread can't
+			// release or replace it under us meanwhile
+			if (!atomic_compare_exchange_strong(&st->next_state,
+				&state, NEXT_CHECKING)) {
+				continue;
+			}
+
+			// its bytes can't go to the device as they are
+			int raw_norm = dec->passthrough && atomic_load(&st->normalize) &&
+				st->next.norm != 1.0f;
+
+			if (raw_norm || !track_source_compatible(&dec->cur->track,
+				&st->next, dec->passthrough)) {
+				atomic_store(&st->next_state, NEXT_READY);
+				return 0;
+			}
+
+			atomic_store(&st->next_state, NEXT_TAKEN);
+			source_start(out, &st->next, 0);
+			return 1;
+		}
+
+		if (state == NEXT_END || state == NEXT_FAILED || !block) {
+			return 0;
+		}
+
+		// pending, loading, or the last one wasn't adopted yet
+		wait_event(st->prefetch_fd, -1);
+	}
+
+	return 0;
+}
+
+// the next track's first frame is produced frame produced
+static void mark_boundary(struct player_state* st, size_t produced) {
+	atomic_store(&st->boundary, produced);
+	atomic_store(&st->boundary_pending, 1);
+}
+
+// counts frames that reached the device, and moves the ui to the next
+// track once the boundary marked by the decoder was crossed
+static void advance_written(struct player_state* st, size_t* written,
+	size_t frames)
+{
+	*written += frames;
+	atomic_fetch_add(&st->cursor, frames);
+
+	if (atomic_load(&st->boundary_pending) &&
+		*written >= atomic_load(&st->boundary)) {
+		atomic_store(&st->cursor, *written - atomic_load(&st->boundary));
+		atomic_store(&st->boundary_pending, 0);
+		atomic_store(&st->track_changed, 1);
+		notify(st->event_fd);
+	}
+}
+
+// up to frames frames of s at the device rate into out, converted and
+// resampled if needed. the read-ahead (ra, if any) follows s
+static size_t source_read
 (
-	const uint8_t* data_buf,
-	size_t buf_len,
-	const struct fmt_sub_chunk* fmt
+	struct decoder* dec,
+	struct source* s,
+	struct readahead* ra,
+	int32_t* out,
+	size_t frames
+)
+{
+	struct track_source* t = &s->track;
+	size_t channels = t->fmt.num_channels;
+	size_t done = 0;
+
+	if (frames > s->left) {
+		frames = s->left;
+	}
+
+	while (done < frames) {
+		size_t n = frames - done;
+		int32_t* dst = out + done * channels;
+
+		if (t->resample) {
+			size_t got = resample_pull(&s->rs, dst, n);
+
+			done += got;
+
+			if (got == n) {
+				break;
+			}
+
+			// the window of the next frame isn't buffered yet
+			n = resample_wants(&s->rs, n - got);
+			dst = dec->scratch;
+
+			if (!n) {
+				break;
+			}
+
+			if (n > FRAMES_PER_TICK) {
+				n = FRAMES_PER_TICK;
+			}
+		}
+
+		const uint8_t* src;
+
+		n = wav_stream_frames(&t->stream, s->cursor, n, &src);
+
+		if (t->resample && !n) {
+			resample_finish(&s->rs);
+			continue;
+		}
+
+		if (!n) {
+			break;
+		}
+
+		t->convert->fn(src, dst, n * channels);
+		s->cursor += n;
+		wav_stream_release(&t->stream, s->cursor);
+
+		if (ra) {
+			readahead_advance(ra, &t->stream, s->cursor);
+		}
+
+		if (t->resample) {
+			resample_push(&s->rs, dst, n);
+		} else {
+			done += n;
+		}
+	}
+
+	// short only if the file ended early, which ends the track here
+	s->left = done < frames ? 0 : s->left - done;
+
+	return done;
+}
+
+// mixes frames frames of the incoming track into dst (linear fade),
+// each track at its own loudness gain
+static void crossfade
+(
+	struct player_state* st,
+	struct decoder* dec,
+	int32_t* dst,
+	size_t frames
+)
+{
+	size_t channels = dec->cur->track.fmt.num_channels;
+	size_t got = source_read(dec, dec->in, NULL, dec->mix, frames);
+	float out_level = source_level(st, dec->cur);
+	float in_level = source_level(st, dec->in);
+
+	for (size_t f = 0; f < frames; f++) {
+		float t = (float) (dec->fade_pos + f) / (float) dec->fade_len;
+
+		for (size_t c = 0; c < channels; c++) {
+			float in = f < got ? (float) dec->mix[f * channels + c] : 0.0f;
+			float out = (float) dst[f * channels + c];
+			float v = out * out_level * (1.0f - t) + in * in_level * t;
+
+			// a track that wasn't measured may be louder than full scale
+			dst[f * channels + c] = v >= 2147483647.0f ? INT32_MAX :
+				v <= -2147483648.0f ? INT32_MIN : (int32_t) v;
+		}
+	}
+
+	dec->fade_pos += frames;
+}
+
+// renders up to frames frames into dst and applies gain, moving on to
+// the prefetched track when the current one ends (or starts fading out)
+// returns how many frames were rendered, 0 at the end of playback
+static size_t render_frames
+(
+	struct player_state* st,
+	struct decoder* dec,
+	int32_t* dst,
+	size_t frames
 )
 {
-	snd_pcm_t* handle;
-	int err;
+	size_t channels = dec->cur->track.fmt.num_channels;
+	size_t fade = (size_t) atomic_load(&st->crossfade_ms) * dec->rate / 1000;
+	size_t done = 0;
+
+	while (done < frames) {
+		size_t left = dec->cur->left;
+
+		if (!dec->fade_len && fade && left && left <= fade &&
+			take_next(st, dec, dec->in, 0)) {
+			dec->fade_len = left;
+			dec->fade_pos = 0;
+			mark_boundary(st, dec->produced + done);
+			gain_init(&dec->gain, decoder_gain(st, dec), dec->rate);
+		}
+
+		if (!left) {
+			if (dec->fade_len) {
+				// the faded in track is now the current one
+				struct source* faded = dec->cur;
+
+				dec->cur = dec->in;
+				dec->in = faded;
+				dec->fade_len = 0;
+				gain_init(&dec->gain, decoder_gain(st, dec), dec->rate);
+				continue;
+			}
+
+			if (!take_next(st, dec, dec->cur, 1)) {
+				break;
+			}
+
+			mark_boundary(st, dec->produced + done);
+			gain_init(&dec->gain, decoder_gain(st, dec), dec->rate);
+			continue;
+		}
+
+		size_t n = frames - done;
+
+		if (dec->fade_len && n > FRAMES_PER_TICK) {
+			n = FRAMES_PER_TICK;
+		}
+
+		int32_t* out = dst + done * channels;
+
+		n = source_read(dec, dec->cur, &st->readahead, out, n);
+
+		if (dec->fade_len) {
+			crossfade(st, dec, out, n);
+		}
+
+		// volume changes are picked up here and ramped in, per track
+		// since the next one may start within frames
+		gain_set(&dec->gain, decoder_gain(st, dec));
+		gain_apply(&dec->gain, out, n, channels);
+		done += n;
+	}
+
+	dec->produced += done;
+
+	return done;
+}
+
+// passthrough: up to frames frames of the current track's bytes, moving
+// on to the prefetched track at the end, consumed by passthrough_consume()
+static size_t passthrough_peek
+(
+	struct player_state* st,
+	struct decoder* dec,
+	size_t frames,
+	const uint8_t** src
+)
+{
+	for (;;) {
+		size_t n = wav_stream_frames(&dec->cur->track.stream,
+			dec->cur->cursor, frames, src);
+
+		if (n || !take_next(st, dec, dec->cur, 1)) {
+			return n;
+		}
+
+		mark_boundary(st, dec->produced);
+	}
+}
+
+static void passthrough_consume
+(
+	struct player_state* st,
+	struct decoder* dec,
+	size_t frames
+)
+{
+	struct source* s = dec->cur;
+
+	s->cursor += frames;
+	s->left -= frames;
+	dec->produced += frames;
+	wav_stream_release(&s->track.stream, s->cursor);
+	readahead_advance(&st->readahead, &s->track.stream, s->cursor);
+}
+
+// producer: converts the mapped data chunk and applies gain into the ring
+static void* decode_thread_main(void* arg) {
+	struct player_state* st = arg;
+	struct decoder dec;
+
+	decoder_init(st, &dec);
+
+	// with a real-time output thread the ring is looked at a few times
+	// per length of it instead of waiting to be woken
+	int timeout = st->rt_priority && dec.rate ?
+		(int) (st->ring.size * 1000 / REALTIME_DECODE_POLL / dec.rate) : -1;
+
+	while (!atomic_load(&st->stop_threads)) {
+		int32_t* region;
+		size_t room = ring_write_region(&st->ring, &region);
+
+		// sleeps until the output thread frees at least a tick worth
+		if (ring_writable(&st->ring) < FRAMES_PER_TICK) {
+			atomic_store(&st->decode_waiting, 1);
+
+			if (ring_writable(&st->ring) < FRAMES_PER_TICK &&
+				!atomic_load(&st->stop_threads)) {
+				wait_event(st->space_fd, timeout);
+			}
+
+			atomic_store(&st->decode_waiting, 0);
+			continue;
+		}
+
+		if (room > FRAMES_PER_TICK) {
+			room = FRAMES_PER_TICK;
+		}
+
+		size_t frames = render_frames(st, &dec, region, room);
+
+		if (!frames) {
+			break;
+		}
+
+		ring_commit_write(&st->ring, frames);
+		wake_output(st);
+	}
+
+	decoder_release_back(st, &dec);
+	atomic_store(&st->decode_done, 1);
+	wake_output(st);
+
+	return NULL;
+}
 
-	if ((err == snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+// consumer: only moves frames from the ring to the device, so nothing
+// done by the ui or the input handling can delay snd_pcm_writei()
+// every wakeup fills whatever the device reports as available
+static void* output_thread_main(void* arg) {
+	struct player_state* st = arg;
+	size_t written_total = 0;
+	int starved = 0;
+	int started = 0;
+
+	while (!atomic_load(&st->stop_threads)) {
+		if (st->play_state != PLAYING) {
+			wait_event(st->wake_fd, -1);
+			continue;
+		}
+
+		if (!ring_readable(&st->ring)) {
+			if (atomic_load(&st->decode_done) &&
+				ring_readable(&st->ring) == 0) {
+				finish_track(st);
+				break;
+			}
+
+			if (started && !starved) {
+				atomic_fetch_add(&st->underruns, 1);
+			}
+
+			starved = 1;
+			wake_decoder(st, 1);
+			atomic_store(&st->output_waiting, 1);
+
+			if (!ring_readable(&st->ring) && !atomic_load(&st->decode_done)) {
+				wait_event(st->wake_fd, -1);
+			}
+
+			atomic_store(&st->output_waiting, 0);
+			continue;
+		}
+
+		starved = 0;
+		snd_pcm_sframes_t avail = device_avail(st);
+		uint64_t tick_start = telemetry_now();
+		int wrote = 0;
+
+		while (avail > 0) {
+			const int32_t* region;
+			size_t frames = ring_read_region(&st->ring, &region);
+
+			if (!frames) {
+				break;
+			}
+
+			if (frames > (size_t) avail) {
+				frames = avail;
+			}
+
+			uint64_t start = telemetry_now();
+			snd_pcm_sframes_t written = output_write(&st->out, region, frames);
+
+			if (written == -EAGAIN) {
+				break;
+			}
+
+			if (written < 0) {
+				recover(st, written);
+				break;
+			}
+
+			histogram_add(&st->out.telemetry.write, telemetry_now() - start);
+
+			if ((size_t) written < frames) {
+				atomic_fetch_add(&st->out.telemetry.short_writes, 1);
+			}
+
+			started = 1;
+			wrote = 1;
+			ring_commit_read(&st->ring, written);
+			advance_written(st, &written_total, written);
+			count_copy(st, written * st->ring.channels * sizeof(int32_t));
+			wake_decoder(st, 0);
+
+			avail -= written;
+		}
+
+		if (wrote) {
+			histogram_add(&st->out.telemetry.tick, telemetry_now() - tick_start);
+		}
+	}
+
+	return NULL;
+}
+
+// passthrough: the file's own bytes go from the mapping straight to
+// snd_pcm_writei(), no decode thread, no ring, no intermediate copy
+static void* passthrough_thread_main(void* arg) {
+	struct player_state* st = arg;
+	size_t written_total = 0;
+	struct decoder dec;
+
+	decoder_init(st, &dec);
+
+	while (!atomic_load(&st->stop_threads)) {
+		if (st->play_state != PLAYING) {
+			wait_event(st->wake_fd, -1);
+			continue;
+		}
+
+		snd_pcm_sframes_t avail = device_avail(st);
+
+		if (!avail) {
+			continue;
+		}
+
+		uint64_t tick_start = telemetry_now();
+		const uint8_t* src;
+		size_t frames = passthrough_peek(st, &dec, avail, &src);
+
+		if (!frames) {
+			finish_track(st);
+			break;
+		}
+
+		uint64_t start = telemetry_now();
+		snd_pcm_sframes_t written = output_write(&st->out, src, frames);
+
+		if (written == -EAGAIN) {
+			continue;
+		}
+
+		if (written < 0) {
+			recover(st, written);
+			continue;
+		}
+
+		uint64_t end = telemetry_now();
+
+		if ((size_t) written < frames) {
+			atomic_fetch_add(&st->out.telemetry.short_writes, 1);
+		}
+
+		passthrough_consume(st, &dec, written);
+		advance_written(st, &written_total, written);
+		count_copy(st, written * dec.cur->track.stream.frame_size);
+		histogram_add(&st->out.telemetry.write, end - start);
+		histogram_add(&st->out.telemetry.tick, end - tick_start);
+	}
+
+	decoder_release_back(st, &dec);
+
+	return NULL;
+}
+
+// mmap access: frames are produced directly inside the device's buffer
+// between snd_pcm_mmap_begin() and snd_pcm_mmap_commit(). on the
+// conversion path the kernel and the gain write straight into it (no
+// copy at all), on passthrough the mapped file is copied there once
+static void* mmap_thread_main(void* arg) {
+	struct player_state* st = arg;
+	size_t written_total = 0;
+	struct decoder dec;
+
+	decoder_init(st, &dec);
+
+	while (!atomic_load(&st->stop_threads)) {
+		if (st->play_state != PLAYING) {
+			wait_event(st->wake_fd, -1);
+			continue;
+		}
+
+		snd_pcm_sframes_t avail = device_avail(st);
+
+		if (!avail) {
+			continue;
+		}
+
+		uint64_t tick_start = telemetry_now();
+		const snd_pcm_channel_area_t* areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = avail;
+		int err = snd_pcm_mmap_begin(st->out.pcm, &areas, &offset, &frames);
+
+		if (err < 0) {
+			recover(st, err);
+			continue;
+		}
+
+		// interleaved: every channel lives in areas[0]
+		uint8_t* dst = (uint8_t*) areas[0].addr + areas[0].first / 8 +
+			offset * (areas[0].step / 8);
+		size_t done;
+
+		if (dec.passthrough) {
+			const uint8_t* src;
+			size_t frame_size = dec.cur->track.stream.frame_size;
+
+			done = passthrough_peek(st, &dec, frames, &src);
+			memcpy(dst, src, done * frame_size);
+			passthrough_consume(st, &dec, done);
+			count_copy(st, done * frame_size);
+		} else {
+			done = render_frames(st, &dec, (int32_t*) dst, frames);
+		}
+
+		if (!done) {
+			snd_pcm_mmap_commit(st->out.pcm, offset, 0);
+			finish_track(st);
+			break;
+		}
+
+		uint64_t start = telemetry_now();
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(st->out.pcm, offset, done);
+
+		if (committed < 0) {
+			recover(st, committed);
+			continue;
+		}
+
+		uint64_t end = telemetry_now();
+
+		// the frames past committed were produced for nothing, the
+		// device plays on from what it took
+		if ((size_t) committed < done) {
+			atomic_fetch_add(&st->out.telemetry.short_writes, 1);
+		}
+
+		if (snd_pcm_state(st->out.pcm) == SND_PCM_STATE_PREPARED) {
+			snd_pcm_start(st->out.pcm);
+		}
+
+		advance_written(st, &written_total, committed);
+		histogram_add(&st->out.telemetry.write, end - start);
+		histogram_add(&st->out.telemetry.tick, end - tick_start);
+	}
+
+	decoder_release_back(st, &dec);
+
+	return NULL;
+}
+
+// wakes the output thread, e.g. after a pause is toggled
+void playback_wake(struct player_state* st) {
+	notify(st->wake_fd);
+}
+
+int audio_events_init(struct player_state* st) {
+	st->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	st->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	st->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	st->prefetch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (st->wake_fd < 0 || st->space_fd < 0 || st->event_fd < 0 ||
+		st->prefetch_fd < 0) {
+		perror("eventfd");
+		audio_events_free(st);
+		return -1;
+	}
+
+	return 0;
+}
+
+void audio_events_free(struct player_state* st) {
+	int* fds[] = {
+		&st->wake_fd, &st->space_fd, &st->event_fd, &st->prefetch_fd
+	};
+
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0) {
+			close(*fds[i]);
+		}
+
+		*fds[i] = -1;
+	}
+}
+
+// starts decoding and playing the current track from st->cursor
+int playback_start(struct player_state* st) {
+	if (st->threads_running) {
+		return 0;
+	}
+
+	ring_reset(&st->ring, st->fmt.num_channels);
+	atomic_store(&st->stop_threads, 0);
+	atomic_store(&st->decode_done, 0);
+	atomic_store(&st->track_done, 0);
+	atomic_store(&st->output_waiting, 0);
+	atomic_store(&st->decode_waiting, 0);
+	atomic_store(&st->boundary_pending, 0);
+
+	// mmap access and passthrough need a single thread, only rw access
+	// on the conversion path goes through the decode thread and the ring
+	void* (*output_main)(void*) = output_thread_main;
+
+	if (st->out.access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+		output_main = mmap_thread_main;
+	} else if (st->output_path == PATH_PASSTHROUGH) {
+		output_main = passthrough_thread_main;
+	}
+
+	st->decoding = output_main == output_thread_main;
+
+	if (st->decoding && pthread_create(&st->decode_thread, NULL,
+		decode_thread_main, st) != 0) {
 		return -1;
 	}
 
-	snd_pcm_set_params(handle,
-		SND_PCM_FORMAT_S32_LE,
-		SND_PCM_ACCESS_RW_INTERLEAVED,
-		fmt->num_channels,
-		fmt->sample_rate,
-		1, // allows resampling software
-		500000 // latency (ms)
-	);
+	int started = 0;
 
-	snd_pcm_writei(handle,
-		data_buf, buf_len / (fmt->num_channels * fmt->bits_per_sample / 8));
+	if (st->rt_priority) {
+		int fifo = realtime_start(&st->output_thread, &st->output_stack,
+			st->rt_priority, output_main, st);
 
-	snd_pcm_drain(handle);
-	snd_pcm_close(handle);
+		st->output_fifo = fifo > 0;
+		started = fifo >= 0;
+	} else {
+		started = pthread_create(&st->output_thread, NULL, output_main, st) == 0;
+	}
 
+	if (!started) {
+		if (st->decoding) {
+			atomic_store(&st->stop_threads, 1);
+			notify(st->space_fd);
+			pthread_join(st->decode_thread, NULL);
+		}
+
+		return -1;
+	}
+
+	st->threads_running = 1;
 	return 0;
 }
 
-void apply_volume(struct player_state** st)
-{
-	if ((*st)->player_gain == 1.0) {
+// frames still in the ring are discarded
+void playback_stop(struct player_state* st) {
+	if (!st->threads_running) {
 		return;
 	}
 
-	size_t total_samples = (*st)->pcm_frames * (*st)->fmt.num_channels;
+	atomic_store(&st->stop_threads, 1);
+	notify(st->wake_fd);
+	notify(st->space_fd);
+	notify(st->prefetch_fd);
 
-	for (size_t i = 0; i < total_samples; i++) {
-		int64_t v = (int64_t)((*st)->pcm_buf[i] * (*st)->player_gain);
-		(*st)->pcm_buf[i] = clamp_s32(v);
+	if (st->decoding) {
+		pthread_join(st->decode_thread, NULL);
+	}
+
+	if (st->output_stack) {
+		realtime_join(st->output_thread, st->output_stack);
+		st->output_stack = NULL;
+	} else {
+		pthread_join(st->output_thread, NULL);
+	}
+
+	st->threads_running = 0;
+
+	// the next track was taken but none of it was heard yet, it stays
+	// prefetched and playback resumes in the current one
+	int taken = NEXT_TAKEN;
+
+	if (atomic_load(&st->boundary_pending)) {
+		atomic_compare_exchange_strong(&st->next_state, &taken, NEXT_READY);
+		atomic_store(&st->boundary_pending, 0);
 	}
+
+	drain_events(st->wake_fd);
+	drain_events(st->space_fd);
+	drain_events(st->prefetch_fd);
 }
 
-int convert_wav_to_32(struct player_state** st, const uint8_t* data_buf) {
-	size_t bytes_per_sample = (*st)->fmt.bits_per_sample / 8;
-	size_t bytes_per_frame = bytes_per_sample * (*st)->fmt.num_channels;
-	size_t total_frames = (*st)->buf_len / bytes_per_frame;
+// st->cursor counts what was written, the device still holds delay
+// frames of it
+static size_t device_position(struct player_state* st) {
+	snd_pcm_sframes_t delay = 0;
+	size_t cursor = atomic_load(&st->cursor);
+
+	if (output_delay(&st->out, &delay) == 0 &&
+		delay > 0 && (size_t) delay <= cursor) {
+		cursor -= delay;
+	}
+
+	return cursor;
+}
 
-	int32_t* pcm_buf = malloc(
-		total_frames * (*st)->fmt.num_channels * sizeof(int32_t)
-	);
+// the frame of the current track being heard right now
+size_t playback_position(struct player_state* st) {
+	return to_track_frames(st, device_position(st));
+}
 
-	if (!pcm_buf) {
+// restarts the current track at frame. its byte offset follows from
+// the frame alone (the stream is mapped and frames have a fixed size),
+// so nothing before it is read or decoded. the frames the device still
+// had queued are dropped, the new position is heard within a period
+int audio_seek(struct player_state* st, size_t frame) {
+	if (!st->out.open) {
 		return -1;
 	}
 
-	const uint8_t* src = data_buf;
-	int32_t* dst = pcm_buf;
+	playback_stop(st);
 
-	for (size_t i = 0; i < total_frames * (*st)->fmt.num_channels; i++) {
-		int32_t sample = 0;
+	if (frame > st->pcm_frames) {
+		frame = st->pcm_frames;
+	}
 
-		if ((*st)->fmt.bits_per_sample == 8) {
-			uint8_t v = *src++;
-			sample = ((int32_t)v - 128) << 24;
-		} else if ((*st)->fmt.bits_per_sample == 16) {
-			int16_t v = (int16_t)(src[0] | (src[1] << 8));
-			src += 2;
-			sample = ((int32_t) v) << 16;
-		} else if ((*st)->fmt.bits_per_sample == 24) {
-			int32_t v = (src[0]) | (src[1] << 8) | (src[2] << 16);
+	size_t from = playback_position(st);
 
-			if (v & 0x00800000) {
-				v |= 0xFF000000;
-			}
+	output_drop(&st->out);
 
-			src += 3;
-			sample = v << 8;
-		} else {			
-			free(pcm_buf);
+	wav_stream_seek(&st->stream, from, frame);
+	atomic_store(&st->cursor, to_device_frames(st, frame));
+
+	return playback_start(st);
+}
+
+// the device holds what it has while paused when it can. otherwise it
+// is dropped, and playback starts again from what was heard. either way
+// it doesn't run dry, which would be counted as an xrun
+void audio_pause(struct player_state* st, int pause) {
+	if (pause) {
+		st->play_state = PAUSED;
+
+		if (output_pause(&st->out, 1) < 0 && st->threads_running) {
+			audio_seek(st, playback_position(st));
+		}
+	} else {
+		if (output_pause(&st->out, 0) < 0 && st->out.paused) {
+			audio_seek(st, playback_position(st));
+		}
+
+		st->play_state = PLAYING;
+	}
+
+	playback_wake(st);
+}
+
+// format the device can take the file's bytes in, if any
+static snd_pcm_format_t native_format(const struct fmt_sub_chunk* fmt) {
+	if (fmt->audio_format != 1) {
+		return SND_PCM_FORMAT_UNKNOWN;
+	}
+
+	switch (fmt->bits_per_sample) {
+	case 8:
+		return SND_PCM_FORMAT_U8;
+	case 16:
+		return SND_PCM_FORMAT_S16_LE;
+	case 24:
+		return SND_PCM_FORMAT_S24_3LE;
+	default:
+		return SND_PCM_FORMAT_UNKNOWN;
+	}
+}
+
+// plays a whole buffer of fmt frames through out, returning once it
+// was heard. the device is set up for fmt only if it isn't already
+int play_wav
+(
+	struct output_session* out,
+	const uint8_t* data_buf,
+	size_t buf_len,
+	const struct fmt_sub_chunk* fmt
+)
+{
+	snd_pcm_format_t format = native_format(fmt);
+	size_t frame_size = fmt->num_channels * fmt->bits_per_sample / 8;
+
+	if (format == SND_PCM_FORMAT_UNKNOWN || !frame_size ||
+		output_open(out) < 0 ||
+		output_configure(out, format, fmt->num_channels, fmt->sample_rate) < 0) {
+		return -1;
+	}
+
+	size_t frames = buf_len / frame_size;
+
+	while (frames) {
+		snd_pcm_sframes_t written = out->access == SND_PCM_ACCESS_MMAP_INTERLEAVED ?
+			snd_pcm_mmap_writei(out->pcm, data_buf, frames) :
+			output_write(out, data_buf, frames);
+
+		if (written == -EAGAIN) {
+			output_wait(out, -1);
+			continue;
+		}
+
+		if (written < 0 && telemetry_recover(out, written) < 0) {
 			return -1;
 		}
 
-		*dst++ = sample;
+		if (written > 0) {
+			data_buf += written * frame_size;
+			frames -= written;
+		}
 	}
 
-	(*st)->pcm_frames = total_frames;
-	(*st)->pcm_buf = pcm_buf;
+	output_drain(out);
+
 	return 0;
 }
 
-int audio_init(struct player_state* st) 
-{
-	int err;
+// the device is only renegotiated when format, channels or rate differ
+// a resampled track reaches it at the device rate, not its own
+static int pcm_configure(struct player_state* st, snd_pcm_format_t format) {
+	unsigned int rate = st->resample ? st->resample->out_rate : st->fmt.sample_rate;
+
+	return output_configure(&st->out, format, st->fmt.num_channels, rate);
+}
+
+// picks the output path for the current track: the file's bytes are
+// passed through when nothing has to be done to them and the device
+// accepts their format, otherwise they are converted to S32
+// with a device rate the device always takes S32, so the next track's
+// bit depth never makes it renegotiate
+int audio_configure(struct player_state* st) {
+	snd_pcm_format_t native = native_format(&st->fmt);
 
-	if ((err = snd_pcm_open(&st->pcm, "default",
-		SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	// gain and crossfades need the samples, not just the bytes, and a
+	// real-time output thread only ever reads the ring
+	if (!st->device_rate && !st->rt_priority &&
+		st->player_gain == 1.0f && !atomic_load(&st->crossfade_ms) &&
+		(!atomic_load(&st->normalize) || st->norm == 1.0f) &&
+		native != SND_PCM_FORMAT_UNKNOWN &&
+		pcm_configure(st, native) == 0) {
+		st->output_path = PATH_PASSTHROUGH;
+		return 0;
+	}
+
+	if (pcm_configure(st, SND_PCM_FORMAT_S32_LE) < 0) {
 		return -1;
 	}
 
-	if ((err = snd_pcm_set_params(
-		st->pcm,
-		SND_PCM_FORMAT_S32_LE,
-		SND_PCM_ACCESS_RW_INTERLEAVED,
-		st->fmt.num_channels,
-		st->fmt.sample_rate,
-		1,
-		500000)) < 0) {
+	st->output_path = PATH_CONVERT;
+	return 0;
+}
+
+// moves a passthrough track to the conversion path (the gain is no longer
+// unity), resuming from the frame the device was about to play
+static int leave_passthrough(struct player_state* st) {
+	playback_stop(st);
+	st->cursor = device_position(st);
+	output_drop(&st->out);
+
+	if (pcm_configure(st, SND_PCM_FORMAT_S32_LE) < 0) {
+		return -1;
+	}
+
+	st->output_path = PATH_CONVERT;
+	return playback_start(st);
+}
+
+// the device is only opened the first time, and keeps its setup when
+// the track has the same format as the last one played
+int audio_init(struct player_state* st) {
+	if (output_open(&st->out) < 0 || audio_configure(st) < 0) {
 		return -1;
 	}
 
 	st->mode = PLAYER;
 	st->play_state = PLAYING;
 
+	if (playback_start(st) < 0) {
+		return -1;
+	}
+
 	return 0;
 }
 
+// playback stops once what the device holds was heard, the device
+// itself stays open (see output.h)
 void audio_shutdown(struct player_state* st) {
-	if (!st->pcm) {
+	if (!st->out.open) {
 		return;
 	}
 
-	snd_pcm_drain(st->pcm);
-	snd_pcm_close(st->pcm);
-	st->pcm = NULL;
+	playback_stop(st);
+
+	// a boundary the device crossed but the main loop didn't adopt yet:
+	// the taken track is closed with the prefetch below, so the next
+	// tick after a later play must not adopt it
+	atomic_store(&st->boundary_pending, 0);
+	atomic_store(&st->track_changed, 0);
+
+	prefetch_cancel(st);
+	wav_stream_close(&st->retired);
+	output_drain(&st->out);
 	st->mode = COMMAND;
 	st->play_state = STOPPED;
 }
 
+// the audio itself runs on its own threads, each tick just reports
+// whether the current track has been completely played (0) or the
+// device moved on to the prefetched one (2)
 int play_wav_player_tick(struct player_state* st) {
 	if (st->play_state != PLAYING) {
 		return -2;
 	}
 
-	size_t frames_left = st->pcm_frames - st->cursor;
-
-	if (!frames_left) {
-		return 0;
+	// the device got to the prefetched track, the caller adopts it
+	if (atomic_load(&st->track_changed)) {
+		return 2;
 	}
 
-	size_t frames_to_write = 
-		frames_left < FRAMES_PER_TICK ? frames_left : FRAMES_PER_TICK;
-
-	snd_pcm_sframes_t written =
-		snd_pcm_writei(st->pcm,
-			st->pcm_buf + 
-				(st->cursor * st->fmt.num_channels),
-			frames_to_write);
+	if (st->output_path == PATH_PASSTHROUGH &&
+		(st->player_gain != 1.0f || atomic_load(&st->crossfade_ms) ||
+		(atomic_load(&st->normalize) && st->norm != 1.0f))) {
+		if (leave_passthrough(st) < 0) {
+			return -1;
+		}
+	}
 
-	if (written < 0) {
-		snd_pcm_prepare(st->pcm);
-		return -1;
+	if (atomic_load(&st->track_done)) {
+		return 0;
 	}
 
-	st->cursor += written;
-}
\ No newline at end of file
+	return 1;
+}
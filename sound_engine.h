@@ -4,18 +4,35 @@
 #include "types.h"
 
 int audio_init(struct player_state* st);
+int audio_configure(struct player_state* st);
 void audio_shutdown(struct player_state* st);
 
 int play_wav
 (
+	struct output_session* out,
 	const uint8_t* data_buf,
 	size_t buf_len,
 	const struct fmt_sub_chunk* fmt
 );
 
+int audio_events_init(struct player_state* st);
+void audio_events_free(struct player_state* st);
+
+int playback_start(struct player_state* st);
+void playback_stop(struct player_state* st);
+void playback_wake(struct player_state* st);
+size_t playback_position(struct player_state* st);
+int audio_seek(struct player_state* st, size_t frame);
+void audio_pause(struct player_state* st, int pause);
+
 int play_wav_player_tick(struct player_state* st);
 
-int convert_wav_to_32(struct player_state** st, const uint8_t* data_buf);
-void apply_volume(struct player_state** st);
+int convert_wav_to_32
+(
+	const struct fmt_sub_chunk* fmt,
+	const uint8_t* src,
+	int32_t* dst,
+	size_t frames
+);
 
 #endif
\ No newline at end of file
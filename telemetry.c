@@ -0,0 +1,155 @@
+#include "telemetry.h"
+#include "output.h"
+#include <errno.h>
+#include <time.h>
+
+uint64_t telemetry_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void histogram_reset(struct histogram* h) {
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		atomic_store(&h->buckets[i], 0);
+	}
+
+	atomic_store(&h->count, 0);
+	atomic_store(&h->total_ns, 0);
+	atomic_store(&h->max_ns, 0);
+}
+
+void telemetry_reset(struct telemetry* t) {
+	atomic_store(&t->xruns, 0);
+	atomic_store(&t->suspends, 0);
+	atomic_store(&t->errors, 0);
+	atomic_store(&t->recoveries, 0);
+	atomic_store(&t->recovery_failures, 0);
+	atomic_store(&t->short_writes, 0);
+	atomic_store(&t->avail, 0);
+	histogram_reset(&t->write);
+	histogram_reset(&t->tick);
+}
+
+// only the output thread adds to a histogram, so max needs no cas loop
+void histogram_add(struct histogram* h, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	size_t bucket = 0;
+
+	while (bucket < HISTOGRAM_BUCKETS - 1 && us >= ((uint64_t) 1 << bucket)) {
+		bucket++;
+	}
+
+	atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->total_ns, ns, memory_order_relaxed);
+
+	if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+		atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+	}
+}
+
+double histogram_percentile(const struct histogram* h, double p) {
+	size_t count = atomic_load(&h->count);
+	size_t seen = 0;
+
+	if (!count) {
+		return 0.0;
+	}
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		seen += atomic_load(&h->buckets[i]);
+
+		if (seen >= p * count) {
+			return (double) ((uint64_t) 1 << i);
+		}
+	}
+
+	return atomic_load(&h->max_ns) / 1e3;
+}
+
+int telemetry_recover(struct output_session* out, int err) {
+	struct telemetry* t = &out->telemetry;
+
+	if (err == -EPIPE) {
+		atomic_fetch_add(&t->xruns, 1);
+	} else if (err == -ESTRPIPE) {
+		atomic_fetch_add(&t->suspends, 1);
+	} else {
+		atomic_fetch_add(&t->errors, 1);
+	}
+
+	if (output_recover(out, err) < 0) {
+		atomic_fetch_add(&t->recovery_failures, 1);
+		return -1;
+	}
+
+	atomic_fetch_add(&t->recoveries, 1);
+
+	return 0;
+}
+
+long telemetry_delay(struct player_state* st) {
+	snd_pcm_sframes_t delay;
+
+	if (output_delay(&st->out, &delay) < 0) {
+		return -1;
+	}
+
+	return delay;
+}
+
+static void print_histogram(const char* name, const struct histogram* h, FILE* out) {
+	size_t count = atomic_load(&h->count);
+
+	fprintf(out, "\"%s\":{\"count\":%zu,\"mean_us\":%.2f,\"p50_us\":%.0f,"
+		"\"p99_us\":%.0f,\"max_us\":%.2f,\"buckets_us\":{",
+		name, count,
+		count ? atomic_load(&h->total_ns) / 1e3 / count : 0.0,
+		histogram_percentile(h, 0.50), histogram_percentile(h, 0.99),
+		atomic_load(&h->max_ns) / 1e3);
+
+	// keyed by upper bound, the last bucket has none
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (i < HISTOGRAM_BUCKETS - 1) {
+			fprintf(out, "%s\"%llu\":%zu", i ? "," : "",
+				(unsigned long long) 1 << i, atomic_load(&h->buckets[i]));
+		} else {
+			fprintf(out, ",\"inf\":%zu", atomic_load(&h->buckets[i]));
+		}
+	}
+
+	fprintf(out, "}}");
+}
+
+void telemetry_print_json(struct player_state* st, FILE* out) {
+	struct telemetry* t = &st->out.telemetry;
+	long delay = telemetry_delay(st);
+	unsigned int rate = st->out.rate ? st->out.rate : 1;
+	int set_up = st->out.open && st->out.format != SND_PCM_FORMAT_UNKNOWN;
+
+	fprintf(out, "{\"device\":{\"backend\":\"%s\",\"open\":%s,\"format\":\"%s\",\"channels\":%u,"
+		"\"rate\":%u,\"access\":\"%s\",\"opens\":%zu,\"setups\":%zu,"
+		"\"delay_frames\":%ld,\"delay_ms\":%.2f,\"avail_frames\":%ld},",
+		output_name(&st->out), st->out.open ? "true" : "false",
+		set_up ? snd_pcm_format_name(st->out.format) : "",
+		st->out.channels, st->out.rate,
+		!set_up ? "" : st->out.access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw",
+		st->out.opens, st->out.setups,
+		delay, delay > 0 ? delay * 1000.0 / rate : 0.0,
+		atomic_load(&t->avail));
+
+	fprintf(out, "\"xruns\":%zu,\"suspends\":%zu,\"errors\":%zu,"
+		"\"recoveries\":%zu,\"recovery_failures\":%zu,\"short_writes\":%zu,"
+		"\"ring_underruns\":%zu,",
+		atomic_load(&t->xruns), atomic_load(&t->suspends),
+		atomic_load(&t->errors), atomic_load(&t->recoveries),
+		atomic_load(&t->recovery_failures), atomic_load(&t->short_writes),
+		atomic_load(&st->underruns));
+
+	print_histogram("write", &t->write, out);
+	fprintf(out, ",");
+	print_histogram("tick", &t->tick, out);
+	fprintf(out, "}\n");
+}
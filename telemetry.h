@@ -0,0 +1,44 @@
+/*
+playback telemetry
+
+every error the device reports to an output thread used to be answered
+with a silent snd_pcm_prepare(), so nothing told how often playback
+underran. the output threads now go through telemetry_recover(), which
+counts what happened (xrun, suspend, anything else) and whether the
+device came back, and count the writes it took only part of
+
+they also time each write (snd_pcm_writei(), or snd_pcm_mmap_commit())
+and each tick (one wakeup: everything written until the device is full)
+into log2 histograms of microseconds. recording is a few relaxed atomic
+adds, the main thread reads them whenever it wants (ui, stats command)
+
+the counters cover the output session, from the device being opened
+until the player exits
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "types.h"
+#include <stdio.h>
+
+uint64_t telemetry_now(void); // monotonic ns
+
+void telemetry_reset(struct telemetry* t);
+
+void histogram_add(struct histogram* h, uint64_t ns);
+
+// upper bound in us of the bucket holding the p quantile (0..1)
+double histogram_percentile(const struct histogram* h, double p);
+
+// counts err (negative errno from alsa) and gets the device going again
+// returns -1 if it couldn't be recovered
+int telemetry_recover(struct output_session* out, int err);
+
+// frames queued in the device right now, -1 if it can't tell
+long telemetry_delay(struct player_state* st);
+
+// every counter and histogram of st's session as one json object
+void telemetry_print_json(struct player_state* st, FILE* out);
+
+#endif
@@ -1,6 +1,7 @@
 #include "types.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void print_riff_header(const struct riff_header* rhdr) {
 	printf("	--- RIFF HEADER --- 	\n");
@@ -27,6 +28,255 @@ void print_data_sub_chunk(const struct data_sub_chunk* data) {
 	printf("subchunk2_size: %d\n\n", data->subchunk2_size);
 }
 
+void print_wav_chunks(const struct wav_chunks* chunks) {
+	size_t count = chunks->count < WAV_MAX_CHUNKS ? chunks->count : WAV_MAX_CHUNKS;
+
+	printf("	--- CHUNKS --- 	\n");
+
+	for (size_t i = 0; i < count; i++) {
+		printf("%.4s: %u bytes at %llu\n", chunks->chunk[i].id, chunks->chunk[i].size,
+			(unsigned long long) chunks->chunk[i].offset);
+	}
+
+	if (chunks->count > count) {
+		printf("(%u more)\n", chunks->count - (uint32_t) count);
+	}
+
+	printf("\n");
+}
+
+void print_wav_tags(const struct wav_tags* tags) {
+	printf("	--- TAGS --- 	\n");
+	printf("title: %s\n", tags->title);
+	printf("artist: %s\n", tags->artist);
+	printf("album: %s\n", tags->album);
+	printf("date: %s\n", tags->date);
+	printf("genre: %s\n", tags->genre);
+	printf("comment: %s\n\n", tags->comment);
+}
+
+/* --- STRING POOL --- */
+
+#define POOL_BLOCK_SIZE (64 << 10)
+
+struct pool_block {
+	struct pool_block* next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+static void pool_free(struct string_pool* pool) {
+	while (pool->blocks) {
+		struct pool_block* next = pool->blocks->next;
+		free(pool->blocks);
+		pool->blocks = next;
+	}
+
+	free(pool->dirs);
+	memset(pool, 0, sizeof(*pool));
+}
+
+static char* pool_strndup(struct string_pool* pool, const char* s, size_t len) {
+	struct pool_block* b = pool->blocks;
+
+	if (!b || b->size - b->used < len + 1) {
+		size_t size = len + 1 > POOL_BLOCK_SIZE ? len + 1 : POOL_BLOCK_SIZE;
+
+		b = malloc(sizeof(*b) + size);
+
+		if (!b) {
+			return NULL;
+		}
+
+		b->next = pool->blocks;
+		b->used = 0;
+		b->size = size;
+		pool->blocks = b;
+	}
+
+	char* copy = b->data + b->used;
+
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	b->used += len + 1;
+	pool->used += len + 1;
+
+	return copy;
+}
+
+// fnv-1a
+static size_t hash_dir(const char* s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t) s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (size_t) h;
+}
+
+static int same_dir(const char* interned, const char* dir, size_t len) {
+	return strncmp(interned, dir, len) == 0 && interned[len] == '\0';
+}
+
+static int pool_grow_dirs(struct string_pool* pool) {
+	size_t cap = pool->dirs_cap ? pool->dirs_cap * 2 : 64;
+	const char** dirs = calloc(cap, sizeof(*dirs));
+
+	if (!dirs) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < pool->dirs_cap; i++) {
+		const char* dir = pool->dirs[i];
+
+		if (!dir) {
+			continue;
+		}
+
+		size_t j = hash_dir(dir, strlen(dir)) & (cap - 1);
+
+		while (dirs[j]) {
+			j = (j + 1) & (cap - 1);
+		}
+
+		dirs[j] = dir;
+	}
+
+	free(pool->dirs);
+	pool->dirs = dirs;
+	pool->dirs_cap = cap;
+
+	return 0;
+}
+
+// every track of a directory shares the same copy of it
+static const char* pool_intern_dir(struct string_pool* pool, const char* dir, size_t len) {
+	if (pool->last_dir && same_dir(pool->last_dir, dir, len)) {
+		return pool->last_dir;
+	}
+
+	if (pool->dirs_len * 2 >= pool->dirs_cap && pool_grow_dirs(pool) < 0) {
+		return NULL;
+	}
+
+	size_t mask = pool->dirs_cap - 1;
+	size_t i = hash_dir(dir, len) & mask;
+
+	while (pool->dirs[i]) {
+		if (same_dir(pool->dirs[i], dir, len)) {
+			pool->last_dir = pool->dirs[i];
+			return pool->last_dir;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	char* copy = pool_strndup(pool, dir, len);
+
+	if (!copy) {
+		return NULL;
+	}
+
+	pool->dirs[i] = copy;
+	pool->dirs_len++;
+	pool->last_dir = copy;
+
+	return copy;
+}
+
+// points t's strings into pool
+static int pool_track(struct string_pool* pool, struct track* t) {
+	const char* dir = pool_intern_dir(pool, t->dir, strlen(t->dir));
+	const char* name = dir ? pool_strndup(pool, t->name, strlen(t->name)) : NULL;
+
+	if (!name) {
+		return -1;
+	}
+
+	t->dir = dir;
+	t->name = name;
+
+	return 0;
+}
+
+/* --- TRACK PATHS --- */
+
+int track_path(const struct track* t, char* out, size_t len) {
+	int n = snprintf(out, len, "%s/%s", t->dir, t->name);
+
+	return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+// strcmp() of dir/name and s
+static int compare_parts(const char* dir, const char* name, const char* s) {
+	while (*dir && *dir == *s) {
+		dir++;
+		s++;
+	}
+
+	if (*dir) {
+		return (unsigned char) *dir - (unsigned char) *s;
+	}
+
+	if (*s != '/') {
+		return '/' - (unsigned char) *s;
+	}
+
+	return strcmp(name, s + 1);
+}
+
+int track_compare_path(const struct track* t, const char* path) {
+	return compare_parts(t->dir, t->name, path);
+}
+
+int track_compare(const struct track* a, const struct track* b) {
+	if (a->dir == b->dir) {
+		return strcmp(a->name, b->name);
+	}
+
+	const char* x = a->dir;
+	const char* y = b->dir;
+
+	while (*x && *x == *y) {
+		x++;
+		y++;
+	}
+
+	if (*x && *y) {
+		return (unsigned char) *x - (unsigned char) *y;
+	}
+
+	if (!*x && !*y) {
+		return strcmp(a->name, b->name);
+	}
+
+	// one of the dirs ended, a / comes next in its path
+	if (!*x) {
+		return *y != '/' ? '/' - (unsigned char) *y :
+			-compare_parts(y + 1, b->name, a->name);
+	}
+
+	return *x != '/' ? (unsigned char) *x - '/' :
+		compare_parts(x + 1, a->name, b->name);
+}
+
+int track_split_path(char* path, struct track* t) {
+	char* slash = strrchr(path, '/');
+
+	if (!slash) {
+		return -1;
+	}
+
+	*slash = '\0';
+	t->dir = path;
+	t->name = slash + 1;
+
+	return 0;
+}
+
 /* --- PLAYLIST FUNCTIONS --- */
 
 static int playlist_grow(struct playlist* pl) {
@@ -48,6 +298,7 @@ void playlist_init(struct playlist* pl) {
 	pl->items = NULL;
 	pl->len = 0;
 	pl->cap = 0;
+	memset(&pl->pool, 0, sizeof(pl->pool));
 }
 
 int playlist_push(struct playlist* pl, struct track t) {
@@ -57,17 +308,110 @@ int playlist_push(struct playlist* pl, struct track t) {
 		}
 	}
 
+	if (pool_track(&pl->pool, &t) < 0) {
+		return -1;
+	}
+
 	pl->items[pl->len++] = t;
 	return 0;
 }
 
-void playlist_free(struct playlist* pl) {
+// the playlist is kept sorted by path: returns 1 and the position of
+// path, or 0 and the position it would be inserted at
+int playlist_find(const struct playlist* pl, const char* path, size_t* pos) {
+	size_t lo = 0;
+	size_t hi = pl->len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = -track_compare_path(&pl->items[mid], path);
+
+		if (cmp == 0) {
+			*pos = mid;
+			return 1;
+		}
+
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	*pos = lo;
+	return 0;
+}
+
+int playlist_insert(struct playlist* pl, size_t pos, struct track t) {
+	if (pl->len == pl->cap) {
+		if (playlist_grow(pl) < 0) {
+			return -1;
+		}
+	}
+
+	if (pool_track(&pl->pool, &t) < 0) {
+		return -1;
+	}
+
+	memmove(&pl->items[pos + 1], &pl->items[pos],
+		(pl->len - pos) * sizeof(*pl->items));
+	pl->items[pos] = t;
+	pl->len++;
+
+	return 0;
+}
+
+// copies every entry's strings into a new pool, once most of the old
+// one belongs to removed entries. nothing changes if it fails
+static void playlist_compact(struct playlist* pl) {
+	struct string_pool pool = {0};
+	struct track* items = malloc((pl->len ? pl->len : 1) * sizeof(*items));
+
+	if (!items) {
+		return;
+	}
+
 	for (size_t i = 0; i < pl->len; i++) {
-		free(pl->items[i].path);
-		free(pl->items[i].name);
+		items[i] = pl->items[i];
+
+		if (pool_track(&pool, &items[i]) < 0) {
+			pool_free(&pool);
+			free(items);
+			return;
+		}
 	}
 
+	memcpy(pl->items, items, pl->len * sizeof(*items));
+	free(items);
+	pool_free(&pl->pool);
+	pl->pool = pool;
+}
+
+void playlist_remove(struct playlist* pl, size_t pos) {
+	pl->pool.garbage += strlen(pl->items[pos].name) + 1;
+
+	memmove(&pl->items[pos], &pl->items[pos + 1],
+		(pl->len - pos - 1) * sizeof(*pl->items));
+	pl->len--;
+
+	if (pl->pool.used > POOL_BLOCK_SIZE && pl->pool.garbage > pl->pool.used / 2) {
+		playlist_compact(pl);
+	}
+}
+
+static int compare_tracks(const void* a, const void* b) {
+	return track_compare(a, b);
+}
+
+void playlist_sort(struct playlist* pl) {
+	if (pl->len > 1) {
+		qsort(pl->items, pl->len, sizeof(*pl->items), compare_tracks);
+	}
+}
+
+void playlist_free(struct playlist* pl) {
 	free(pl->items);
+	pool_free(&pl->pool);
 }
 
 void track_print(struct track* t) {
@@ -75,7 +419,7 @@ void track_print(struct track* t) {
 		return;
 	}
 
-	printf("path: %s\n", t->path);
+	printf("path: %s/%s\n", t->dir, t->name);
 	printf("name: %s\n", t->name);
 	printf("duration: %.2f\n\n", t->duration);
 }
@@ -87,7 +431,7 @@ void playlist_print(struct playlist* pl) {
 
 	for (size_t i = 0; i < pl->len; i++) {
 		struct track* t = &pl->items[i];
-		printf("track %d\n", i + 1);
+		printf("track %zu\n", i + 1);
 
 		track_print(t);
 	}
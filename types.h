@@ -3,10 +3,15 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
+#include "ring_buffer.h"
 
 #define PATH_MAX_LENGTH 1024
 #define FRAMES_PER_TICK 1024
+#define MAX_CHANNELS 8
+#define RING_FRAMES 32768 // decoded frames buffered ahead of the device
 
 struct riff_header {
 	char chunk_id[4]; // "RIFF"
@@ -36,24 +41,139 @@ struct chunk_header {
 	uint32_t size;
 }__attribute__((packed));
 
+struct convert_kernel;
+struct index_header;
+struct index_entry;
+
 struct read_wav_result {
 	int riff;
 	int fmt;
 	int data;
 };
 
+// a .wav opened for playback: the file is mapped and only the frames
+// about to be played are touched, so memory doesn't grow with the file
+struct wav_stream {
+	uint8_t* map; // mapping of the whole file (NULL when closed)
+	size_t map_len; // size of the mapping
+	const uint8_t* data; // start of the data chunk inside map
+	size_t data_len; // data chunk size in bytes (whole frames only)
+	size_t frame_size; // bytes per frame (byte_align)
+	size_t released; // bytes of data already handed back to the kernel
+	int fd; // kept open for the read-ahead
+	uint64_t id; // tells streams apart once their fd or address is reused
+};
+
+// a track opened for playback (the current one or the prefetched next)
+struct track_source {
+	size_t index; // position in the playlist
+	struct wav_stream stream;
+	struct fmt_sub_chunk fmt;
+	const struct convert_kernel* convert;
+	size_t frames; // frames in the data chunk
+	const struct resample_bank* resample; // NULL: played at its own rate
+	float norm; // loudness gain (see loudness.h), 1: none
+};
+
+#define WAV_MAX_CHUNKS 8 // chunks remembered per file
+#define TAG_LENGTH 128
+
+// what the library knows about a file without opening it again
+struct wav_info {
+	struct fmt_sub_chunk fmt;
+	uint64_t data_offset; // where the data chunk starts in the file
+	uint64_t data_len;
+	int64_t mtime; // ns, a file whose mtime or size changed is probed again
+	uint64_t size;
+	uint64_t tags_offset; // payload of the LIST/INFO chunk, tags_len 0: none
+	uint32_t tags_len;
+};
+
+// where a chunk's payload is in the file
+struct wav_chunk {
+	char id[4];
+	uint32_t size;
+	uint64_t offset;
+};
+
+// every chunk of a file, only probed for the info command (the tags
+// are found from wav_info alone), a playlist doesn't keep them
+struct wav_chunks {
+	uint32_t count; // chunks in the file, the first ones are below
+	struct wav_chunk chunk[WAV_MAX_CHUNKS];
+};
+
+// LIST/INFO metadata
+struct wav_tags {
+	char title[TAG_LENGTH]; // INAM
+	char artist[TAG_LENGTH]; // IART
+	char album[TAG_LENGTH]; // IPRD
+	char date[TAG_LENGTH]; // ICRD
+	char genre[TAG_LENGTH]; // IGNR
+	char comment[TAG_LENGTH]; // ICMT
+};
+
+// loudness of a track not measured yet, and of one with nothing to
+// normalize (silent, or it couldn't be read), see loudness.h
+#define LOUDNESS_UNKNOWN -1000.0f
+#define LOUDNESS_NONE -999.0f
+
+// a track's path is dir/name. inside a playlist both live in its
+// string pool, and every track of a directory points at the same dir
+// outside of one (e.g. a track just probed) they point at the caller's
+// strings, and a playlist copies them in when it's given the track
 struct track {
-	char* path;
-	char* name;
+	const char* dir;
+	const char* name;
 	double duration;
+	struct wav_info info;
+	float loudness; // integrated, LUFS
+	float peak; // true peak, linear
+};
+
+struct pool_block;
+
+// strings of a playlist, allocated in big blocks and freed all at once
+struct string_pool {
+	struct pool_block* blocks; // the newest one first
+	const char** dirs; // open addressing set of the directories interned
+	size_t dirs_cap;
+	size_t dirs_len;
+	const char* last_dir; // tracks mostly come a directory at a time
+	size_t used; // bytes handed out
+	size_t garbage; // bytes of names removed since, reclaimed by a compaction
 };
 
 struct playlist {
 	struct track* items;
 	size_t len;
 	size_t cap;
+	struct string_pool pool;
+};
+
+// the on-disk library index, mapped read only (see index.h)
+struct library_index {
+	uint8_t* map; // NULL when there is no usable index
+	size_t map_len;
+	const struct index_header* hdr;
+	const struct index_entry* entries;
+	const char* strings;
+	size_t count;
 };
 
+// inotify watches over the library (see watcher.h)
+struct library_watch {
+	int fd; // inotify instance, -1 when not watching
+	pthread_mutex_t lock; // dirs is also filled by the initial walk
+	char** dirs; // directory watched by each watch descriptor
+	size_t dirs_len;
+	pthread_t walk_thread; // adds the initial watches
+	int walking;
+	atomic_int stop;
+};
+
+struct library_change;
+
 enum ui_mode {
 	PLAYER,
 	COMMAND
@@ -65,6 +185,111 @@ enum play_state {
 	PAUSED
 };
 
+struct io_meter {
+	double wall; // when the rates below were last computed
+	double cpu; // process cpu time at that point
+	size_t copies; // copy counters at that point
+	size_t copied_bytes;
+	double copies_per_sec;
+	double mb_per_sec;
+	double cpu_percent;
+};
+
+#define HISTOGRAM_BUCKETS 20
+
+// durations, bucket i counts those under 2^i us (the last one also
+// everything longer)
+struct histogram {
+	atomic_size_t buckets[HISTOGRAM_BUCKETS];
+	atomic_size_t count;
+	atomic_uint_least64_t total_ns;
+	atomic_uint_least64_t max_ns;
+};
+
+// what the output threads saw of the device (see telemetry.h)
+struct telemetry {
+	atomic_size_t xruns; // -EPIPE: the device ran out of frames
+	atomic_size_t suspends; // -ESTRPIPE: the system was suspended
+	atomic_size_t errors; // any other error
+	atomic_size_t recoveries; // the device was running again after one
+	atomic_size_t recovery_failures;
+	atomic_size_t short_writes; // the device took part of a write
+	atomic_long avail; // frames the device could take at the last tick
+	struct histogram write; // one snd_pcm_writei() or mmap commit
+	struct histogram tick; // one wakeup of the output thread
+};
+
+struct output_backend;
+struct output_sink;
+struct loudness_analyzer;
+struct waveform_builder;
+struct screen;
+
+// the playback device, kept open across tracks (see output.h)
+struct output_session {
+	const struct output_backend* backend; // NULL: alsa
+	const char* device; // alsa pcm name (NULL: "default") or the file written
+	int paced; // null sink: frames are taken at the rate they'd be played
+	int open; // from the first play until exit
+	snd_pcm_t* pcm; // alsa
+	struct output_sink* sink; // null and file
+	int use_mmap; // write through snd_pcm_mmap_begin/commit (-m)
+	int mmap_refused; // the device didn't accept mmap access
+	snd_pcm_access_t access; // access the device is set up with
+	int can_pause; // alsa: it holds its frames while paused (snd_pcm_pause)
+	int paused; // by output_pause()
+	snd_pcm_format_t format; // format the device is set up with
+	unsigned int channels;
+	unsigned int rate;
+	size_t opens; // times the device was opened
+	size_t setups; // times its params were negotiated
+	struct telemetry telemetry; // since the device was opened
+};
+
+struct readahead_uring;
+
+// read-ahead of the track being played (see readahead.h)
+struct readahead {
+	int depth; // windows in flight at most, 0: off
+	const char* backend; // "io_uring" or "pread"
+	struct readahead_uring* uring; // NULL on the pread fallback
+	uint8_t* buffers; // one window per read in flight
+	pthread_t thread;
+	int running;
+	int wake_fd; // eventfd: the decoder moved on
+	atomic_int stop;
+
+	// set by the decoder
+	pthread_mutex_t lock;
+	uint64_t stream_id; // the stream being read ahead
+	int pending_fd; // a new stream's fd, not picked up by the thread yet
+	uint64_t pending_end;
+	atomic_uint_least64_t pos; // file offset the decoder got to
+	uint64_t woken_at; // pos the thread was last woken up for
+
+	// reported
+	atomic_int inflight; // windows
+	atomic_size_t inflight_bytes;
+	atomic_size_t reads;
+	atomic_uint_least64_t latency_ns; // total, over reads
+	atomic_uint_least64_t latency_max_ns;
+};
+
+enum output_path {
+	PATH_CONVERT, // decode thread converts to S32 and applies gain
+	PATH_PASSTHROUGH // the file's bytes are written as they are
+};
+
+enum next_state {
+	NEXT_PENDING, // the main thread hasn't decided the next track yet
+	NEXT_LOADING, // prefetch thread is opening it
+	NEXT_READY, // opened, waiting for the decoder
+	NEXT_CHECKING, // the decoder is checking it can follow the current track
+	NEXT_TAKEN, // the decoder moved on to it
+	NEXT_END, // no track follows
+	NEXT_FAILED // it couldn't be opened
+};
+
 struct player_state {
 	int running; // controls main loop
 	char dir_path[PATH_MAX_LENGTH]; // path of the current directory
@@ -74,29 +299,113 @@ struct player_state {
 	size_t played; // how many tracks were played
 
 	enum ui_mode mode; // PLAYER or COMMAND
-	enum play_state play_state; // STOPPED or PLAYING or PAUSED
+	_Atomic enum play_state play_state; // STOPPED or PLAYING or PAUSED
 
 	struct playlist playlist; // list of tracks
+
+	// library index (see library.h)
+	char index_file[PATH_MAX_LENGTH]; // empty: no index is kept
+	struct library_index index; // loaded at startup, until revalidated
+	struct playlist rescanned; // revalidated playlist, not adopted yet
+	pthread_t rescan_thread;
+	int rescanning;
+	atomic_int rescan_done;
+	atomic_int rescan_cancel;
+	struct library_change* changes; // applied during the rescan, replayed on it
+	size_t changes_len;
+	size_t changes_cap;
+	char** deferred; // removed while playing, taken out once they aren't
+	size_t deferred_len;
+	int library_dirty; // the index on disk is behind the playlist
+	struct library_watch watch;
 	size_t current_track; // number of tracks
-	size_t cursor;
-	float player_gain;
+	atomic_size_t cursor; // frames already written to the device
+	_Atomic float player_gain;
+	atomic_int normalize; // the tracks' loudness gains are applied
+	struct loudness_analyzer* analyzer; // background measurements
+	struct waveform_builder* waveform; // of the current track (see waveform.h)
+	struct screen* screen; // the player mode's, NULL until first drawn
 
-	snd_pcm_t *pcm;
-	int32_t* pcm_buf; // audio data that has been read using read_data_buf
-	size_t buf_len; // size of data_buf
+	struct output_session out; // the device, open until exit (see output.h)
+	unsigned int device_rate; // every track is resampled to it (-R), 0: off
+	int resample_quality; // enum resample_quality
+	enum output_path output_path; // chosen per track by audio_configure()
+	struct wav_stream stream; // data chunk of the current track
+	size_t buf_len; // size of the data chunk in bytes
 	size_t pcm_frames;
 	struct fmt_sub_chunk fmt;
+	const struct convert_kernel* convert; // picked once per track
+	const struct resample_bank* resample; // of the current track
+	float norm; // of the current track
+	struct wav_tags tags; // of the current track
+
+	// decode thread -> ring -> output thread
+	struct ring_buffer ring; // decoded frames waiting for the device
+	pthread_t decode_thread; // converts stream and applies gain into ring
+	pthread_t output_thread; // only moves frames from ring to pcm
+	int threads_running;
+	int decoding; // decode_thread was started (rw access, conversion)
+	int rt_priority; // -t: SCHED_FIFO priority of output_thread, 0: none (see realtime.h)
+	int output_fifo; // output_thread got it
+	void* output_stack; // its locked stack, NULL: a default one
+	atomic_int stop_threads; // asks both threads to return
+	atomic_int decode_done; // decoder reached the end of the track
+	atomic_int track_done; // every frame of the track reached the device
+	atomic_int output_waiting; // output thread sleeps until frames arrive
+	atomic_int decode_waiting; // decode thread sleeps until there's room
+	int wake_fd; // eventfd: wakes the output thread
+	int space_fd; // eventfd: wakes the decode thread
+	int event_fd; // eventfd: wakes the main loop (track done)
+
+	// gapless playback (see prefetch.h)
+	struct track_source next; // prefetched next track
+	atomic_int next_state; // enum next_state
+	size_t next_index; // playlist entry being prefetched
+	char next_path[PATH_MAX_LENGTH];
+	struct wav_info next_info; // what the playlist knows about it
+	float next_norm;
+	pthread_t prefetch_thread;
+	int prefetching;
+	int prefetch_fd; // eventfd: wakes a decoder waiting for st->next
+	struct wav_stream retired; // previous track, closed at the next change
+	atomic_size_t boundary; // produced frame where the next track starts
+	atomic_int boundary_pending; // decoder switched, device not there yet
+	atomic_int track_changed; // device reached the boundary
+	atomic_int crossfade_ms; // 0: plain gapless
+	atomic_size_t underruns; // times the output found the ring empty
+	atomic_size_t copies; // copies of frames on their way to the device
+	atomic_size_t copied_bytes;
+	struct io_meter meter; // per second rates shown by the ui
+	struct readahead readahead;
 };
 
 void print_riff_header(const struct riff_header* rhdr);
 void print_fmt_sub_chunk(const struct fmt_sub_chunk* fmt);
 void print_data_sub_chunk(const struct data_sub_chunk* data);
+void print_wav_chunks(const struct wav_chunks* chunks);
+void print_wav_tags(const struct wav_tags* tags);
 
 /* --- PLAYLIST FUNCTIONS --- */
 
 void playlist_init(struct playlist* pl);
 void playlist_free(struct playlist* pl);
+int playlist_find(const struct playlist* pl, const char* path, size_t* pos);
+
+// t's strings are copied into the playlist
 int playlist_push(struct playlist* pl, struct track t);
+int playlist_insert(struct playlist* pl, size_t pos, struct track t);
+void playlist_remove(struct playlist* pl, size_t pos);
+void playlist_sort(struct playlist* pl);
+
+// dir/name into out, -1 if it doesn't fit
+int track_path(const struct track* t, char* out, size_t len);
+
+// orders t as its path would be, without building it
+int track_compare_path(const struct track* t, const char* path);
+int track_compare(const struct track* a, const struct track* b);
+
+// points t's dir and name into path (changed in place), -1 without a /
+int track_split_path(char* path, struct track* t);
 void playlist_print(struct playlist* pl);
 void track_print(struct track* t);
 
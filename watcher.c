@@ -0,0 +1,351 @@
+#include "watcher.h"
+#include "library.h"
+#include "scanner.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+	IN_DELETE | IN_CREATE | IN_ONLYDIR)
+
+static void set_dir(struct library_watch* w, int wd, const char* path) {
+	pthread_mutex_lock(&w->lock);
+
+	if ((size_t) wd >= w->dirs_len) {
+		size_t len = w->dirs_len ? w->dirs_len : 64;
+
+		while (len <= (size_t) wd) {
+			len *= 2;
+		}
+
+		char** dirs = realloc(w->dirs, len * sizeof(*dirs));
+
+		if (!dirs) {
+			pthread_mutex_unlock(&w->lock);
+			return;
+		}
+
+		memset(dirs + w->dirs_len, 0, (len - w->dirs_len) * sizeof(*dirs));
+		w->dirs = dirs;
+		w->dirs_len = len;
+	}
+
+	free(w->dirs[wd]);
+	w->dirs[wd] = strdup(path);
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void forget_dir(struct library_watch* w, int wd) {
+	pthread_mutex_lock(&w->lock);
+
+	if (wd >= 0 && (size_t) wd < w->dirs_len) {
+		free(w->dirs[wd]);
+		w->dirs[wd] = NULL;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int dir_of(struct library_watch* w, int wd, char* out, size_t len) {
+	int ret = -1;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (wd >= 0 && (size_t) wd < w->dirs_len && w->dirs[wd]) {
+		snprintf(out, len, "%s", w->dirs[wd]);
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return ret;
+}
+
+// watches path, and every directory under it when recursive
+static void watch_tree(struct player_state* st, const char* path) {
+	struct library_watch* w = &st->watch;
+	int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			fprintf(stderr, "inotify watch limit reached: %s\n", path);
+		}
+
+		return;
+	}
+
+	set_dir(w, wd, path);
+
+	if (!st->recursive) {
+		return;
+	}
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+
+	if (!dir) {
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return;
+	}
+
+	struct dirent* ent;
+
+	while (!atomic_load(&w->stop) && (ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		int type = ent->d_type;
+
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat sb;
+
+			if (fstatat(dirfd(dir), ent->d_name, &sb, 0) != 0) {
+				continue;
+			}
+
+			type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_UNKNOWN;
+		}
+
+		char sub[PATH_MAX_LENGTH];
+		int len = snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+
+		if (type == DT_DIR && len > 0 && (size_t) len < sizeof(sub)) {
+			watch_tree(st, sub);
+		}
+	}
+
+	closedir(dir);
+}
+
+// a directory moved out of the library keeps its watches otherwise
+static void unwatch_tree(struct library_watch* w, const char* path) {
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&w->lock);
+
+	for (size_t wd = 0; wd < w->dirs_len; wd++) {
+		const char* dir = w->dirs[wd];
+
+		if (dir && strncmp(dir, path, len) == 0 &&
+			(dir[len] == '\0' || dir[len] == '/')) {
+			inotify_rm_watch(w->fd, wd);
+			free(w->dirs[wd]);
+			w->dirs[wd] = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void* walk_thread_main(void* arg) {
+	struct player_state* st = arg;
+
+	watch_tree(st, st->dir_path);
+
+	return NULL;
+}
+
+static void add_tree(struct player_state* st, const char* path) {
+	struct playlist found;
+
+	playlist_init(&found);
+	scan_library(path, st->recursive, NULL, NULL, &found);
+
+	for (size_t i = 0; i < found.len; i++) {
+		library_add(st, found.items[i]);
+	}
+
+	playlist_free(&found);
+}
+
+// the tracks under path are contiguous, the playlist is sorted by path
+static void remove_tree(struct player_state* st, const char* path) {
+	char prefix[PATH_MAX_LENGTH];
+	int len = snprintf(prefix, sizeof(prefix), "%s/", path);
+	size_t pos;
+	size_t end;
+
+	if (len < 0 || (size_t) len >= sizeof(prefix)) {
+		return;
+	}
+
+	playlist_find(&st->playlist, prefix, &pos);
+
+	char entry[PATH_MAX_LENGTH];
+
+	for (end = pos; end < st->playlist.len; end++) {
+		if (track_path(&st->playlist.items[end], entry, sizeof(entry)) < 0 ||
+			strncmp(entry, prefix, len) != 0) {
+			break;
+		}
+	}
+
+	// copied first, removing moves the entries
+	size_t count = end - pos;
+	char** paths = malloc((count ? count : 1) * sizeof(*paths));
+
+	if (!paths) {
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		track_path(&st->playlist.items[pos + i], entry, sizeof(entry));
+		paths[i] = strdup(entry);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (paths[i]) {
+			library_remove(st, paths[i]);
+		}
+
+		free(paths[i]);
+	}
+
+	free(paths);
+}
+
+static void handle_event(struct player_state* st, const struct inotify_event* ev) {
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fprintf(stderr, "inotify queue overflowed, rescanning\n");
+		library_rescan(st);
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		forget_dir(&st->watch, ev->wd);
+		return;
+	}
+
+	char dir[PATH_MAX_LENGTH];
+	char path[PATH_MAX_LENGTH];
+
+	if (!ev->len || dir_of(&st->watch, ev->wd, dir, sizeof(dir)) < 0) {
+		return;
+	}
+
+	int len = snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+
+	if (len < 0 || (size_t) len >= sizeof(path)) {
+		return;
+	}
+
+	if (ev->mask & IN_ISDIR) {
+		if (!st->recursive) {
+			return;
+		}
+
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_tree(st, path);
+			add_tree(st, path);
+		} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			unwatch_tree(&st->watch, path);
+			remove_tree(st, path);
+		}
+
+		return;
+	}
+
+	if (!scan_is_wav(ev->name)) {
+		return;
+	}
+
+	if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		struct track t;
+
+		// rewritten into something that isn't a wav anymore
+		if (scan_track(AT_FDCWD, dir, ev->name, &t) < 0) {
+			library_remove(st, path);
+			return;
+		}
+
+		library_add(st, t);
+	} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		library_remove(st, path);
+	}
+}
+
+int watcher_init(struct player_state* st) {
+	struct library_watch* w = &st->watch;
+
+	w->dirs = NULL;
+	w->dirs_len = 0;
+	w->walking = 0;
+	atomic_store(&w->stop, 0);
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (w->fd < 0) {
+		perror("inotify_init1");
+		return -1;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+
+	if (pthread_create(&w->walk_thread, NULL, walk_thread_main, st) == 0) {
+		w->walking = 1;
+	} else {
+		watch_tree(st, st->dir_path);
+	}
+
+	return 0;
+}
+
+void watcher_process(struct player_state* st) {
+	char buf[WATCH_EVENTS_LEN]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	if (st->watch.fd < 0) {
+		return;
+	}
+
+	for (;;) {
+		ssize_t n = read(st->watch.fd, buf, sizeof(buf));
+
+		if (n <= 0) {
+			break;
+		}
+
+		for (char* p = buf; p < buf + n; ) {
+			const struct inotify_event* ev = (const struct inotify_event*) p;
+
+			handle_event(st, ev);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+void watcher_free(struct player_state* st) {
+	struct library_watch* w = &st->watch;
+
+	if (w->fd < 0) {
+		return;
+	}
+
+	atomic_store(&w->stop, 1);
+
+	if (w->walking) {
+		pthread_join(w->walk_thread, NULL);
+		w->walking = 0;
+	}
+
+	close(w->fd);
+	w->fd = -1;
+
+	for (size_t i = 0; i < w->dirs_len; i++) {
+		free(w->dirs[i]);
+	}
+
+	free(w->dirs);
+	w->dirs = NULL;
+	w->dirs_len = 0;
+	pthread_mutex_destroy(&w->lock);
+}
@@ -0,0 +1,32 @@
+/*
+inotify watcher over the library
+
+every directory of the library (only the top one when not recursive)
+is watched. the watches are added by a background walk at startup, so
+the playlist from the index is still ready right away
+
+the inotify fd is polled by the command and the player loops next to
+stdin, and watcher_process() turns what happened into library_add()
+and library_remove() calls (see library.h):
+
+- a .wav written and closed, or moved in: probed and added (or updated)
+- a .wav deleted or moved out: removed
+- a directory created or moved in: watched and scanned
+- a directory deleted or moved out: every track under it is removed
+- the event queue overflowed: the whole library is rescanned
+
+audio runs on its own threads, so none of this can delay it
+*/
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "types.h"
+
+#define WATCH_EVENTS_LEN 16384 // bytes of events read at once
+
+int watcher_init(struct player_state* st);
+void watcher_process(struct player_state* st);
+void watcher_free(struct player_state* st);
+
+#endif
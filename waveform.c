@@ -0,0 +1,527 @@
+#include "waveform.h"
+#include "convert.h"
+#include "fd_handle.h"
+#include "index.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define SAMPLE_SCALE (1.0f / 2147483648.0f) // S32 to [-1, 1)
+
+// min and max of n samples folded into *min and *max, returns the sum of
+// their squares (all of them scaled to [-1, 1))
+typedef float (*block_fn)(const int32_t* s, size_t n, float* min, float* max);
+
+/* --- BLOCK KERNELS --- */
+
+static float block_scalar(const int32_t* s, size_t n, float* min, float* max) {
+	float lo = *min;
+	float hi = *max;
+	float sum = 0.0f;
+
+	for (size_t i = 0; i < n; i++) {
+		float x = (float) s[i] * SAMPLE_SCALE;
+
+		lo = x < lo ? x : lo;
+		hi = x > hi ? x : hi;
+		sum += x * x;
+	}
+
+	*min = lo;
+	*max = hi;
+
+	return sum;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static float block_sse2(const int32_t* s, size_t n, float* min, float* max) {
+	__m128 scale = _mm_set1_ps(SAMPLE_SCALE);
+	__m128 lo = _mm_set1_ps(*min);
+	__m128 hi = _mm_set1_ps(*max);
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(v), scale);
+
+		lo = _mm_min_ps(lo, x);
+		hi = _mm_max_ps(hi, x);
+		acc = _mm_add_ps(acc, _mm_mul_ps(x, x));
+	}
+
+	float l[4], h[4], a[4];
+
+	_mm_storeu_ps(l, lo);
+	_mm_storeu_ps(h, hi);
+	_mm_storeu_ps(a, acc);
+
+	for (size_t k = 1; k < 4; k++) {
+		l[0] = l[k] < l[0] ? l[k] : l[0];
+		h[0] = h[k] > h[0] ? h[k] : h[0];
+	}
+
+	*min = l[0];
+	*max = h[0];
+
+	return a[0] + a[1] + a[2] + a[3] + block_scalar(s + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static float block_avx2(const int32_t* s, size_t n, float* min, float* max) {
+	__m256 scale = _mm256_set1_ps(SAMPLE_SCALE);
+	__m256 lo = _mm256_set1_ps(*min);
+	__m256 hi = _mm256_set1_ps(*max);
+	__m256 acc = _mm256_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256 x = _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale);
+
+		lo = _mm256_min_ps(lo, x);
+		hi = _mm256_max_ps(hi, x);
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(x, x));
+	}
+
+	float l[8], h[8], a[8];
+
+	_mm256_storeu_ps(l, lo);
+	_mm256_storeu_ps(h, hi);
+	_mm256_storeu_ps(a, acc);
+
+	float sum = a[0];
+
+	for (size_t k = 1; k < 8; k++) {
+		l[0] = l[k] < l[0] ? l[k] : l[0];
+		h[0] = h[k] > h[0] ? h[k] : h[0];
+		sum += a[k];
+	}
+
+	*min = l[0];
+	*max = h[0];
+
+	return sum + block_scalar(s + i, n - i, min, max);
+}
+
+#endif
+
+static block_fn kernel = block_scalar;
+static const char* kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void) {
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = block_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel = block_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+}
+
+const char* waveform_kernel_name(void) {
+	pthread_once(&kernel_once, pick_kernel);
+	return kernel_name;
+}
+
+/* --- PYRAMID --- */
+
+static size_t base_len(uint64_t frames) {
+	return (frames + WAVEFORM_BASE_FRAMES - 1) / WAVEFORM_BASE_FRAMES;
+}
+
+int waveform_init(struct waveform* wf, uint64_t frames, size_t channels) {
+	size_t len = base_len(frames);
+
+	memset(wf, 0, sizeof(*wf));
+
+	// every level is at most half (rounded up) of the one under it
+	wf->peaks = calloc(2 * len + WAVEFORM_MAX_LEVELS, sizeof(*wf->peaks));
+
+	if (!wf->peaks) {
+		return -1;
+	}
+
+	pthread_once(&kernel_once, pick_kernel);
+
+	wf->frames = frames;
+	wf->channels = channels ? channels : 1;
+	wf->level[0] = wf->peaks;
+	wf->levels = 1;
+	wf->min = 1.0f;
+	wf->max = -1.0f;
+
+	return 0;
+}
+
+void waveform_free(struct waveform* wf) {
+	free(wf->peaks);
+	memset(wf, 0, sizeof(*wf));
+}
+
+static int16_t to_s16(float x) {
+	float v = roundf(x * 32768.0f);
+
+	return (int16_t) (v > 32767.0f ? 32767.0f : v < -32768.0f ? -32768.0f : v);
+}
+
+static uint16_t rms_to_u16(double rms) {
+	double v = round(rms * 32767.0);
+
+	return (uint16_t) (v > 65535.0 ? 65535.0 : v);
+}
+
+static void close_peak(struct waveform* wf) {
+	struct waveform_peak* p = &wf->level[0][wf->len[0]++];
+
+	p->min = to_s16(wf->min);
+	p->max = to_s16(wf->max);
+	p->rms = rms_to_u16(sqrt(wf->sum / (double) (wf->fill * wf->channels)));
+
+	wf->fill = 0;
+	wf->min = 1.0f;
+	wf->max = -1.0f;
+	wf->sum = 0.0;
+}
+
+void waveform_add(struct waveform* wf, const int32_t* frames, size_t n) {
+	size_t room = base_len(wf->frames);
+
+	while (n > 0 && wf->len[0] < room) {
+		size_t take = WAVEFORM_BASE_FRAMES - wf->fill;
+
+		if (take > n) {
+			take = n;
+		}
+
+		wf->sum += kernel(frames, take * wf->channels, &wf->min, &wf->max);
+		wf->fill += take;
+		frames += take * wf->channels;
+		n -= take;
+
+		if (wf->fill == WAVEFORM_BASE_FRAMES) {
+			close_peak(wf);
+		}
+	}
+}
+
+static struct waveform_peak merge(const struct waveform_peak* a, const struct waveform_peak* b) {
+	struct waveform_peak p = {
+		.min = a->min < b->min ? a->min : b->min,
+		.max = a->max > b->max ? a->max : b->max,
+		.rms = rms_to_u16(sqrt(((double) a->rms * a->rms + (double) b->rms * b->rms) /
+			(2.0 * 32767.0 * 32767.0)))
+	};
+
+	return p;
+}
+
+// every level from level 0, two peaks of a level are one of the next
+static void build_levels(struct waveform* wf) {
+	wf->levels = 1;
+
+	while (wf->levels < WAVEFORM_MAX_LEVELS && wf->len[wf->levels - 1] > 1) {
+		size_t below = wf->levels - 1;
+		const struct waveform_peak* src = wf->level[below];
+		struct waveform_peak* dst = wf->level[below] + wf->len[below];
+		size_t len = (wf->len[below] + 1) / 2;
+
+		for (size_t i = 0; i < len; i++) {
+			dst[i] = 2 * i + 1 < wf->len[below] ?
+				merge(&src[2 * i], &src[2 * i + 1]) : src[2 * i];
+		}
+
+		wf->level[wf->levels] = dst;
+		wf->len[wf->levels] = len;
+		wf->levels++;
+	}
+}
+
+void waveform_finish(struct waveform* wf) {
+	if (wf->fill && wf->len[0] < base_len(wf->frames)) {
+		close_peak(wf);
+	}
+
+	build_levels(wf);
+}
+
+void waveform_overview
+(
+	const struct waveform* wf,
+	uint64_t from,
+	uint64_t to,
+	size_t columns,
+	struct waveform_peak* out
+)
+{
+	size_t level = 0;
+	uint64_t span = columns && to > from ? (to - from) / columns : 0;
+
+	// the coarsest level whose peaks are no wider than a column
+	while (level + 1 < wf->levels &&
+		((uint64_t) WAVEFORM_BASE_FRAMES << (level + 1)) <= span) {
+		level++;
+	}
+
+	uint64_t bucket = (uint64_t) WAVEFORM_BASE_FRAMES << level;
+	const struct waveform_peak* peaks = wf->level[level];
+	size_t len = wf->len[level];
+
+	for (size_t c = 0; c < columns; c++) {
+		uint64_t f0 = from + (to - from) * c / columns;
+		uint64_t f1 = from + (to - from) * (c + 1) / columns;
+		size_t b0 = f0 / bucket;
+		size_t b1 = (f1 + bucket - 1) / bucket;
+		struct waveform_peak p = {0};
+
+		if (b1 <= b0) {
+			b1 = b0 + 1;
+		}
+
+		if (b1 > len) {
+			b1 = len;
+		}
+
+		// at most 3 peaks: a column is narrower than 2 of them
+		if (b0 < b1) {
+			double sum = 0.0;
+
+			p = peaks[b0];
+
+			for (size_t b = b0; b < b1; b++) {
+				p.min = peaks[b].min < p.min ? peaks[b].min : p.min;
+				p.max = peaks[b].max > p.max ? peaks[b].max : p.max;
+				sum += (double) peaks[b].rms * peaks[b].rms;
+			}
+
+			p.rms = rms_to_u16(sqrt(sum / (b1 - b0)) / 32767.0);
+		}
+
+		out[c] = p;
+	}
+}
+
+/* --- CACHE --- */
+
+static int waveform_load(const char* file, const struct wav_info* info, struct waveform* wf) {
+	struct waveform_header hdr;
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (read_bytes_from_file(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(hdr.magic, WAVEFORM_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != WAVEFORM_VERSION ||
+		hdr.base_frames != WAVEFORM_BASE_FRAMES ||
+		hdr.mtime != info->mtime || hdr.size != info->size ||
+		hdr.frames != wf->frames || hdr.len != base_len(wf->frames)) {
+		close(fd);
+		return -1;
+	}
+
+	size_t bytes = hdr.len * sizeof(*wf->peaks);
+	int ret = read_bytes_from_file(fd, wf->peaks, bytes) == (ssize_t) bytes ? 0 : -1;
+
+	close(fd);
+
+	if (ret == 0) {
+		wf->len[0] = hdr.len;
+		build_levels(wf);
+	}
+
+	return ret;
+}
+
+static int waveform_save(const char* file, const struct wav_info* info, const struct waveform* wf) {
+	char tmp[PATH_MAX_LENGTH];
+	struct waveform_header hdr = {0};
+
+	memcpy(hdr.magic, WAVEFORM_MAGIC, sizeof(hdr.magic));
+	hdr.version = WAVEFORM_VERSION;
+	hdr.base_frames = WAVEFORM_BASE_FRAMES;
+	hdr.mtime = info->mtime;
+	hdr.size = info->size;
+	hdr.frames = wf->frames;
+	hdr.len = wf->len[0];
+
+	int n = snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+	if (n < 0 || (size_t) n >= sizeof(tmp)) {
+		return -1;
+	}
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int ret = -1;
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	size_t bytes = hdr.len * sizeof(*wf->peaks);
+
+	if (write_bytes_to_file(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write_bytes_to_file(fd, wf->level[0], bytes) == (ssize_t) bytes) {
+		ret = 0;
+	}
+
+	close(fd);
+
+	if (ret == 0 && rename(tmp, file) < 0) {
+		ret = -1;
+	}
+
+	if (ret < 0) {
+		unlink(tmp);
+	}
+
+	return ret;
+}
+
+/* --- BACKGROUND BUILD --- */
+
+struct waveform_builder {
+	char path[PATH_MAX_LENGTH];
+	struct wav_info info;
+	struct waveform wf;
+	pthread_t thread;
+	atomic_int cancel;
+	atomic_int ready; // wf can be read
+};
+
+// one pass over the track, like the loudness analysis
+static int waveform_scan(struct waveform_builder* b) {
+	struct wav_stream ws;
+
+	if (wav_stream_open(b->path, &b->info, &ws) < 0) {
+		return -1;
+	}
+
+	const struct convert_kernel* convert = convert_select(&b->info.fmt);
+	size_t channels = b->info.fmt.num_channels;
+
+	if (!convert || channels == 0 || channels > MAX_CHANNELS) {
+		wav_stream_close(&ws);
+		return -1;
+	}
+
+	int32_t block[FRAMES_PER_TICK * MAX_CHANNELS];
+	const uint8_t* src;
+	size_t cursor = 0;
+	size_t n;
+
+	while (!atomic_load(&b->cancel) &&
+		(n = wav_stream_frames(&ws, cursor, FRAMES_PER_TICK, &src)) > 0) {
+		convert->fn(src, block, n * channels);
+		waveform_add(&b->wf, block, n);
+		cursor += n;
+		wav_stream_release(&ws, cursor);
+	}
+
+	wav_stream_close(&ws);
+
+	if (atomic_load(&b->cancel)) {
+		return -1;
+	}
+
+	waveform_finish(&b->wf);
+
+	return 0;
+}
+
+static void* builder_thread_main(void* arg) {
+	struct waveform_builder* b = arg;
+	char file[PATH_MAX_LENGTH];
+	int cached = cache_file_path("waveform", b->path, 0, file, sizeof(file)) == 0;
+
+	setpriority(PRIO_PROCESS, 0, WAVEFORM_NICE);
+
+	if (cached && waveform_load(file, &b->info, &b->wf) == 0) {
+		atomic_store(&b->ready, 1);
+		return NULL;
+	}
+
+	if (waveform_scan(b) < 0) {
+		return NULL;
+	}
+
+	atomic_store(&b->ready, 1);
+
+	// next time the track plays it's drawn at once
+	if (cached) {
+		waveform_save(file, &b->info, &b->wf);
+	}
+
+	return NULL;
+}
+
+void waveform_request(struct player_state* st, const char* path, const struct wav_info* info) {
+	struct waveform_builder* b = st->waveform;
+
+	// the same track again (looped, or picked again)
+	if (b && strcmp(b->path, path) == 0 && b->info.mtime == info->mtime &&
+		b->info.size == info->size) {
+		return;
+	}
+
+	waveform_stop(st);
+
+	size_t frame_size = info->fmt.byte_align;
+
+	if (!frame_size || strlen(path) >= sizeof(b->path) ||
+		!(b = calloc(1, sizeof(*b)))) {
+		return;
+	}
+
+	strcpy(b->path, path);
+	b->info = *info;
+	atomic_init(&b->cancel, 0);
+	atomic_init(&b->ready, 0);
+
+	if (waveform_init(&b->wf, info->data_len / frame_size, info->fmt.num_channels) < 0) {
+		free(b);
+		return;
+	}
+
+	if (pthread_create(&b->thread, NULL, builder_thread_main, b) != 0) {
+		waveform_free(&b->wf);
+		free(b);
+		return;
+	}
+
+	st->waveform = b;
+}
+
+const struct waveform* waveform_current(struct player_state* st) {
+	struct waveform_builder* b = st->waveform;
+
+	return b && atomic_load(&b->ready) ? &b->wf : NULL;
+}
+
+void waveform_stop(struct player_state* st) {
+	struct waveform_builder* b = st->waveform;
+
+	if (!b) {
+		return;
+	}
+
+	atomic_store(&b->cancel, 1);
+	pthread_join(b->thread, NULL);
+	waveform_free(&b->wf);
+	free(b);
+	st->waveform = NULL;
+}
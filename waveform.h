@@ -0,0 +1,99 @@
+/*
+waveform overview of the current track
+
+a min/max/rms pyramid: level 0 holds one peak per WAVEFORM_BASE_FRAMES
+frames (every channel folded together), every level above one per two
+peaks of the level under it, so a track of any length is a few
+thousand peaks. an overview of any width is then O(width): each column
+takes the coarsest level whose peaks still fit in it, and combines the
+two or three peaks it covers
+
+the pyramid is built in one pass over the decoded track (the block
+kernel is sse2 or avx2 when the cpu has it) by a niced thread started
+when the player screen first shows a track, and kept in the cache
+directory next to the library index, so a track is only ever scanned
+once while its mtime and size don't change. nothing waits for it: the
+player draws the plain progress bar until it's ready
+
+layout of a cached pyramid:
+
+struct waveform_header
+struct waveform_peak[len] // level 0, the levels above are rebuilt
+*/
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include "types.h"
+
+#define WAVEFORM_MAGIC "WAVEFORM"
+#define WAVEFORM_VERSION 1
+#define WAVEFORM_BASE_FRAMES 4096 // frames per peak of level 0
+#define WAVEFORM_MAX_LEVELS 32
+#define WAVEFORM_NICE 10 // the build yields to playback
+
+// one bucket of frames, in S16 steps of full scale
+struct waveform_peak {
+	int16_t min;
+	int16_t max;
+	uint16_t rms; // 32767: a full scale square wave
+};
+
+struct waveform {
+	uint64_t frames; // of the track
+	size_t levels;
+	size_t len[WAVEFORM_MAX_LEVELS]; // peaks per level
+	struct waveform_peak* level[WAVEFORM_MAX_LEVELS]; // into peaks
+	struct waveform_peak* peaks;
+
+	// building: the level 0 peak being filled
+	size_t channels;
+	size_t fill; // frames in it
+	float min;
+	float max;
+	double sum; // of squares
+};
+
+struct waveform_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t base_frames;
+	int64_t mtime; // of the track, a changed track is scanned again
+	uint64_t size;
+	uint64_t frames;
+	uint64_t len; // level 0 peaks
+};
+
+// "scalar", "sse2" or "avx2"
+const char* waveform_kernel_name(void);
+
+// room for a track of frames frames, nothing added yet
+int waveform_init(struct waveform* wf, uint64_t frames, size_t channels);
+void waveform_free(struct waveform* wf);
+
+// the next n interleaved S32 frames of the track
+void waveform_add(struct waveform* wf, const int32_t* frames, size_t n);
+
+// closes the last peak and builds the levels above level 0
+void waveform_finish(struct waveform* wf);
+
+// columns peaks of frames [from, to) of the track, one per column
+void waveform_overview
+(
+	const struct waveform* wf,
+	uint64_t from,
+	uint64_t to,
+	size_t columns,
+	struct waveform_peak* out
+);
+
+// player screen: starts loading or building the pyramid of the track at
+// path (dropping the one of the track before), nothing if it's the same
+void waveform_request(struct player_state* st, const char* path, const struct wav_info* info);
+
+// the current track's pyramid, NULL until it's ready
+const struct waveform* waveform_current(struct player_state* st);
+
+void waveform_stop(struct player_state* st);
+
+#endif